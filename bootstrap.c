@@ -1,14 +1,17 @@
 #include "bootstrap.h"
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/time.h>
 #include <netinet/in.h>
 #include <event.h>
 #include <netdb.h>
-#include <pthread.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <stdbool.h>
 
 #include <signal.h>
 #include <errno.h>
@@ -16,13 +19,26 @@
 #include <arpa/inet.h>
 #include <sys/wait.h>
 
+#include "protocol_node.h"
+
 #define NODE_ADDITION_PORT "11311"
 #define METADATA_UPDATE_PORT "11312"
 #define NODE_DEPARTURE_PORT "11313"
-#define BACKLOG 10 // how many pending connections queue will hold
+#define ZONE_MAP_PORT "11314"
+#define BACKLOG 1024 // how many pending connections queue will hold
+
+/*
+ * The bootstrap is a single libevent loop serving all four ports, so joins,
+ * departures and zone map polls from any number of nodes are interleaved
+ * rather than queued behind one blocking accept per port. Every connection
+ * reads whole messages as they arrive and writes its replies from a buffer.
+ * The version changes with every update of nodes[].
+ */
+static struct event_base *main_base;
+static unsigned int zone_map_version = 1;
 
 
-void init_boundary(ZoneBoundary *b){
+static void init_boundary(ZoneBoundary *b){
     b->from.x = 0;
     b->from.y = 0;
     b->to.x = 0;
@@ -40,40 +56,8 @@ static void deserialize_boundary(char *s, ZoneBoundary *b) {
 	sscanf(s, "[(%f,%f) to (%f,%f)]", &(b->from.x), &(b->from.y), &(b->to.x),
 			&(b->to.y));
 }
-static void sigchld_handler(int s) {
-	while (waitpid(-1, NULL, WNOHANG) > 0);
-}
-
-// get sockaddr, IPv4 or IPv6:
-static void *get_in_addr(struct sockaddr *sa) {
-	if (sa->sa_family == AF_INET) {
-		return &(((struct sockaddr_in*) sa)->sin_addr);
-	}
-	return &(((struct sockaddr_in6*) sa)->sin6_addr);
-}
-
-static int receive_connection_from_client(int server_sock_fd, char *caller){
-    int new_fd; // listen on sock_fd, new connection on new_fd
-    struct sockaddr_storage their_addr; // connector's address information
-    socklen_t sin_size;
-    char s[INET6_ADDRSTRLEN];
-
-    fprintf(stderr,"%s : server: waiting for connections...\n",caller);
-    sin_size = sizeof their_addr;
-    new_fd = accept(server_sock_fd, (struct sockaddr *) &their_addr, &sin_size);
-    if (new_fd == -1) {
-        perror("accept");
-        exit(-1);
-    }
-
-    inet_ntop(their_addr.ss_family, get_in_addr((struct sockaddr *) &their_addr), s, sizeof s);
-    fprintf(stderr, "%s : server: got connection from %s\n",caller, s);
-    return new_fd;
-}
-
-static int listen_on(char *port,char *caller){
-    int sockfd=-1; // listen on sock_fd, new connection on new_fd
-	struct sigaction sa;
+static int listen_on(char *host,char *port,char *caller){
+    int sockfd=-1, flags;
    	struct addrinfo hints, *servinfo, *p;
    	int rv;
 
@@ -82,7 +66,7 @@ static int listen_on(char *port,char *caller){
     hints.ai_socktype = SOCK_STREAM;
     hints.ai_flags = INADDR_ANY;
 
-	if ((rv = getaddrinfo("localhost", port, &hints, &servinfo)) != 0) {
+	if ((rv = getaddrinfo(host, port, &hints, &servinfo)) != 0) {
         fprintf(stderr, "In %s, getaddrinfo: %s\n", caller, gai_strerror(rv));
         exit(-1);
     }
@@ -94,6 +78,8 @@ static int listen_on(char *port,char *caller){
             perror("listener: socket");
             continue;
         }
+        flags = 1;
+        setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, (void *) &flags, sizeof(flags));
         if (bind(sockfd, p->ai_addr, p->ai_addrlen) == -1) {
             close(sockfd);
             fprintf(stderr,"In %s,",caller);
@@ -113,33 +99,136 @@ static int listen_on(char *port,char *caller){
     exit(1);
     }
 
-    sa.sa_handler = sigchld_handler; // reap all dead processes
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = SA_RESTART;
-
-    if (sigaction(SIGCHLD, &sa, NULL ) == -1) {
+    if ((flags = fcntl(sockfd, F_GETFL, 0)) < 0 ||
+            fcntl(sockfd, F_SETFL, flags | O_NONBLOCK) < 0) {
     fprintf(stderr,"In %s,",caller);
-    perror("sigaction");
+    perror("setting O_NONBLOCK");
     exit(1);
     }
+    freeaddrinfo(servinfo);
 
     return sockfd;
 }
 
-static ZoneBoundary* _recv_boundary_from_neighbour(int child_fd) {
-	char buf[1024];
-	int MAXDATASIZE = 1024;
-	memset(buf, '\0', 1024);
-	if (recv(child_fd, buf, MAXDATASIZE-1, 0) == -1) {
-        perror("recv");
-        exit(1);
+/*
+ * Inter-node messages are framed as described in protocol_node.h, so the
+ * receiver always knows where a message ends.
+ */
+
+/* cas is left alone; only the nodes look at it and they convert it themselves. */
+static void node_header_hton(protocol_node_header *h) {
+    h->request.keylen = htons(h->request.keylen);
+    h->request.status = htons(h->request.status);
+    h->request.opaque = htonl(h->request.opaque);
+    h->request.vallen = htonl(h->request.vallen);
+    h->request.flags = htonl(h->request.flags);
+    h->request.exptime = htonl(h->request.exptime);
+}
+
+static void node_header_ntoh(protocol_node_header *h) {
+    h->request.keylen = ntohs(h->request.keylen);
+    h->request.status = ntohs(h->request.status);
+    h->request.opaque = ntohl(h->request.opaque);
+    h->request.vallen = ntohl(h->request.vallen);
+    h->request.flags = ntohl(h->request.flags);
+    h->request.exptime = ntohl(h->request.exptime);
+}
+
+enum bootstrap_service {
+    NODE_ADDITION,
+    METADATA_UPDATE,
+    NODE_DEPARTURE,
+    ZONE_MAP
+};
+
+/*
+ * Messages to the bootstrap are a handful of short strings, so a
+ * connection reads into a fixed buffer and gives up on anything larger.
+ */
+#define CONN_RBUF_SIZE 1024
+
+typedef struct bootstrap_conn {
+    int fd;
+    enum bootstrap_service service;
+    struct event event;
+    short ev_flags;
+    char rbuf[CONN_RBUF_SIZE];
+    size_t rbytes;
+    char *wbuf;             /* replies not written yet */
+    size_t wsize;
+    size_t wbytes;
+    size_t wsent;
+    int step;               /* messages of the exchange handled so far */
+    bool replied;           /* close once the peer has read the replies */
+    ZoneBoundary boundary;  /* sent just before the ports it belongs to */
+} bootstrap_conn;
+
+static void conn_handler(const int fd, const short which, void *arg);
+
+static bool conn_update_event(bootstrap_conn *c, short flags) {
+    if (c->ev_flags == flags)
+        return true;
+    if (c->ev_flags != 0)
+        event_del(&c->event);
+    event_set(&c->event, c->fd, flags | EV_PERSIST, conn_handler, c);
+    event_base_set(main_base, &c->event);
+    c->ev_flags = flags;
+    return event_add(&c->event, 0) != -1;
+}
+
+static void conn_close(bootstrap_conn *c) {
+    if (c->ev_flags != 0)
+        event_del(&c->event);
+    close(c->fd);
+    free(c->wbuf);
+    free(c);
+}
+
+static bool conn_reserve(bootstrap_conn *c, size_t len) {
+    if (c->wbytes + len > c->wsize) {
+        size_t size = c->wsize ? c->wsize : 1024;
+        char *wbuf;
+        while (size < c->wbytes + len)
+            size *= 2;
+        if ((wbuf = realloc(c->wbuf, size)) == NULL)
+            return false;
+        c->wbuf = wbuf;
+        c->wsize = size;
     }
-	ZoneBoundary *child_boundary = (ZoneBoundary *) malloc(sizeof(ZoneBoundary));
-	deserialize_boundary(buf, child_boundary);
-	fprintf(stderr,"Received %s\n",buf);
-	return child_boundary;
+    return true;
+}
+
+static bool conn_queue(bootstrap_conn *c, const void *buf, size_t len) {
+    if (!conn_reserve(c, len))
+        return false;
+    memcpy(c->wbuf + c->wbytes, buf, len);
+    c->wbytes += len;
+    return true;
 }
 
+/* Frames a control message whose value is a string, e.g. a serialized boundary. */
+static size_t node_frame_message(char *out, uint8_t opcode, const char *text) {
+    protocol_node_header h;
+    size_t vallen = text ? strlen(text) : 0;
+
+    memset(&h, 0, sizeof(h));
+    h.request.magic = PROTOCOL_NODE_REQ;
+    h.request.opcode = opcode;
+    h.request.vallen = vallen;
+    node_header_hton(&h);
+    memcpy(out, h.bytes, sizeof(h.bytes));
+    if (vallen)
+        memcpy(out + sizeof(h.bytes), text, vallen);
+    return sizeof(h.bytes) + vallen;
+}
+
+static bool node_queue_message(bootstrap_conn *c, uint8_t opcode, const char *text) {
+    size_t len = sizeof(protocol_node_header) + (text ? strlen(text) : 0);
+    if (!conn_reserve(c, len))
+        return false;
+    c->wbytes += node_frame_message(c->wbuf + c->wbytes, opcode, text);
+    return true;
+}
 
 static float calculate_area(ZoneBoundary bounds)
 {
@@ -157,319 +246,528 @@ static float calculate_area(ZoneBoundary bounds)
 
 /// End of functions common to kmain.c
 
-static int find_port(){
-	struct addrinfo hints, *servinfo, *p;
-		int rv,addrlen;
-		int socket_descriptor=0,portno;
-		memset(&hints, 0, sizeof hints);
-		hints.ai_family = AF_INET;
-		hints.ai_socktype = SOCK_STREAM;
-		hints.ai_flags = INADDR_ANY;
-		struct sockaddr_in serv_addr;
-	int input_portno = 0;
-	char portnoString[10];
-		sprintf(portnoString,"%i", input_portno);
-
-		if ((rv = getaddrinfo(NULL, portnoString, &hints, &servinfo)) != 0) {
-				fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
-				//return 1;
-		}
-
-		// loop through all the results and bind to the first we can
-		for(p = servinfo; p != NULL; p = p->ai_next) {
-			if ((socket_descriptor = socket(p->ai_family, p->ai_socktype,
-					p->ai_protocol)) == -1) {
-					perror("listener: socket");
-					continue;
-			}
-			if (bind(socket_descriptor, p->ai_addr, p->ai_addrlen) == -1) {
-				close(socket_descriptor);
-				perror("listener: bind");
-				continue;
-			}
-			break;
-		}
-		if (p == NULL) {
-			fprintf(stderr, "listener: failed to bind socket\n");
-			//return 2;
-		}
-		addrlen = sizeof(serv_addr);
-		int getsock_check=getsockname(socket_descriptor,(struct sockaddr *)&serv_addr, (socklen_t *)&addrlen) ;
-
-		   	if (getsock_check== -1) {
-		   			perror("getsockname");
-		   			exit(1);
-		   	}
-		portno =  ntohs(serv_addr.sin_port);
-        	fprintf(stderr, "The actual port number is %d\n", portno);
-		freeaddrinfo(servinfo);
-		close(socket_descriptor);
-		return portno;
-
-}
-
-static int cluster_has_nodes(){
+/* Appends a node with no zone yet, growing the table if it is full. */
+static int node_add(char *address){
     int counter;
-    for(counter=0;counter<10;counter++)
+    if(node_count==node_slots)
     {
-        if(strcmp(nodes[0].join_request,"NULL")!=0)
+        int slots = node_slots ? node_slots*2 : 16;
+        node_info *table = realloc(nodes,slots*sizeof(node_info));
+        if(table==NULL)
         {
-            //found a node in the list
-            return 1;
+            fprintf(stderr,"Failed to grow the node table to %d entries\n",slots);
+            return -1;
         }
+        nodes=table;
+        node_slots=slots;
     }
-    // Did not find any node in the list
-    return -1;
+    counter=node_count++;
+    memset(&nodes[counter],0,sizeof(node_info));
+    snprintf(nodes[counter].join_request,sizeof(nodes[counter].join_request),"%s",address);
+    strcpy(nodes[counter].request_propogation,"NULL");
+    strcpy(nodes[counter].client,"NULL");
+    init_boundary(&nodes[counter].boundary);
+    return counter;
+}
+
+/* The last node takes the removed one's slot, so the table stays dense. */
+static void node_remove(int counter){
+    nodes[counter]=nodes[--node_count];
+    zone_map_version++;
+}
+
+/* Bytes held per unit of capacity weight, how full a node is */
+static double node_fill(int counter){
+    uint64_t capacity = nodes[counter].load.capacity;
+    return (double)nodes[counter].load.bytes/(capacity ? capacity : 1);
 }
 
+/*
+ * A joining node takes part of its target's zone, so send it to the member
+ * carrying the most: its share of the cluster's fill (bytes per capacity),
+ * of the requests per second and of the evictions, as reported with the
+ * zone map polls. Until
+ * any load has been reported the largest zone is used. The target's load is
+ * halved right away, so joins arriving before its next report spread out.
+ */
 static int find_node_to_join(){
 
-	int port;
 	int counter;
 	float max=-99999;
-	float area;
-	int final_counter;
+	float score;
+	int final_counter=0;
+	double bytes=0,requests=0,evictions=0;	/* bytes sums the fills */
 
-	for(counter=0;counter<10;counter++)
+	for(counter=0;counter<node_count;counter++)
 	{
-		area = calculate_area(nodes[counter].boundary);
-		if(max<area)
-		{
-			max = area;
-			final_counter=counter;
-		}
+		bytes+=node_fill(counter);
+		requests+=nodes[counter].load.get_rate+nodes[counter].load.set_rate;
+		evictions+=nodes[counter].load.eviction_rate;
 	}
-	port=atoi(nodes[final_counter].join_request);
-	return port;
-
-}
-
-static void save_port_number(int port){
-	int counter;
-
-	for(counter=0;counter<10;counter++)
+	for(counter=0;counter<node_count;counter++)
 	{
-		if(!strcmp(nodes[counter].join_request,"NULL"))
+		if(bytes==0 && requests==0 && evictions==0)
+			score = calculate_area(nodes[counter].boundary);
+		else
 		{
-			sprintf(nodes[counter].join_request,"%d",port);
-			break;
+			score=0;
+			if(bytes>0)
+				score+=node_fill(counter)/bytes;
+			if(requests>0)
+				score+=(nodes[counter].load.get_rate+nodes[counter].load.set_rate)/requests;
+			if(evictions>0)
+				score+=nodes[counter].load.eviction_rate/evictions;
+		}
+		if(max<score)
+		{
+			max = score;
+			final_counter=counter;
 		}
 	}
+	nodes[final_counter].load.items/=2;
+	nodes[final_counter].load.bytes/=2;
+	nodes[final_counter].load.get_rate/=2;
+	nodes[final_counter].load.set_rate/=2;
+	nodes[final_counter].load.eviction_rate/=2;
+	fprintf(stderr,"join target %s: %llu items, %llu bytes, %.1f gets/s, %.1f sets/s, %.1f evictions/s before the split\n",
+	        nodes[final_counter].join_request,
+	        (unsigned long long)nodes[final_counter].load.items*2,
+	        (unsigned long long)nodes[final_counter].load.bytes*2,
+	        nodes[final_counter].load.get_rate*2,
+	        nodes[final_counter].load.set_rate*2,
+	        nodes[final_counter].load.eviction_rate*2);
+	return final_counter;
+
 }
 
 
 static void print_list_of_nodes_in_cluster(){
 	int counter;
     fprintf(stderr,"List of nodes in the cluster:\n");
-	for(counter=0;counter<10;counter++)
+	for(counter=0;counter<node_count;counter++)
 	{
-		if(strcmp(nodes[counter].join_request,"NULL"))
-		{
-		    fprintf(stderr,"\t%d: (%s,[(%f,%f) to (%f,%f)])\n",
-		            (counter+1),nodes[counter].join_request,
-		            nodes[counter].boundary.from.x,
-		            nodes[counter].boundary.from.y,
-		            nodes[counter].boundary.to.x,
-		            nodes[counter].boundary.to.y);
-		}
+	    fprintf(stderr,"\t%d: (%s,[(%f,%f) to (%f,%f)])\n",
+	            (counter+1),nodes[counter].join_request,
+	            nodes[counter].boundary.from.x,
+	            nodes[counter].boundary.from.y,
+	            nodes[counter].boundary.to.x,
+	            nodes[counter].boundary.to.y);
 	}
 	fprintf(stderr,"End of list\n");
 }
 
-static void *node_addition_routine(void *arg){
-    fprintf(stderr,"Node addition thread started\n");
-    int sockfd, new_fd; // listen on sock_fd, new connection on new_fd
-    int port,port_to_join;
-    char portnum[255];
+/*
+ * A new node sends the address of its join port; it is told the world and
+ * whom to join.
+ */
+static bool node_addition_message(bootstrap_conn *c,protocol_node_header *h,char *buf){
+    char address[NODE_ADDR_LEN];
     char str[1024];
 
-    sockfd  = listen_on(NODE_ADDITION_PORT,"node_addition_routine");
-    printf("node_addition_routine, port %s: waiting for connections...\n",NODE_ADDITION_PORT);
-    
-    while(1) { // main accept() loop
-        new_fd = receive_connection_from_client(sockfd,"node_addition_routine");
-
-        //sending join_req_port
-        port=find_port();
-        sprintf(portnum,"%d",port);
-        if (send(new_fd,portnum,strlen(portnum), 0) == -1)
-        perror("send");
-        
-        serialize_boundary(world_boundary,str);
-        
-        usleep(1000);
-        //sending world boundary
-        if (send(new_fd,str,strlen(str), 0) == -1)
-        perror("send");
-        
-        usleep(1000);
-        
-        //sending whom to connect
-        if(cluster_has_nodes() == -1)
-        {
-            nodes[0].boundary=world_boundary;
-            sprintf(nodes[0].join_request,"%d",port);
-            sprintf(portnum,"%s %d","FIRST",0);
-            send(new_fd,portnum,strlen(portnum), 0);
-        }
-        else{
-            port_to_join=find_node_to_join();
-            save_port_number(port);
-            sprintf(portnum,"%s %d","NOTFIRST",port_to_join);
-            send(new_fd,portnum,strlen(portnum), 0);
-        }
-        close(new_fd); // parent doesn't need this
-        print_list_of_nodes_in_cluster();
+    if(h->request.opcode!=PROTOCOL_NODE_CMD_PORTS || sscanf(buf,"%63s",address)!=1)
+    {
+        fprintf(stderr,"node addition: expected the join address, received %x\n",h->request.opcode);
+        return false;
     }
-    return 0;
+
+    //sending world boundary
+    serialize_boundary(world_boundary,str);
+    node_queue_message(c,PROTOCOL_NODE_CMD_BOUNDARY,str);
+
+    //sending whom to connect
+    if(node_count==0)
+    {
+        if(node_add(address)==-1)
+            return false;
+        nodes[0].boundary=world_boundary;
+        sprintf(str,"%s %s","FIRST","-");
+    }
+    else{
+        sprintf(str,"%s %s","NOTFIRST",nodes[find_node_to_join()].join_request);
+        if(node_add(address)==-1)
+            return false;
+    }
+    if(!node_queue_message(c,PROTOCOL_NODE_CMD_JOIN_TARGET,str))
+        return false;
+    c->replied=true;
+    print_list_of_nodes_in_cluster();
+    return true;
 }
 
-static void save_boundaries(char *port_number,ZoneBoundary b){
-	int counter;
-	for(counter=0;counter<10;counter++)
-	{
-		if(!strcmp(nodes[counter].join_request,port_number))
-		{
-			nodes[counter].boundary.from.x=b.from.x;
-			nodes[counter].boundary.from.y=b.from.y;
-			nodes[counter].boundary.to.x=b.to.x;
-			nodes[counter].boundary.to.y=b.to.y;
-			break;
-		}
-	}
+/*
+ * A node is named by its join request address, or by its request
+ * propagation address when the sender doesn't know the join address.
+ */
+static int is_node(int counter,char *port_number,char *propagation_port_number){
+    if(strcmp(nodes[counter].join_request,port_number)==0)
+        return 1;
+    return strcmp(propagation_port_number,"NULL")!=0 &&
+            strcmp(nodes[counter].request_propogation,propagation_port_number)==0;
 }
 
-static void remove_node(char *port_number,ZoneBoundary b){
-	int counter;
-	for(counter=0;counter<10;counter++)
+/* Index of the node named by these addresses, or -1. */
+static int node_find(char *port_number,char *propagation_port_number){
+    int counter;
+    for(counter=0;counter<node_count;counter++)
+    {
+        if(is_node(counter,port_number,propagation_port_number))
+            return counter;
+    }
+    return -1;
+}
+
+static void save_boundaries(char *port_number,char *propagation_port_number,ZoneBoundary b){
+	int counter=node_find(port_number,propagation_port_number);
+	if(counter==-1)
+	    return;
+	nodes[counter].boundary=b;
+	if(strcmp(propagation_port_number,"NULL"))
+	    strcpy(nodes[counter].request_propogation,propagation_port_number);
+	zone_map_version++;
+}
+
+static void remove_node(char *port_number,char *propagation_port_number){
+	int counter=0;
+	while(counter<node_count)
 	{
-		if(!strcmp(nodes[counter].join_request,port_number))
-		{
-			strcpy(nodes[counter].join_request,"NULL");
-			init_boundary(&nodes[counter].boundary);
-		}
+		if(is_node(counter,port_number,propagation_port_number))
+			node_remove(counter);
+		else
+			counter++;
 	}
 }
 
-static void *metadata_update_routine(void *arg){
-    fprintf(stderr,"metadata_update_routine started\n");
-    int sockfd, new_fd; // listen on sock_fd, new connection on new_fd
-    int numbytes;
-    char buf[1024],port_number[255],parent_port_number[255];
-    ZoneBoundary my_boundary,parent_boundary;
+/* PORTS messages carry the join request address and, if known, the request propagation address */
+static void parse_ports(char *buf,char *port_number,char *propagation_port_number){
+    strcpy(port_number,"NULL");
+    strcpy(propagation_port_number,"NULL");
+    sscanf(buf,"%63s %63s",port_number,propagation_port_number);
+}
 
-    sockfd = listen_on(METADATA_UPDATE_PORT,"metadata_update_routine");
-	printf("metadata_update_routine, port %s: waiting for connections...\n", METADATA_UPDATE_PORT);
+/*
+ * After a split or a departure a node sends its own boundary and addresses,
+ * then its parent's: BOUNDARY, PORTS, BOUNDARY, PORTS. A departing node is
+ * removed and the parent that took over its zone is updated.
+ */
+static bool membership_message(bootstrap_conn *c,protocol_node_header *h,char *buf){
+    char port_number[NODE_ADDR_LEN],propagation_port_number[NODE_ADDR_LEN];
+    uint8_t expected = c->step%2==0 ? PROTOCOL_NODE_CMD_BOUNDARY : PROTOCOL_NODE_CMD_PORTS;
 
-    while(1) { // main accept() loop
-        new_fd = receive_connection_from_client(sockfd,"metadata_update_routine");
+    if(h->request.opcode!=expected)
+    {
+        fprintf(stderr,"membership update: expected message %x, received %x\n",expected,h->request.opcode);
+        return false;
+    }
+    if(expected==PROTOCOL_NODE_CMD_BOUNDARY)
+    {
+        deserialize_boundary(buf,&c->boundary);
+        fprintf(stderr,"Received %s\n",buf);
+    }
+    else
+    {
+        parse_ports(buf,port_number,propagation_port_number);
+        if(c->service==NODE_DEPARTURE && c->step==1)
+            remove_node(port_number,propagation_port_number);
+        else
+            save_boundaries(port_number,propagation_port_number,c->boundary);
+    }
+    if(++c->step<4)
+        return true;
+    print_list_of_nodes_in_cluster();
+    return false;
+}
 
-        //receiving child boundary
-        my_boundary = *(_recv_boundary_from_neighbour(new_fd));
-        
-        //receiving child port number
-        memset(buf, '\0', 1024);
-        if ((numbytes = recv(new_fd, buf,1024, 0)) == -1) {
-            perror("rec");
-            exit(1);
+/*
+ * Stores the load summary that comes with a zone map poll:
+ * "version join prop curr_items curr_bytes gets/s sets/s evictions/s capacity client".
+ * A node that joined first learns its propagation address only from here, and
+ * every node reports the address clients reach it at.
+ * Returns the zone map version the node has; a client that only wants the
+ * map sends nothing and gets all of it.
+ */
+static unsigned long record_load(char *buf){
+    unsigned long known_version=0;
+    unsigned long long items=0,bytes=0,capacity=0;
+    char port_number[NODE_ADDR_LEN],propagation_port_number[NODE_ADDR_LEN],client[64]="NULL";
+    node_load load;
+    int counter;
+
+    memset(&load,0,sizeof(load));
+    if(sscanf(buf,"%lu %63s %63s %llu %llu %f %f %f %llu %63s",&known_version,
+            port_number,propagation_port_number,&items,&bytes,
+            &load.get_rate,&load.set_rate,&load.eviction_rate,&capacity,client)<9)
+        return known_version;
+    load.items=items;
+    load.bytes=bytes;
+    load.capacity=capacity;
+    if((counter=node_find(port_number,propagation_port_number))==-1)
+        return known_version;
+    nodes[counter].load=load;
+    if(strcmp(nodes[counter].client,client)!=0)
+    {
+        strcpy(nodes[counter].client,client);
+        zone_map_version++;
+    }
+    if(strcmp(nodes[counter].request_propogation,"NULL")==0 &&
+            strcmp(propagation_port_number,"NULL")!=0)
+    {
+        strcpy(nodes[counter].request_propogation,propagation_port_number);
+        zone_map_version++;
+    }
+    return known_version;
+}
+
+/*
+ * The NODE_INFO entries of the zone map, framed and ready to send, so a
+ * poll costs one copy however large the cluster is. It is rebuilt the
+ * first time it is asked for after zone_map_version moves on.
+ */
+static struct {
+    unsigned int version;
+    char *buf;
+    size_t size;
+    size_t bytes;
+} snapshot;
+
+static bool zone_map_snapshot(void){
+    char entry[1024];
+    int counter;
+
+    if(snapshot.version==zone_map_version)
+        return true;
+    snapshot.bytes=0;
+    for(counter=0;counter<node_count;counter++)
+    {
+        size_t len;
+        if(strcmp(nodes[counter].request_propogation,"NULL")==0)
+            continue;
+        len=sprintf(entry,"%s %s (%f,%f) to (%f,%f) %llu %s",
+                nodes[counter].request_propogation,
+                "NULL",
+                nodes[counter].boundary.from.x,
+                nodes[counter].boundary.from.y,
+                nodes[counter].boundary.to.x,
+                nodes[counter].boundary.to.y,
+                (unsigned long long)nodes[counter].load.capacity,
+                nodes[counter].client);
+        len+=sizeof(protocol_node_header);
+        if(snapshot.bytes+len>snapshot.size)
+        {
+            size_t size=snapshot.size ? snapshot.size*2 : 4096;
+            char *buf;
+            while(size<snapshot.bytes+len)
+                size*=2;
+            if((buf=realloc(snapshot.buf,size))==NULL)
+                return false;
+            snapshot.buf=buf;
+            snapshot.size=size;
         }
-        
-        
-        sscanf(buf,"%s",port_number);
-        save_boundaries(port_number,my_boundary);
-        
-        //receiving parent boundary
-        parent_boundary = *(_recv_boundary_from_neighbour(new_fd));
-
-        
-        //receiving parent port
-        memset(buf, '\0', 1024);
-        if ((numbytes = recv(new_fd, buf,1024, 0)) == -1) {
-            perror("rec");
-            exit(1);
+        snapshot.bytes+=node_frame_message(snapshot.buf+snapshot.bytes,PROTOCOL_NODE_CMD_NODE_INFO,entry);
+    }
+    snapshot.version=zone_map_version;
+    return true;
+}
+
+/*
+ * Nodes poll the zone map port for the zone of every node so they can route
+ * a key straight to its owner. The request carries the version the node
+ * already has and its load; the entries are only sent when the version
+ * changed.
+ */
+static bool zone_map_message(bootstrap_conn *c,protocol_node_header *h,char *buf){
+    unsigned long known_version;
+
+    if(h->request.opcode!=PROTOCOL_NODE_CMD_ZONE_MAP)
+        return false;
+    known_version=record_load(buf);
+    sprintf(buf,"%u",zone_map_version);
+    node_queue_message(c,PROTOCOL_NODE_CMD_ZONE_MAP,buf);
+    if(known_version!=zone_map_version && zone_map_snapshot())
+        conn_queue(c,snapshot.buf,snapshot.bytes);
+    c->replied=true;
+    return node_queue_message(c,PROTOCOL_NODE_CMD_END,NULL);
+}
+
+/* Parses every whole message in rbuf. Returns false to close the connection. */
+static bool conn_parse(bootstrap_conn *c){
+    protocol_node_header h;
+    char value[CONN_RBUF_SIZE];
+    size_t len;
+    bool keep;
+
+    while(!c->replied && c->rbytes>=sizeof(h.bytes))
+    {
+        memcpy(h.bytes,c->rbuf,sizeof(h.bytes));
+        if(h.request.magic!=PROTOCOL_NODE_REQ && h.request.magic!=PROTOCOL_NODE_RES)
+        {
+            fprintf(stderr,"conn_parse: invalid magic %x\n",h.request.magic);
+            return false;
+        }
+        node_header_ntoh(&h);
+        len=sizeof(h.bytes)+h.request.keylen+h.request.vallen;
+        if(len>=CONN_RBUF_SIZE)
+        {
+            fprintf(stderr,"conn_parse: message of %u bytes is too large\n",h.request.vallen);
+            return false;
         }
-        
-        sscanf(buf,"%s",parent_port_number);
-        save_boundaries(parent_port_number,parent_boundary);
-        
-        close(new_fd); // parent doesn't need this
-        print_list_of_nodes_in_cluster();
+        if(c->rbytes<len)
+            break;
+        memcpy(value,c->rbuf+sizeof(h.bytes)+h.request.keylen,h.request.vallen);
+        value[h.request.vallen]='\0';
+        c->rbytes-=len;
+        memmove(c->rbuf,c->rbuf+len,c->rbytes);
+        if(c->service==ZONE_MAP)
+            keep=zone_map_message(c,&h,value);
+        else if(c->service==NODE_ADDITION)
+            keep=node_addition_message(c,&h,value);
+        else
+            keep=membership_message(c,&h,value);
+        if(!keep)
+            return false;
     }
+    return true;
 }
 
-static void *node_depature_routine(void *arg){
-    fprintf(stderr,"node_depature_routine started\n");
-    int sockfd, new_fd; // listen on sock_fd, new connection on new_fd
-    int numbytes;
-    char buf[1024],port_number[255],parent_port_number[255];
-    ZoneBoundary my_boundary,parent_boundary;
-    sockfd = listen_on(NODE_DEPARTURE_PORT,"node_depature_routine");
+/* Returns false once the peer has closed or the connection failed. */
+static bool conn_read(bootstrap_conn *c){
+    char scratch[CONN_RBUF_SIZE];
+    ssize_t res;
 
-    printf("node_depature_routine, port %s: waiting for connections...\n",NODE_DEPARTURE_PORT);
-    
-    while(1) { // main accept() loop
-        new_fd = receive_connection_from_client(sockfd,"node_depature_routin");
+    while(1)
+    {
+        /* after the replies only the close matters */
+        if(c->replied)
+            res=read(c->fd,scratch,sizeof(scratch));
+        else
+            res=read(c->fd,c->rbuf+c->rbytes,sizeof(c->rbuf)-c->rbytes);
+        if(res==0)
+            return false;
+        if(res==-1)
+        {
+            if(errno==EINTR)
+                continue;
+            return errno==EAGAIN || errno==EWOULDBLOCK;
+        }
+        if(c->replied)
+            continue;
+        c->rbytes+=res;
+        if(!conn_parse(c))
+            return false;
+    }
+}
 
-        //receiving child boundary
-        my_boundary = *(_recv_boundary_from_neighbour(new_fd));
+/*
+ * Returns false when the connection is done with. A zone map poller closes
+ * first, so the TIME_WAIT of every poll stays on its side rather than
+ * piling up here.
+ */
+static bool conn_write(bootstrap_conn *c){
+    ssize_t res;
 
-        
-        //receiving child port number
-        memset(buf, '\0', 1024);
-        if ((numbytes = recv(new_fd, buf,1024, 0)) == -1) {
-            perror("rec");
-            exit(1);
+    while(c->wsent<c->wbytes)
+    {
+        res=write(c->fd,c->wbuf+c->wsent,c->wbytes-c->wsent);
+        if(res==-1)
+        {
+            if(errno==EINTR)
+                continue;
+            return errno==EAGAIN || errno==EWOULDBLOCK;
         }
-        
-        fprintf(stderr,"\nchild portnum recv:%s\n",buf);
-        sscanf(buf,"%s",port_number);
-        remove_node(port_number,my_boundary);
-        
-        //receiving parent boundary
-        parent_boundary = *(_recv_boundary_from_neighbour(new_fd));
-
-        //receiving parent port
-        memset(buf, '\0', 1024);
-        if ((numbytes = recv(new_fd, buf,1024, 0)) == -1) {
-            perror("rec");
-            exit(1);
+        c->wsent+=res;
+    }
+    c->wsent=c->wbytes=0;
+    return !(c->replied && c->service==NODE_ADDITION);
+}
+
+static void conn_handler(const int fd, const short which, void *arg){
+    bootstrap_conn *c=arg;
+
+    if((which & EV_WRITE) && !conn_write(c))
+    {
+        conn_close(c);
+        return;
+    }
+    if((which & EV_READ) && !conn_read(c))
+    {
+        conn_close(c);
+        return;
+    }
+    /* replies queued by this read go out right away */
+    if(c->wbytes>c->wsent && !conn_write(c))
+    {
+        conn_close(c);
+        return;
+    }
+    if(!conn_update_event(c,c->wbytes>c->wsent ? EV_READ|EV_WRITE : EV_READ))
+        conn_close(c);
+}
+
+typedef struct bootstrap_listener {
+    char *port;
+    enum bootstrap_service service;
+    struct event event;
+} bootstrap_listener;
+
+static bootstrap_listener listeners[] = {
+    { NODE_ADDITION_PORT, NODE_ADDITION },
+    { METADATA_UPDATE_PORT, METADATA_UPDATE },
+    { NODE_DEPARTURE_PORT, NODE_DEPARTURE },
+    { ZONE_MAP_PORT, ZONE_MAP }
+};
+
+static void accept_handler(const int fd, const short which, void *arg){
+    bootstrap_listener *l=arg;
+    bootstrap_conn *c;
+    int sfd,flags;
+
+    while((sfd=accept(fd,NULL,NULL))!=-1)
+    {
+        if((flags=fcntl(sfd,F_GETFL,0))<0 ||
+                fcntl(sfd,F_SETFL,flags|O_NONBLOCK)<0 ||
+                (c=calloc(1,sizeof(bootstrap_conn)))==NULL)
+        {
+            close(sfd);
+            continue;
         }
-        
-        fprintf(stderr,"\nchild recv:%s\n",buf);
-        sscanf(buf,"%s",parent_port_number);
-        
-        save_boundaries(parent_port_number,parent_boundary);
-        
-        close(new_fd); // parent doesn't need this
-        print_list_of_nodes_in_cluster();
+        c->fd=sfd;
+        c->service=l->service;
+        /* zone map polls are frequent, so don't log every connection */
+        if(l->service!=ZONE_MAP)
+            fprintf(stderr,"server: got connection on port %s\n",l->port);
+        if(!conn_update_event(c,EV_READ))
+            conn_close(c);
     }
+    if(errno!=EAGAIN && errno!=EWOULDBLOCK && errno!=EINTR)
+        perror("accept");
 }
 
-int main(void){
-	int i;
-	printf("Bootstrap running\n");
+/* The nodes reach the bootstrap at the host given as the only argument, localhost by default. */
+int main(int argc, char **argv){
+	int i,sockfd;
+	char *host = argc > 1 ? argv[1] : "localhost";
+	printf("Bootstrap running on %s\n",host);
 	world_boundary.from.x=0;
 	world_boundary.from.y=0;
 	world_boundary.to.x=50;
 	world_boundary.to.y=50;
-	
-	for(i =0 ;i < 10 ;i++)
-    {
-			strcpy(nodes[i].join_request,"NULL");
-			init_boundary(&nodes[i].boundary);
-    }
     print_list_of_nodes_in_cluster();
 
-    pthread_t node_addition_thread;
-    pthread_t metadata_update_thread;
-    pthread_t node_departure_thread;
-    
-    pthread_create(&node_addition_thread, 0,node_addition_routine,NULL);
-    pthread_create(&metadata_update_thread, 0,metadata_update_routine,NULL);
-    pthread_create(&node_departure_thread, 0,node_depature_routine,NULL);
-    pthread_join(node_addition_thread,NULL);
-    pthread_join(metadata_update_thread,NULL);
-    pthread_join(node_departure_thread,NULL);
+    /* a node that hangs up early must not take the bootstrap with it */
+    signal(SIGPIPE,SIG_IGN);
+    main_base=event_init();
+    for(i=0;i<sizeof(listeners)/sizeof(listeners[0]);i++)
+    {
+        sockfd=listen_on(host,listeners[i].port,"main");
+        event_set(&listeners[i].event,sockfd,EV_READ|EV_PERSIST,accept_handler,&listeners[i]);
+        event_base_set(main_base,&listeners[i].event);
+        if(event_add(&listeners[i].event,0)==-1)
+        {
+            perror("event_add");
+            exit(1);
+        }
+        printf("port %s: waiting for connections...\n",listeners[i].port);
+    }
+    fflush(stdout);
+    event_base_loop(main_base,0);
     return 0;
 }
-
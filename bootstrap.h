@@ -1,4 +1,4 @@
-#include <pthread.h>
+#include <stdint.h>
 
 typedef struct tagPoint{
     float x;
@@ -12,11 +12,28 @@ typedef struct tagZoneBoundary {
 } ZoneBoundary;
 ZoneBoundary world_boundary;
 
+/* What a node last reported about itself with its zone map poll */
+typedef struct tag_node_load{
+    uint64_t items;
+    uint64_t bytes;
+    float get_rate;
+    float set_rate;
+    float eviction_rate;
+    uint64_t capacity;
+}node_load;
+
+/* A node's ports are named by the "host:port" other nodes reach them at */
+#define NODE_ADDR_LEN 64
+
 typedef struct tag_node_info{
      ZoneBoundary boundary;
-    char join_request[10];
+    char join_request[NODE_ADDR_LEN];
+    char request_propogation[NODE_ADDR_LEN];
+    char client[64];    /* host:port clients reach the node at */
+    node_load load;
 
 }node_info;
-node_info nodes[10];
-
-
+/* The members of the cluster; the table doubles when it is full */
+node_info *nodes;
+int node_count;
+int node_slots;
@@ -429,3 +429,24 @@ uint32_t hash( const void *key, size_t length, const uint32_t initval)
 #else /* HASH_XXX_ENDIAN == 1 */
 #error Must define HASH_BIG_ENDIAN or HASH_LITTLE_ENDIAN
 #endif /* HASH_XXX_ENDIAN == 1 */
+
+/*
+ * 64-bit hash used to place keys in the CAN world: FNV-1a, finished with
+ * the murmur3 mixer so that every bit of the key affects every bit of the
+ * result.
+ */
+uint64_t hash64(const void *key, size_t length) {
+    const uint8_t *k = key;
+    uint64_t h = 14695981039346656037ULL;
+
+    while (length-- > 0) {
+        h ^= *k++;
+        h *= 1099511628211ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
@@ -6,6 +6,7 @@ extern "C" {
 #endif
 
 uint32_t hash(const void *key, size_t length, const uint32_t initval);
+uint64_t hash64(const void *key, size_t length);
 
 #ifdef    __cplusplus
 }
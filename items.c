@@ -16,6 +16,8 @@
 /* Forward Declarations */
 static void item_link_q(item *it);
 static void item_unlink_q(item *it);
+static void item_link_cell(item *it);
+static void item_unlink_cell(item *it);
 
 /*
  * We only reposition items in the LRU queue if they haven't been repositioned
@@ -25,6 +27,24 @@ static void item_unlink_q(item *it);
 #define ITEM_UPDATE_INTERVAL 60
 
 #define LARGEST_ID POWER_LARGEST
+
+/*
+ * The linked items of one grid cell, in no particular order. An item keeps
+ * its slot in cell_pos and leaves by moving the last item into it. Items
+ * that found no room when the index couldn't grow are only counted, in
+ * cells_unindexed.
+ */
+typedef struct {
+    item **items;
+    uint32_t count;
+    uint32_t size;
+} cell_index;
+
+#define CELL_INDEX_INITIAL 16
+#define CELL_UNINDEXED UINT32_MAX
+
+/* Keys copied out of the cache per hold of cache_lock by a walk */
+#define ITEM_WALK_CHUNK 64
 typedef struct {
     uint64_t evicted;
     uint64_t evicted_nonzero;
@@ -38,6 +58,9 @@ typedef struct {
 
 static item *heads[LARGEST_ID];
 static item *tails[LARGEST_ID];
+static cell_index cells[ITEM_GRID_SIDE * ITEM_GRID_SIDE];
+static unsigned int cells_unindexed = 0;
+static uint64_t cell_bytes[ITEM_GRID_SIDE * ITEM_GRID_SIDE];
 static itemstats_t itemstats[LARGEST_ID];
 static unsigned int sizes[LARGEST_ID];
 
@@ -220,6 +243,11 @@ void item_free(item *it) {
     size_t ntotal = ITEM_ntotal(it);
     unsigned int clsid;
     assert((it->it_flags & ITEM_LINKED) == 0);
+    if (it->it_flags & ITEM_UNSLABBED) {
+        assert(it->refcount == 0);
+        free(it);
+        return;
+    }
     assert(it != heads[it->slabs_clsid]);
     assert(it != tails[it->slabs_clsid]);
     assert(it->refcount == 0);
@@ -231,6 +259,24 @@ void item_free(item *it) {
     slabs_free(it, ntotal, clsid);
 }
 
+/*
+ * Copies it into memory of its own, so it can be held without taking slab
+ * memory the -m limit gives to the items we store. The copy is unlinked,
+ * carries one reference, and item_free() hands it back to malloc.
+ */
+item *item_copy_unslabbed(item *it) {
+    size_t ntotal = ITEM_ntotal(it);
+    item *copy;
+
+    if ((copy = malloc(ntotal)) == NULL)
+        return NULL;
+    memcpy(copy, it, ntotal);
+    copy->next = copy->prev = copy->h_next = NULL;
+    copy->refcount = 1;
+    copy->it_flags = (it->it_flags & ITEM_CAS) | ITEM_UNSLABBED;
+    return copy;
+}
+
 /**
  * Returns true if an item will fit in the cache (its size does not exceed
  * the maximum for a cache entry.)
@@ -289,9 +335,62 @@ static void item_unlink_q(item *it) {
     return;
 }
 
+/*
+ * The grid splits the world into ITEM_GRID_SIDE cells along each axis. A
+ * key's cell is taken from the same hash64() halves as its point (see
+ * key_point() in memcached.c), so a zone boundary maps onto a range of
+ * cells and its keys can be listed without looking at the rest.
+ */
+static uint16_t item_cell(item *it) {
+    uint64_t h = hash64(ITEM_key(it), it->nkey);
+    unsigned int x = (uint32_t)(h >> 32) >> (32 - ITEM_GRID_BITS);
+    unsigned int y = (uint32_t)h >> (32 - ITEM_GRID_BITS);
+    return y * ITEM_GRID_SIDE + x;
+}
+
+static void item_link_cell(item *it) {
+    cell_index *cell = &cells[it->cell];
+
+    cell_bytes[it->cell] += ITEM_ntotal(it);
+    if (cell->count == cell->size) {
+        uint32_t size = cell->size ? cell->size * 2 : CELL_INDEX_INITIAL;
+        item **grown = realloc(cell->items, size * sizeof(item *));
+        if (grown == NULL) {
+            it->cell_pos = CELL_UNINDEXED;
+            cells_unindexed++;
+            return;
+        }
+        cell->items = grown;
+        cell->size = size;
+    }
+    it->cell_pos = cell->count;
+    cell->items[cell->count++] = it;
+}
+
+static void item_unlink_cell(item *it) {
+    cell_index *cell = &cells[it->cell];
+    item **shrunk;
+
+    cell_bytes[it->cell] -= ITEM_ntotal(it);
+    if (it->cell_pos == CELL_UNINDEXED) {
+        cells_unindexed--;
+        return;
+    }
+    assert(cell->items[it->cell_pos] == it);
+    cell->items[it->cell_pos] = cell->items[--cell->count];
+    cell->items[it->cell_pos]->cell_pos = it->cell_pos;
+    /* cells a split emptied give most of their index back */
+    if (cell->size > CELL_INDEX_INITIAL && cell->count < cell->size / 4 &&
+            (shrunk = realloc(cell->items, cell->size / 2 * sizeof(item *))) != NULL) {
+        cell->items = shrunk;
+        cell->size /= 2;
+    }
+}
+
 int do_item_link(item *it, const uint32_t hv) {
     MEMCACHED_ITEM_LINK(ITEM_key(it), it->nkey, it->nbytes);
     assert((it->it_flags & (ITEM_LINKED|ITEM_SLABBED)) == 0);
+    it->cell = item_cell(it);
     mutex_lock(&cache_lock);
     it->it_flags |= ITEM_LINKED;
     it->time = current_time;
@@ -306,6 +405,7 @@ int do_item_link(item *it, const uint32_t hv) {
     ITEM_set_cas(it, (settings.use_cas) ? get_cas_id() : 0);
     assoc_insert(it, hv);
     item_link_q(it);
+    item_link_cell(it);
     refcount_incr(&it->refcount);
     mutex_unlock(&cache_lock);
 
@@ -323,6 +423,7 @@ void do_item_unlink(item *it, const uint32_t hv) {
         STATS_UNLOCK();
         assoc_delete(ITEM_key(it), it->nkey, hv);
         item_unlink_q(it);
+        item_unlink_cell(it);
         do_item_remove(it);
     }
     mutex_unlock(&cache_lock);
@@ -339,6 +440,7 @@ void do_item_unlink_nolock(item *it, const uint32_t hv) {
         STATS_UNLOCK();
         assoc_delete(ITEM_key(it), it->nkey, hv);
         item_unlink_q(it);
+        item_unlink_cell(it);
         do_item_remove(it);
     }
 }
@@ -425,6 +527,79 @@ void item_stats_evictions(uint64_t *evicted) {
     mutex_unlock(&cache_lock);
 }
 
+/*
+ * Calls fn with the key of every linked item, a chunk of keys per hold of
+ * the cache lock, as item_foreach_key_in_cells() does over the whole grid.
+ */
+void item_foreach_key(void (*fn)(const char *key, const size_t nkey, void *arg), void *arg) {
+    item_foreach_key_in_cells(0, ITEM_GRID_SIDE, 0, ITEM_GRID_SIDE, fn, arg);
+}
+
+static bool in_cells(const item *it, const unsigned int x0, const unsigned int x1,
+                     const unsigned int y0, const unsigned int y1) {
+    unsigned int x = it->cell % ITEM_GRID_SIDE, y = it->cell / ITEM_GRID_SIDE;
+    return x >= x0 && x < x1 && y >= y0 && y < y1;
+}
+
+/*
+ * Like item_foreach_key, for the cells [x0, x1) x [y0, y1) of the grid, but
+ * the cache lock is only held to copy out ITEM_WALK_CHUNK keys at a time and
+ * fn runs without it. Each cell is walked from its last slot down, so an
+ * item linked during the walk may be missed, and one moved down by an
+ * unlink may be seen twice; none linked throughout is missed. If the index
+ * ever lacked room for an item, the LRUs are walked under the lock instead.
+ */
+void item_foreach_key_in_cells(const unsigned int x0, const unsigned int x1,
+                               const unsigned int y0, const unsigned int y1,
+                               void (*fn)(const char *key, const size_t nkey, void *arg), void *arg) {
+    char keys[ITEM_WALK_CHUNK][KEY_MAX_LENGTH];
+    uint8_t nkeys[ITEM_WALK_CHUNK];
+    unsigned int x, y, n, i;
+    uint32_t pos;
+    cell_index *cell;
+    item *it;
+
+    mutex_lock(&cache_lock);
+    if (cells_unindexed > 0) {
+        for (i = 0; i < LARGEST_ID; i++) {
+            for (it = heads[i]; it != NULL; it = it->next) {
+                if (in_cells(it, x0, x1, y0, y1))
+                    fn(ITEM_key(it), it->nkey, arg);
+            }
+        }
+        mutex_unlock(&cache_lock);
+        return;
+    }
+    mutex_unlock(&cache_lock);
+
+    for (y = y0; y < y1 && y < ITEM_GRID_SIDE; y++) {
+        for (x = x0; x < x1 && x < ITEM_GRID_SIDE; x++) {
+            cell = &cells[y * ITEM_GRID_SIDE + x];
+            pos = CELL_UNINDEXED;
+            do {
+                mutex_lock(&cache_lock);
+                if (pos > cell->count)
+                    pos = cell->count;
+                for (n = 0; pos > 0 && n < ITEM_WALK_CHUNK; n++) {
+                    it = cell->items[--pos];
+                    memcpy(keys[n], ITEM_key(it), it->nkey);
+                    nkeys[n] = it->nkey;
+                }
+                mutex_unlock(&cache_lock);
+                for (i = 0; i < n; i++)
+                    fn(keys[i], nkeys[i], arg);
+            } while (pos > 0);
+        }
+    }
+}
+
+/* Copies the bytes held in each cell, row by row, into bytes. */
+void item_grid_bytes(uint64_t *bytes) {
+    mutex_lock(&cache_lock);
+    memcpy(bytes, cell_bytes, sizeof(cell_bytes));
+    mutex_unlock(&cache_lock);
+}
+
 void do_item_stats_totals(ADD_STAT add_stats, void *c) {
     itemstats_t totals;
     memset(&totals, 0, sizeof(itemstats_t));
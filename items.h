@@ -4,6 +4,8 @@ uint64_t get_cas_id(void);
 /*@null@*/
 item *do_item_alloc(char *key, const size_t nkey, const int flags, const rel_time_t exptime, const int nbytes, const uint32_t cur_hv);
 void item_free(item *it);
+/*@null@*/
+item *item_copy_unslabbed(item *it);
 bool item_size_ok(const size_t nkey, const int flags, const int nbytes);
 
 int  do_item_link(item *it, const uint32_t hv);     /** may fail if transgresses limits */
@@ -26,3 +28,12 @@ item *do_item_touch(const char *key, const size_t nkey, uint32_t exptime, const
 void item_stats_reset(void);
 extern pthread_mutex_t cache_lock;
 void item_stats_evictions(uint64_t *evicted);
+void item_foreach_key(void (*fn)(const char *key, const size_t nkey, void *arg), void *arg);
+
+/* Linked items are also indexed by the cell of the world their key maps to. */
+#define ITEM_GRID_BITS 6
+#define ITEM_GRID_SIDE (1 << ITEM_GRID_BITS)
+void item_foreach_key_in_cells(const unsigned int x0, const unsigned int x1,
+                               const unsigned int y0, const unsigned int y1,
+                               void (*fn)(const char *key, const size_t nkey, void *arg), void *arg);
+void item_grid_bytes(uint64_t *bytes);
@@ -37,6 +37,7 @@
 #include <pwd.h>
 #include <sys/mman.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <errno.h>
@@ -79,6 +80,7 @@ static void conn_set_state(conn *c, enum conn_states state);
 static void stats_init(void);
 static void server_stats(ADD_STAT add_stats, conn *c);
 static void process_stat_settings(ADD_STAT add_stats, void *c);
+static void process_stat_cluster(ADD_STAT add_stats, void *c);
 
 
 /* defaults */
@@ -90,11 +92,43 @@ static void conn_close(conn *c);
 static void conn_init(void);
 static bool update_event(conn *c, const int new_flags);
 static void complete_nread(conn *c);
+static void complete_nread_node(conn *c);
+static void write_node_response(conn *c, uint16_t status, item *it);
 static void process_command(conn *c, char *command);
 static void write_and_free(conn *c, char *buf, int bytes);
 static int ensure_iov_space(conn *c);
 static int add_iov(conn *c, const void *buf, int len);
 static int add_msghdr(conn *c);
+static node_info get_neighbour_information(char *key);
+static int is_neighbour_info_not_valid(node_info n);
+static void deserialize_node_info(char *buf, node_info *n);
+static uint64_t capacity_weight(void);
+static void forward_abandon(conn *c);
+static void key_changed(conn *c, char *key);
+static bool key_in_other_zone(char *key);
+static bool handoff_moving(char *key);
+static void drop_stale_replicas(void);
+static int delete_key_locally(char *key);
+static bool handoff_hold_if_ours(char *key);
+static void handoff_release(void);
+static void handoff_key(conn *c, char *key);
+static bool bin_get_batch_key(conn *c, char *key, size_t nkey, item **it);
+static bool bin_get_batch_open(conn *c);
+static void bin_get_batch_close(conn *c);
+static void bin_get_batch_release(conn *c);
+static void bin_get_batch_free(conn *c);
+static void forward_key_to_owner(conn *c, uint8_t opcode, char *key, size_t nkey,
+        item *it, void (*completion)(conn *c));
+static void forward_arithmetic(conn *c, char *key, size_t nkey, bool incr, uint64_t delta,
+        uint64_t initial, uint32_t exptime, uint64_t cas, void (*completion)(conn *c));
+static void forward_touch(conn *c, char *key, size_t nkey, uint32_t exptime, void (*completion)(conn *c));
+static void complete_forwarded_store(conn *c);
+static void complete_forwarded_arithmetic(conn *c);
+static void complete_forwarded_touch(conn *c);
+static uint8_t node_store_opcode(int comm);
+static void complete_bin_forwarded(conn *c);
+static void complete_bin_forwarded_arithmetic(conn *c);
+static void complete_bin_forwarded_touch(conn *c);
 
 
 static void conn_free(conn *c);
@@ -120,17 +154,15 @@ enum transmit_result {
 
 static enum transmit_result transmit(conn *c);
 
-//IP address and port number of join node
-static char join_server_port_number[255];
-static char join_server_ip_address[255];
+//address of the node we join, and of the bootstrap's node addition port (-J)
+static char join_server_address[NODE_ADDR_LEN];
+static char bootstrap_address[NODE_ADDR_LEN];
 
 #define INVALID_START_TYPE -1
 #define START_AS_PARENT 1
 #define START_AS_CHILD 2
 static int starting_node_type = INVALID_START_TYPE;
 
-static my_list list_of_keys;
-static my_list trash_both;
 
 #define NORMAL_NODE 0
 #define SPLITTING_PARENT_INIT 1
@@ -143,8 +175,24 @@ static my_list trash_both;
 #define MERGING_CHILD_MIGRATING 8
 
 static int mode;
-static pthread_key_t set_command_to_execute_t;
-static pthread_key_t key_to_transfer_t;
+
+/* Our side of a split or merge that moves handoff_zone, see handoff_key() */
+#define HANDOFF_NONE 0
+#define HANDOFF_GIVING 1
+#define HANDOFF_TAKING 2
+
+static int handoff_role = HANDOFF_NONE;
+static ZoneBoundary handoff_zone;
+static node_info handoff_peer;
+/* signalled by handoff_end(), one handoff runs at a time */
+static pthread_mutex_t handoff_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t handoff_cond = PTHREAD_COND_INITIALIZER;
+/* read side held from an ownership check to the change it allows, see handoff_hold_if_ours() */
+#ifdef PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP
+static pthread_rwlock_t zone_lock = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+#else
+static pthread_rwlock_t zone_lock = PTHREAD_RWLOCK_INITIALIZER;
+#endif
 
 /* This reduces the latency without adding lots of extra wiring to be able to
  * notify the listener thread of when to listen again.
@@ -208,6 +256,10 @@ static void stats_init(void) {
 	stats.slabs_moved = 0;
 	stats.accepting_conns = true; /* assuming we start in this state. */
 	stats.slab_reassign_running = false;
+	stats.migration_running = false;
+	stats.migration_keys = stats.migration_bytes = 0;
+	stats.migration_keys_per_sec = stats.migration_bytes_per_sec = 0;
+	stats.near_cache_hits = stats.near_cache_items = stats.near_cache_bytes = 0;
 
 	/* make the time we started always be 2 seconds before we really
 	 did, so time(0) - time.started is never zero.  if so, things
@@ -258,6 +310,14 @@ static void settings_init(void) {
 	settings.slab_reassign = false;
 	settings.slab_automove = 0;
 	settings.shutdown_command = false;
+	settings.migration_rate = 0;
+	settings.capacity_weight = 0;
+	settings.replicas = 0;
+	settings.near_cache = 0;
+	settings.near_cache_ttl = 2;
+	settings.redirect = false;
+	settings.node_host = NULL;
+	settings.lazy_join = false;
 }
 
 /*
@@ -374,6 +434,9 @@ static const char *prot_text(enum protocol prot) {
 	case negotiating_prot:
 		rv = "auto-negotiate";
 		break;
+	case node_prot:
+		rv = "node";
+		break;
 	}
 	return rv;
 }
@@ -475,6 +538,7 @@ conn *conn_new(const int sfd, enum conn_states init_state,
 	c->write_and_go = init_state;
 	c->write_and_free = 0;
 	c->item = 0;
+	c->forwards = 0;
 
 	c->noreply = false;
 
@@ -520,6 +584,9 @@ static void conn_cleanup(conn *c) {
 		}
 	}
 
+	forward_abandon(c);
+	bin_get_batch_release(c);
+
 	if (c->write_and_free) {
 		free(c->write_and_free);
 		c->write_and_free = 0;
@@ -556,6 +623,7 @@ void conn_free(conn *c) {
 			free(c->suffixlist);
 		if (c->iov)
 			free(c->iov);
+		bin_get_batch_free(c);
 		free(c);
 	}
 }
@@ -655,7 +723,8 @@ static void conn_shrink(conn *c) {
 static const char *state_text(enum conn_states state) {
 	const char* const statenames[] = { "conn_listening", "conn_new_cmd",
 			"conn_waiting", "conn_read", "conn_parse_cmd", "conn_write",
-			"conn_nread", "conn_swallow", "conn_closing", "conn_mwrite" };
+			"conn_nread", "conn_swallow", "conn_closing", "conn_mwrite",
+			"conn_forwarding" };
 	return statenames[state];
 }
 
@@ -854,15 +923,23 @@ static void complete_nread_ascii(conn *c) {
 	item *it = c->item;
 	int comm = c->cmd;
 	enum store_item_type ret;
+	char key[KEY_MAX_LENGTH + 1];
 
 	pthread_mutex_lock(&c->thread->stats.mutex);
 	c->thread->stats.slab_stats[it->slabs_clsid].set_cmds++;
 	pthread_mutex_unlock(&c->thread->stats.mutex);
 
+	memcpy(key, ITEM_key(it), it->nkey);
+	key[it->nkey] = '\0';
 	if (strncmp(ITEM_data(it) + it->nbytes - 2, "\r\n", 2) != 0) {
 		out_string(c, "CLIENT_ERROR bad data chunk");
+	} else if (!handoff_hold_if_ours(key)) {
+		forward_key_to_owner(c, node_store_opcode(comm), key, it->nkey, it, complete_forwarded_store);
 	} else {
 		ret = store_item(it, comm, c);
+		handoff_release();
+		if (ret == STORED && mode == NORMAL_NODE)
+			key_changed(c, key);
 
 #ifdef ENABLE_DTRACE
 		uint64_t cas = ITEM_get_cas(it);
@@ -1013,6 +1090,9 @@ static void write_bin_error(conn *c, protocol_binary_response_status err,
 	case PROTOCOL_BINARY_RESPONSE_AUTH_ERROR:
 		errstr = "Auth failure.";
 		break;
+	case PROTOCOL_BINARY_RESPONSE_ETMPFAIL:
+		errstr = "Temporary failure.";
+		break;
 	default:
 		assert(false);
 		errstr = "UNHANDLED ERROR";
@@ -1059,6 +1139,8 @@ static void complete_incr_bin(conn *c) {
 	/* Weird magic in add_delta forces me to pad here */
 	char tmpbuf[INCR_MAX_STORAGE_LEN];
 	uint64_t cas = 0;
+	char zkey[KEY_MAX_LENGTH + 1];
+	bool changed = false;
 
 	protocol_binary_response_incr* rsp =
 			(protocol_binary_response_incr*) c->wbuf;
@@ -1090,9 +1172,19 @@ static void complete_incr_bin(conn *c) {
 	if (c->binary_header.request.cas != 0) {
 		cas = c->binary_header.request.cas;
 	}
+	memcpy(zkey, key, nkey);
+	zkey[nkey] = '\0';
+	if (!handoff_hold_if_ours(zkey)) {
+		forward_arithmetic(c, zkey, nkey, c->cmd == PROTOCOL_BINARY_CMD_INCREMENT,
+				req->message.body.delta, req->message.body.initial,
+				req->message.body.expiration, cas,
+				complete_bin_forwarded_arithmetic);
+		return;
+	}
 	switch (add_delta(c, key, nkey, c->cmd == PROTOCOL_BINARY_CMD_INCREMENT,
 			req->message.body.delta, tmpbuf, &cas)) {
 	case OK:
+		changed = true;
 		rsp->message.body.value = htonll(strtoull(tmpbuf, NULL, 10));
 		if (cas) {
 			c->cas = cas;
@@ -1119,6 +1211,7 @@ static void complete_incr_bin(conn *c) {
 						(unsigned long long) req->message.body.initial);
 
 				if (store_item(it, NREAD_ADD, c)) {
+					changed = true;
 					c->cas = ITEM_get_cas(it);
 					write_bin_response(c, &rsp->message.body, 0, 0,
 							sizeof(rsp->message.body.value));
@@ -1145,11 +1238,15 @@ static void complete_incr_bin(conn *c) {
 		write_bin_error(c, PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS, 0);
 		break;
 	}
+	handoff_release();
+	if (changed && mode == NORMAL_NODE)
+		key_changed(c, zkey);
 }
 
 static void complete_update_bin(conn *c) {
 	protocol_binary_response_status eno = PROTOCOL_BINARY_RESPONSE_EINVAL;
 	enum store_item_type ret = NOT_STORED;
+	char zkey[KEY_MAX_LENGTH + 1];
 	assert(c != NULL);
 
 	item *it = c->item;
@@ -1163,7 +1260,17 @@ static void complete_update_bin(conn *c) {
 	*(ITEM_data(it) + it->nbytes - 2) = '\r';
 	*(ITEM_data(it) + it->nbytes - 1) = '\n';
 
+	memcpy(zkey, ITEM_key(it), it->nkey);
+	zkey[it->nkey] = '\0';
+	if (!handoff_hold_if_ours(zkey)) {
+		forward_key_to_owner(c, node_store_opcode(c->cmd), zkey, it->nkey, it, complete_bin_forwarded);
+		item_remove(it);
+		c->item = 0;
+		return;
+	}
+
 	ret = store_item(it, c->cmd, c);
+	handoff_release();
 
 #ifdef ENABLE_DTRACE
 	uint64_t cas = ITEM_get_cas(it);
@@ -1194,6 +1301,8 @@ static void complete_update_bin(conn *c) {
 	switch (ret) {
 	case STORED:
 		/* Stored */
+		if (mode == NORMAL_NODE)
+			key_changed(c, zkey);
 		write_bin_response(c, NULL, 0, 0, 0);
 		break;
 	case EXISTS:
@@ -1217,26 +1326,9 @@ static void complete_update_bin(conn *c) {
 	c->item = 0;
 }
 
-static void process_bin_touch(conn *c) {
-	item *it;
-
+/* Answers a touch or GAT with it, which it takes over; NULL is a miss. */
+static void write_bin_touch(conn *c, item *it, char *key, size_t nkey) {
 	protocol_binary_response_get* rsp = (protocol_binary_response_get*) c->wbuf;
-	char* key = binary_get_key(c);
-	size_t nkey = c->binary_header.request.keylen;
-	protocol_binary_request_touch *t = binary_get_request(c);
-	time_t exptime = ntohl(t->message.body.expiration);
-
-	if (settings.verbose > 1) {
-		int ii;
-		/* May be GAT/GATQ/etc */
-		fprintf(stderr, "<%d TOUCH ", c->sfd);
-		for (ii = 0; ii < nkey; ++ii) {
-			fprintf(stderr, "%c", key[ii]);
-		}
-		fprintf(stderr, "\n");
-	}
-
-	it = item_touch(key, nkey, realtime(exptime));
 
 	if (it) {
 		/* the length has two unnecessary bytes ("\r\n") */
@@ -1309,6 +1401,39 @@ static void process_bin_touch(conn *c) {
 	}
 }
 
+static void process_bin_touch(conn *c) {
+	item *it;
+
+	char* key = binary_get_key(c);
+	size_t nkey = c->binary_header.request.keylen;
+	protocol_binary_request_touch *t = binary_get_request(c);
+	time_t exptime = ntohl(t->message.body.expiration);
+	char zkey[KEY_MAX_LENGTH + 1];
+
+	if (settings.verbose > 1) {
+		int ii;
+		/* May be GAT/GATQ/etc */
+		fprintf(stderr, "<%d TOUCH ", c->sfd);
+		for (ii = 0; ii < nkey; ++ii) {
+			fprintf(stderr, "%c", key[ii]);
+		}
+		fprintf(stderr, "\n");
+	}
+
+	memcpy(zkey, key, nkey);
+	zkey[nkey] = '\0';
+	if (!handoff_hold_if_ours(zkey)) {
+		forward_touch(c, zkey, nkey, exptime, complete_bin_forwarded_touch);
+		return;
+	}
+
+	it = item_touch(key, nkey, realtime(exptime));
+	handoff_release();
+	if (it && mode == NORMAL_NODE)
+		key_changed(c, zkey);
+	write_bin_touch(c, it, key, nkey);
+}
+
 static void process_bin_get(conn *c) {
 	item *it;
 
@@ -1325,7 +1450,16 @@ static void process_bin_get(conn *c) {
 		fprintf(stderr, "\n");
 	}
 
-	it = item_get(key, nkey);
+	if (bin_get_batch_key(c, key, nkey, &it)) {
+		/* quiet gets wait for the rest of the pipeline */
+		if (c->noreply)
+			conn_set_state(c, conn_new_cmd);
+		else
+			bin_get_batch_close(c);
+		return;
+	}
+	if (it == NULL)
+		it = item_get(key, nkey);
 	if (it) {
 		/* the length has two unnecessary bytes ("\r\n") */
 		uint16_t keylen = 0;
@@ -1511,6 +1645,8 @@ static void process_bin_stat(conn *c) {
 		stats_reset();
 	} else if (strncmp(subcommand, "settings", 8) == 0) {
 		process_stat_settings(&append_stats, c);
+	} else if (strncmp(subcommand, "cluster", 7) == 0) {
+		process_stat_cluster(&append_stats, c);
 	} else if (strncmp(subcommand, "detail", 6) == 0) {
 		char *subcmd_pos = subcommand + 6;
 		if (strncmp(subcmd_pos, " dump", 5) == 0) {
@@ -2170,17 +2306,26 @@ static void process_bin_delete(conn *c) {
 
 	char* key = binary_get_key(c);
 	size_t nkey = c->binary_header.request.keylen;
+	char zkey[KEY_MAX_LENGTH + 1];
+	bool deleted = false;
 
 	assert(c != NULL);
 
+	memcpy(zkey, key, nkey);
+	zkey[nkey] = '\0';
 	if (settings.verbose > 1) {
-		fprintf(stderr, "Deleting %s\n", key);
+		fprintf(stderr, "Deleting %s\n", zkey);
 	}
 
 	if (settings.detail_enabled) {
 		stats_prefix_record_delete(key, nkey);
 	}
 
+	if (!handoff_hold_if_ours(zkey)) {
+		forward_key_to_owner(c, PROTOCOL_NODE_CMD_DELETE, zkey, nkey, NULL, complete_bin_forwarded);
+		return;
+	}
+
 	it = item_get(key, nkey);
 	if (it) {
 		uint64_t cas = ntohll(req->message.header.request.cas);
@@ -2190,6 +2335,7 @@ static void process_bin_delete(conn *c) {
 			c->thread->stats.slab_stats[it->slabs_clsid].delete_hits++;
 			pthread_mutex_unlock(&c->thread->stats.mutex);
 			item_unlink(it);
+			deleted = true;
 			write_bin_response(c, NULL, 0, 0, 0);
 		} else {
 			write_bin_error(c, PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS, 0);
@@ -2201,6 +2347,9 @@ static void process_bin_delete(conn *c) {
 		c->thread->stats.delete_misses++;
 		pthread_mutex_unlock(&c->thread->stats.mutex);
 	}
+	handoff_release();
+	if (deleted && mode == NORMAL_NODE)
+		key_changed(c, zkey);
 }
 
 static void complete_nread_binary(conn *c) {
@@ -2252,6 +2401,7 @@ static void complete_nread_binary(conn *c) {
 static void reset_cmd_handler(conn *c) {
 	c->cmd = -1;
 	c->substate = bin_no_state;
+	c->forward_status = 0;
 	if (c->item != NULL ) {
 		item_remove(c->item);
 		c->item = NULL;
@@ -2266,12 +2416,14 @@ static void reset_cmd_handler(conn *c) {
 
 static void complete_nread(conn *c) {
 	assert(c != NULL);
-	assert(c->protocol == ascii_prot || c->protocol == binary_prot);
+	assert(c->protocol == ascii_prot || c->protocol == binary_prot || c->protocol == node_prot);
 
 	if (c->protocol == ascii_prot) {
 		complete_nread_ascii(c);
 	} else if (c->protocol == binary_prot) {
 		complete_nread_binary(c);
+	} else if (c->protocol == node_prot) {
+		complete_nread_node(c);
 	}
 }
 
@@ -2631,6 +2783,18 @@ static void server_stats(ADD_STAT add_stats, conn *c) {
 		APPEND_STAT("slab_reassign_running", "%u", stats.slab_reassign_running);
 		APPEND_STAT("slabs_moved", "%llu", stats.slabs_moved);
 	}
+	APPEND_STAT("migration_running", "%u", stats.migration_running);
+	APPEND_STAT("migration_keys", "%llu", (unsigned long long)stats.migration_keys);
+	APPEND_STAT("migration_bytes", "%llu", (unsigned long long)stats.migration_bytes);
+	APPEND_STAT("migration_keys_per_sec", "%llu",
+			(unsigned long long)stats.migration_keys_per_sec);
+	APPEND_STAT("migration_bytes_per_sec", "%llu",
+			(unsigned long long)stats.migration_bytes_per_sec);
+	if (settings.near_cache > 0) {
+		APPEND_STAT("near_cache_hits", "%llu", (unsigned long long)stats.near_cache_hits);
+		APPEND_STAT("near_cache_items", "%llu", (unsigned long long)stats.near_cache_items);
+		APPEND_STAT("near_cache_bytes", "%llu", (unsigned long long)stats.near_cache_bytes);
+	}
 	STATS_UNLOCK();
 }
 
@@ -2663,6 +2827,14 @@ static void process_stat_settings(ADD_STAT add_stats, void *c) {
 	APPEND_STAT("hashpower_init", "%d", settings.hashpower_init);
 	APPEND_STAT("slab_reassign", "%s", settings.slab_reassign ? "yes" : "no");
 	APPEND_STAT("slab_automove", "%d", settings.slab_automove);
+	APPEND_STAT("migration_rate", "%llu", (unsigned long long)settings.migration_rate);
+	APPEND_STAT("capacity_weight", "%llu", (unsigned long long)capacity_weight());
+	APPEND_STAT("replicas", "%d", settings.replicas);
+	APPEND_STAT("near_cache", "%llu", (unsigned long long)settings.near_cache);
+	APPEND_STAT("near_cache_ttl", "%d", settings.near_cache_ttl);
+	APPEND_STAT("redirect", "%s", settings.redirect ? "yes" : "no");
+	APPEND_STAT("node_host", "%s", settings.node_host);
+	APPEND_STAT("lazy_join", "%s", settings.lazy_join ? "yes" : "no");
 }
 
 static void process_stat(conn *c, token_t *tokens, const size_t ntokens) {
@@ -2691,6 +2863,8 @@ static void process_stat(conn *c, token_t *tokens, const size_t ntokens) {
 		return;
 	} else if (strcmp(subcommand, "settings") == 0) {
 		process_stat_settings(&append_stats, c);
+	} else if (strcmp(subcommand, "cluster") == 0) {
+		process_stat_cluster(&append_stats, c);
 	} else if (strcmp(subcommand, "cachedump") == 0) {
 		char *buf;
 		unsigned int bytes, id, limit = 0;
@@ -2741,21 +2915,34 @@ static void process_stat(conn *c, token_t *tokens, const size_t ntokens) {
 	}
 }
 
-static unsigned long str_hash(char *str) {
-	unsigned long hash = 5381;
-	int c;
-
-	while ((c = *str++) != '\0')
-		hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
+/*
+ * A coordinate is a fixed-point fraction of the world's side with
+ * KEY_POINT_BITS bits of resolution. While the side has no more than
+ * 24 - KEY_POINT_BITS significant bits (the default 50 has five), the product
+ * below is exact in a float: the point is a whole multiple of the side over
+ * 2^KEY_POINT_BITS and so falls inside [from, to). Zone cuts on grid columns
+ * are multiples of that step too, so no key is rounded across one.
+ */
+#define KEY_POINT_BITS 16
 
-	return hash;
+static float fixed_point_coordinate(uint32_t fraction, float from, float to) {
+	fraction >>= 32 - KEY_POINT_BITS;
+	return from + (to - from) * fraction / (float) (1 << KEY_POINT_BITS);
 }
+
+/*
+ * Keys are placed by hash64(); its two halves give independent coordinates,
+ * so keys spread over the whole world instead of along its diagonal.
+ */
 static Point key_point(char *key) {
 	Point p;
-	unsigned long hash = str_hash(key);
-	p.x = hash % (int) (world_boundary.to.x);
-	p.y = hash % (int) (world_boundary.to.y);
-	fprintf(stderr,"Key %s projects to (%f,%f)\n",key,p.x,p.y);
+	uint64_t hash = hash64(key, strlen(key));
+	p.x = fixed_point_coordinate((uint32_t) (hash >> 32),
+			world_boundary.from.x, world_boundary.to.x);
+	p.y = fixed_point_coordinate((uint32_t) hash,
+			world_boundary.from.y, world_boundary.to.y);
+	if (settings.verbose > 1)
+		fprintf(stderr,"Key %s projects to (%f,%f)\n",key,p.x,p.y);
 	return p;
 }
 
@@ -2782,68 +2969,155 @@ static void mylist_print(my_list *list) {
 
 static void mylist_init(char *name,my_list *list) {
 	list->size = 0;
+	list->capacity = 0;
+	list->array = NULL;
 	strcpy(list->name,name);
 }
 
+/* Appends a copy of v, doubling the array when it is full. */
 static void mylist_add(my_list *list, char* v) {
-	int new_size = list->size + 1;
-	char **new_array = (char**) malloc(sizeof(char*) * new_size);
-	int i = 0;
-	for (i = 0; i < new_size; i++) {
-		if (i == new_size - 1) {
-			new_array[i] = (char*) malloc(sizeof(char*) * strlen(v));
-			sprintf(new_array[i], "%s", v);
-		} else {
-			new_array[i] = (char*) malloc(
-					sizeof(char*) * strlen(list->array[i]));
-			sprintf(new_array[i], "%s", list->array[i]);
+	char *copy;
+	if (list->size == list->capacity) {
+		int capacity = list->capacity ? list->capacity * 2 : 16;
+		char **array = realloc(list->array, sizeof(char*) * capacity);
+		if (array == NULL) {
+			fprintf(stderr, "mylist_add: out of memory\n");
+			return;
 		}
+		list->array = array;
+		list->capacity = capacity;
 	}
-	list->size++;
-	list->array = new_array;
-	mylist_print(list);
+	if ((copy = strdup(v)) == NULL) {
+		fprintf(stderr, "mylist_add: out of memory\n");
+		return;
+	}
+	list->array[list->size++] = copy;
 }
 
 static void mylist_delete_all(my_list *list) {
-	list->size = 0;
+	int i;
+	for (i = 0; i < list->size; i++)
+		free(list->array[i]);
+	free(list->array);
 	list->array = NULL;
-	mylist_print(list);
+	list->size = list->capacity = 0;
 }
 
-static int mylist_contains(my_list *list, char *v) {
-	int i = 0;
-	for (i = 0; i < list->size; i++) {
-		if (strcmp(list->array[i], v) == 0) {
-			return 1;
-		}
-	}
-	return 0;
-}
-
-static void mylist_delete(my_list *list, char* v) {
-	if (mylist_contains(list, v) == 1) {
-		int new_size = list->size - 1;
-		char **new_array = (char**) malloc(sizeof(char*) * new_size);
-		int i = 0;
-		int detected = 0;
-		for (i = 0; i < list->size; i++) {
-			if (strcmp(list->array[i], v) == 0) {
-				detected = 1;
-				continue;
-			}
-			int index = i - detected;
-			new_array[index] = (char*) malloc(
-					sizeof(char*) * strlen(list->array[i]));
-			sprintf(new_array[index], "%s", list->array[i]);
-		}
-		list->size--;
-		list->array = new_array;
-	}
-	mylist_print(list);
+/*Ending list functions*/
 
+/*
+ * Keys of a zone that is changing hands whose copy on the node taking the
+ * zone over is final, so later copies from the old owner are dropped (see
+ * handoff_receive()). Tombstones are kept in a hash table and carry the
+ * epoch of the handoff that made them. Starting a new epoch forgets all
+ * older tombstones at once; they are freed as their buckets are walked.
+ */
+#define TOMBSTONE_HASHPOWER_INIT 10
+
+typedef struct tombstone {
+    struct tombstone *next;
+    unsigned int epoch;
+    uint8_t nkey;
+    char key[];
+} tombstone;
+
+typedef struct {
+    pthread_mutex_t lock;
+    unsigned int epoch;
+    unsigned int count;         /* tombstones allocated, of any epoch */
+    unsigned int hashpower;
+    tombstone **buckets;
+} tombstone_set;
+
+static tombstone_set handoff_settled = { PTHREAD_MUTEX_INITIALIZER, 1 };
+
+/* Returns the link pointing at key's tombstone, or at the end of its bucket. */
+static tombstone **tombstone_find(tombstone_set *set, const char *key, size_t nkey) {
+    uint32_t hv = hash(key, nkey, 0);
+    tombstone **slot = &set->buckets[hv & ((1U << set->hashpower) - 1)];
+
+    while (*slot != NULL) {
+        tombstone *t = *slot;
+        if (t->epoch != set->epoch) {
+            *slot = t->next;
+            free(t);
+            set->count--;
+            continue;
+        }
+        if (t->nkey == nkey && memcmp(t->key, key, nkey) == 0)
+            break;
+        slot = &t->next;
+    }
+    return slot;
+}
+
+/* Doubles the table, dropping tombstones of older epochs on the way. */
+static void tombstone_expand(tombstone_set *set) {
+    unsigned int hashpower = set->hashpower + 1;
+    tombstone **buckets = calloc(1U << hashpower, sizeof(tombstone *));
+    unsigned int i;
+
+    if (buckets == NULL)
+        return;
+    for (i = 0; i < (1U << set->hashpower); i++) {
+        tombstone *t = set->buckets[i], *next;
+        for (; t != NULL; t = next) {
+            next = t->next;
+            if (t->epoch != set->epoch) {
+                free(t);
+                set->count--;
+            } else {
+                uint32_t hv = hash(t->key, t->nkey, 0);
+                t->next = buckets[hv & ((1U << hashpower) - 1)];
+                buckets[hv & ((1U << hashpower) - 1)] = t;
+            }
+        }
+    }
+    free(set->buckets);
+    set->buckets = buckets;
+    set->hashpower = hashpower;
+}
+
+static int tombstone_contains(tombstone_set *set, char *key) {
+    int found = 0;
+    pthread_mutex_lock(&set->lock);
+    if (set->buckets != NULL)
+        found = *tombstone_find(set, key, strlen(key)) != NULL;
+    pthread_mutex_unlock(&set->lock);
+    return found;
+}
+
+/* Returns 0 if key already had a tombstone. */
+static int tombstone_add(tombstone_set *set, char *key) {
+    size_t nkey = strlen(key);
+    tombstone **slot, *t;
+    int added = 1;
+
+    pthread_mutex_lock(&set->lock);
+    if (set->buckets == NULL) {
+        set->hashpower = TOMBSTONE_HASHPOWER_INIT;
+        set->buckets = calloc(1U << set->hashpower, sizeof(tombstone *));
+    }
+    if (set->buckets != NULL && *(slot = tombstone_find(set, key, nkey)) != NULL) {
+        added = 0;
+    } else if (set->buckets != NULL && (t = malloc(sizeof(tombstone) + nkey)) != NULL) {
+        t->next = NULL;
+        t->epoch = set->epoch;
+        t->nkey = nkey;
+        memcpy(t->key, key, nkey);
+        *slot = t;
+        if (++set->count > (2U << set->hashpower))
+            tombstone_expand(set);
+    }
+    pthread_mutex_unlock(&set->lock);
+    return added;
 }
 
-/*Ending list functions*/
+static void tombstone_new_epoch(tombstone_set *set) {
+    pthread_mutex_lock(&set->lock);
+    set->epoch++;
+    pthread_mutex_unlock(&set->lock);
+}
 
 static void serialize_boundary(ZoneBoundary b, char *s) {
 	sprintf(s, "[(%f,%f) to (%f,%f)]", b.from.x, b.from.y, b.to.x, b.to.y);
@@ -2854,6 +3128,22 @@ static void deserialize_boundary(char *s, ZoneBoundary *b) {
 			&(b->to.y));
 }
 /// Start of functions common to bootstrap
+
+/*
+ * Splits a "host:port" address at its last colon. A bare port is taken to
+ * be on localhost, as ports were before nodes had hosts.
+ */
+static void split_address(const char *address, char *host, size_t hostlen, char *port, size_t portlen) {
+    const char *colon = strrchr(address, ':');
+    if (colon == NULL) {
+        snprintf(host, hostlen, "localhost");
+        snprintf(port, portlen, "%s", address);
+        return;
+    }
+    snprintf(host, hostlen, "%.*s", (int)(colon - address), address);
+    snprintf(port, portlen, "%s", colon + 1);
+}
+
 static void sigchld_handler(int s) {
 	while (waitpid(-1, NULL, WNOHANG) > 0);
 }
@@ -2885,18 +3175,20 @@ static int receive_connection_from_client(int server_sock_fd, char *caller){
     return new_fd;
 }
 
-static int listen_on(char *port,char *caller){
+static int listen_on(char *address,char *caller){
     int sockfd=-1; // listen on sock_fd, new connection on new_fd
 	struct sigaction sa;
    	struct addrinfo hints, *servinfo, *p;
    	int rv;
+   	char host[NODE_ADDR_LEN], port[NI_MAXSERV];
 
     memset(&hints, 0, sizeof hints);
     hints.ai_family = AF_INET;
     hints.ai_socktype = SOCK_STREAM;
     hints.ai_flags = INADDR_ANY;
 
-	if ((rv = getaddrinfo("localhost", port, &hints, &servinfo)) != 0) {
+    split_address(address, host, sizeof(host), port, sizeof(port));
+	if ((rv = getaddrinfo(host, port, &hints, &servinfo)) != 0) {
         fprintf(stderr, "In %s, getaddrinfo: %s\n", caller, gai_strerror(rv));
         exit(-1);
     }
@@ -2940,14 +3232,158 @@ static int listen_on(char *port,char *caller){
     return sockfd;
 }
 
-static ZoneBoundary* _recv_boundary_from_neighbour(int child_fd) {
-	char buf[1024];
-	int MAXDATASIZE = 1024;
-	memset(buf, '\0', 1024);
-	if (recv(child_fd, buf, MAXDATASIZE-1, 0) == -1) {
-        perror("recv");
+/*
+ * Inter-node messages are framed as described in protocol_node.h, so the
+ * receiver always knows where a message ends. Short reads and writes are
+ * retried; -1 means the connection is no longer usable.
+ */
+static int node_send_all(int fd, struct iovec *iov, int iovcnt) {
+    ssize_t res;
+    while (iovcnt > 0) {
+        res = writev(fd, iov, iovcnt);
+        if (res == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        while (iovcnt > 0 && (size_t)res >= iov->iov_len) {
+            res -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + res;
+            iov->iov_len -= res;
+        }
+    }
+    return 0;
+}
+
+static int node_recv_all(int fd, void *buf, size_t len) {
+    char *ptr = buf;
+    ssize_t res;
+    while (len > 0) {
+        res = recv(fd, ptr, len, 0);
+        if (res == 0)
+            return -1;
+        if (res == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        ptr += res;
+        len -= res;
+    }
+    return 0;
+}
+
+static int node_skip(int fd, size_t len) {
+    char scratch[1024];
+    while (len > 0) {
+        size_t chunk = len > sizeof(scratch) ? sizeof(scratch) : len;
+        if (node_recv_all(fd, scratch, chunk) == -1)
+            return -1;
+        len -= chunk;
+    }
+    return 0;
+}
+
+/* cas is left alone; only the nodes look at it and they convert it themselves. */
+static void node_header_hton(protocol_node_header *h) {
+    h->request.keylen = htons(h->request.keylen);
+    h->request.status = htons(h->request.status);
+    h->request.opaque = htonl(h->request.opaque);
+    h->request.vallen = htonl(h->request.vallen);
+    h->request.flags = htonl(h->request.flags);
+    h->request.exptime = htonl(h->request.exptime);
+}
+
+static void node_header_ntoh(protocol_node_header *h) {
+    h->request.keylen = ntohs(h->request.keylen);
+    h->request.status = ntohs(h->request.status);
+    h->request.opaque = ntohl(h->request.opaque);
+    h->request.vallen = ntohl(h->request.vallen);
+    h->request.flags = ntohl(h->request.flags);
+    h->request.exptime = ntohl(h->request.exptime);
+}
+
+/* h is in host order; keylen and vallen give the size of key and value. */
+static int node_send_packet(int fd, protocol_node_header *h, const char *key, const char *value) {
+    protocol_node_header wire = *h;
+    struct iovec iov[3];
+    int iovcnt = 1;
+
+    node_header_hton(&wire);
+    iov[0].iov_base = wire.bytes;
+    iov[0].iov_len = sizeof(wire.bytes);
+    if (h->request.keylen > 0) {
+        iov[iovcnt].iov_base = (void *)key;
+        iov[iovcnt++].iov_len = h->request.keylen;
+    }
+    if (h->request.vallen > 0) {
+        iov[iovcnt].iov_base = (void *)value;
+        iov[iovcnt++].iov_len = h->request.vallen;
+    }
+    return node_send_all(fd, iov, iovcnt);
+}
+
+/* Reads a header and converts it to host order. */
+static int node_recv_header(int fd, protocol_node_header *h) {
+    if (node_recv_all(fd, h->bytes, sizeof(h->bytes)) == -1)
+        return -1;
+    if (h->request.magic != PROTOCOL_NODE_REQ && h->request.magic != PROTOCOL_NODE_RES) {
+        fprintf(stderr, "node_recv_header: invalid magic %x\n", h->request.magic);
+        return -1;
+    }
+    node_header_ntoh(h);
+    return 0;
+}
+
+/* Sends a control message whose value is a string, e.g. a serialized boundary. */
+static int node_send_message(int fd, uint8_t opcode, char *text) {
+    protocol_node_header h;
+    memset(&h, 0, sizeof(h));
+    h.request.magic = PROTOCOL_NODE_REQ;
+    h.request.opcode = opcode;
+    h.request.vallen = text ? strlen(text) : 0;
+    return node_send_packet(fd, &h, NULL, text);
+}
+
+/*
+ * Receives a control message into buf as a NUL terminated string. The
+ * header is returned in h so the caller can look at the opcode.
+ */
+static int node_recv_message(int fd, protocol_node_header *h, char *buf, size_t size) {
+    if (node_recv_header(fd, h) == -1)
+        return -1;
+    if (node_skip(fd, h->request.keylen) == -1)
+        return -1;
+    if (h->request.vallen >= size) {
+        fprintf(stderr, "node_recv_message: message of %u bytes is too large\n", h->request.vallen);
+        return -1;
+    }
+    if (node_recv_all(fd, buf, h->request.vallen) == -1)
+        return -1;
+    buf[h->request.vallen] = '\0';
+    return 0;
+}
+
+/* Like node_recv_message, but anything except the expected message is fatal. */
+static void node_expect_message(int fd, uint8_t opcode, char *buf, size_t size, char *caller) {
+    protocol_node_header h;
+    if (node_recv_message(fd, &h, buf, size) == -1) {
+        fprintf(stderr, "%s: connection lost while waiting for message %x\n", caller, opcode);
+        exit(1);
+    }
+    if (h.request.opcode != opcode) {
+        fprintf(stderr, "%s: expected message %x, received %x\n", caller, opcode, h.request.opcode);
         exit(1);
     }
+}
+
+static ZoneBoundary* _recv_boundary_from_neighbour(int child_fd) {
+	char buf[1024];
+	node_expect_message(child_fd, PROTOCOL_NODE_CMD_BOUNDARY, buf, sizeof(buf), "_recv_boundary_from_neighbour");
 	ZoneBoundary *child_boundary = (ZoneBoundary *) malloc(sizeof(ZoneBoundary));
 	deserialize_boundary(buf, child_boundary);
 	fprintf(stderr,"Received %s\n",buf);
@@ -2970,16 +3406,18 @@ static float calculate_area(ZoneBoundary bounds)
 }
 //////////// End of functions common to bootstrap.c
 
-static int connect_to(char *ip_address,char *port,char *caller){
+static int connect_to(char *address,char *caller){
     int sockfd;
     struct addrinfo hints, *servinfo, *p;
     int rv;
     char s[INET6_ADDRSTRLEN];
+    char ip_address[NODE_ADDR_LEN], port[NI_MAXSERV];
 
     memset(&hints, 0, sizeof hints);
     hints.ai_family = AF_UNSPEC;
     hints.ai_socktype = SOCK_STREAM;
 
+    split_address(address, ip_address, sizeof(ip_address), port, sizeof(port));
     fprintf(stderr,"In %s: attempting to connect_to %s:%s\n",caller,ip_address,port);
 
     if ((rv = getaddrinfo(ip_address, port, &hints, &servinfo)) != 0) {
@@ -3002,8 +3440,10 @@ static int connect_to(char *ip_address,char *port,char *caller){
     }
 
     if (p == NULL ) {
+        /* callers decide whether they can carry on without this peer */
         fprintf(stderr, "In %s : client: failed to connect\n",caller);
-        exit(-1);
+        freeaddrinfo(servinfo);
+        return -1;
     }
 
     inet_ntop(p->ai_family, get_in_addr((struct sockaddr *) p->ai_addr), s, sizeof s);
@@ -3012,6 +3452,69 @@ static int connect_to(char *ip_address,char *port,char *caller){
     return sockfd;
 }
 
+/*
+ * Like connect_to, but failing is not fatal. A non-blocking connect only
+ * starts; the first write tells whether it worked.
+ */
+static int node_connect(char *address, bool nonblocking) {
+    struct addrinfo hints, *ai;
+    int fd, flags, rv;
+    char host[NODE_ADDR_LEN], port[NI_MAXSERV];
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    split_address(address, host, sizeof(host), port, sizeof(port));
+    if ((rv = getaddrinfo(host, port, &hints, &ai)) != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+        return -1;
+    }
+    if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) == -1) {
+        perror("socket");
+        freeaddrinfo(ai);
+        return -1;
+    }
+    if (nonblocking && ((flags = fcntl(fd, F_GETFL, 0)) < 0 ||
+            fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)) {
+        perror("setting O_NONBLOCK");
+        close(fd);
+        fd = -1;
+    } else if (connect(fd, ai->ai_addr, ai->ai_addrlen) == -1 && errno != EINPROGRESS) {
+        if (settings.verbose > 0)
+            fprintf(stderr, "connect to %s:%s: %s\n", host, port, strerror(errno));
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(ai);
+    return fd;
+}
+
+/*
+ * A blocking node_connect() that gives up after timeout_ms, instead of
+ * waiting out the kernel's connect timeout on a host that is down.
+ */
+static int node_connect_timeout(char *address, int timeout_ms) {
+    struct pollfd pfd;
+    int fd, flags, error = 0;
+    socklen_t len = sizeof(error);
+
+    if ((fd = node_connect(address, true)) == -1)
+        return -1;
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+    if (poll(&pfd, 1, timeout_ms) != 1 ||
+            getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1 || error != 0 ||
+            (flags = fcntl(fd, F_GETFL, 0)) < 0 ||
+            fcntl(fd, F_SETFL, flags & ~O_NONBLOCK) < 0) {
+        if (settings.verbose > 0)
+            fprintf(stderr, "connect to %s: %s\n", address,
+                    error ? strerror(error) : "timed out");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
 static int find_port(int *sock_desc){
 
 	struct addrinfo hints, *servinfo, *p;
@@ -3026,7 +3529,7 @@ static int find_port(int *sock_desc){
 	char portnoString[10];
 		sprintf(portnoString,"%i", input_portno);
 
-		if ((rv = getaddrinfo(NULL, portnoString, &hints, &servinfo)) != 0) {
+		if ((rv = getaddrinfo(settings.node_host, portnoString, &hints, &servinfo)) != 0) {
 				fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
 				//return 1;
 		}
@@ -3063,162 +3566,1766 @@ static int find_port(int *sock_desc){
 		return portno;
 }
 
-static void pretty_print(char *str,int len,char *caller){
-    int i=0;
-    char *ptr= str;
-    fprintf(stderr,"%s:Character by character:\n",caller);
-    for (i = 0;i<len;i++)
-    {
-        fprintf(stderr,"%d:%c:%d\n",i,*ptr,*ptr);
-        ptr++;
-    }
-    ptr=str;
-    fprintf(stderr,"\n%s:Single line:\n",caller);
-    for (i = 0;i<len;i++)
-    {
-        fprintf(stderr,"%c",*ptr);
-        ptr++;
-    }
-    fprintf(stderr,"\n%s:end of pretty print,len was %d\n",caller,len);
+/* Our address for one of our ports, as other nodes are told it. */
+static void node_address(char *address, int port) {
+    snprintf(address, NODE_ADDR_LEN, "%s:%d", settings.node_host, port);
 }
 
-static pthread_key_t global_data_entry_t;
-static char *request_neighbour(char *key, char *buf, char *type,node_info *neighbour,item* it) {
-	int sockfd;
-	int MAXDATASIZE = 1024;
-	char str[1024];
-	memset(str,'\0',1024);
-	sprintf(str,"request_neighbour(type=%s,to_transfer=%s)",type,key);
-    sockfd = connect_to("localhost",neighbour->request_propogation,str);
-
-    ///imp sleep..increased two zero.
-    usleep(1000);
-	memset(buf, '\0', 1024);
-	fprintf(stderr,"request_neighbour : sending type %s\n", type);
-	send(sockfd, type, strlen(type), 0);
-	///imp sleep..increased two zero.
-	usleep(1000);
-
-	memset(buf, '\0', 1024);
-	fprintf(stderr,"request_neighbour : sending key/command %s\n", key);
-	send(sockfd, key, strlen(key), 0);
-	fprintf(stderr,"Sent command to neighbour %s\n",key);
-
-	if(strcmp(type,"set")==0){
-		///imp sleep..increased two zero.
-
-	    usleep(1000);
-        if(it){
-            char *v = ITEM_data(it);
-            send(sockfd,v,it->nbytes,0);
-            pretty_print(v,it->nbytes,"request_neighbour,set");
-            fprintf(stderr,"Sent binary value to neighbour successfully\n");
-        }
-        else{
-            fprintf(stderr,"You should not have reached here!!!!!");
-            exit(-1);
-        }
-	}
+/* The address of one of the bootstrap's ports, on the host given with -J. */
+static void bootstrap_port_address(char *address, char *port) {
+    char *colon = strrchr(bootstrap_address, ':');
 
-	//increasing 0
-    usleep(1000);
-    memset(buf, '\0', 1024);
+    if (colon == NULL)
+        snprintf(address, NODE_ADDR_LEN, "localhost:%s", port);
+    else
+        snprintf(address, NODE_ADDR_LEN, "%.*s:%s", (int)(colon - bootstrap_address), bootstrap_address, port);
+}
 
-	if (strcmp(type,"get")==0){
-        recv(sockfd, buf, 1024,0);
-        fprintf(stderr,"Received %s\n",buf);
-        if(strncmp(buf,"NOT FOUND",9)){
-            char *global_data_entry=(char*)malloc(sizeof(char)*1024);
-            memset(global_data_entry,'\0',1024);
-            recv(sockfd, global_data_entry, 1024,0);
-            pthread_setspecific(global_data_entry_t,global_data_entry);
-            fprintf(stderr,"get request propagation received value in binary from neighbour, value is %s\n",global_data_entry);
-        }
-    }
-    else{
-    	recv(sockfd, buf, MAXDATASIZE - 1, 0);
-    }
-	close(sockfd);
-	return buf;
+/*
+ * Item values travel in the same framing; flags, expiry and cas go in the
+ * header so the receiver can rebuild the item exactly.
+ */
+static uint32_t item_flags(item *it) {
+    return strtoul(ITEM_suffix(it), NULL, 10);
 }
 
-static void serialize_key_value_str(char *key, char *flag1, int flag2,
-    int flag3, char *key_and_metadata_str) {
-	sprintf(key_and_metadata_str, "%s %s %d %d", key, flag1, flag2, flag3);
-	fprintf(stderr, "STRING:%s\n", key_and_metadata_str);
+/* Whether it expired while we still held it. */
+static bool item_expired(item *it) {
+    return it->exptime != 0 && it->exptime <= current_time;
 }
 
-static void deserialize_key_value_str(char *key, int *flag1, int *flag2, int *flag3, char *key_and_metadata_str) {
-	sscanf(key_and_metadata_str, "%s %d %d %d", key, flag1, flag2, flag3);
+/*
+ * An expired item goes as a time long past, which the receiver's realtime()
+ * expires at once, as process_update_command() does for negative times.
+ * A relative 1 would have given it another second.
+ */
+static uint32_t item_exptime_for_node(item *it) {
+    if (it->exptime == 0)
+        return 0;
+    if (item_expired(it))
+        return REALTIME_MAXDELTA + 1;
+    if (it->exptime - current_time > REALTIME_MAXDELTA)
+        return process_started + it->exptime;
+    return it->exptime - current_time;
+}
+
+/* Fills a host order header describing it; cas is already in network order. */
+static void node_item_header(protocol_node_header *h, uint8_t magic, uint8_t opcode, item *it) {
+    memset(h, 0, sizeof(*h));
+    h->request.magic = magic;
+    h->request.opcode = opcode;
+    h->request.keylen = it->nkey;
+    h->request.vallen = it->nbytes - 2;
+    h->request.flags = item_flags(it);
+    h->request.exptime = item_exptime_for_node(it);
+    h->request.cas = htonll(ITEM_get_cas(it));
+}
+
+/* Requests whose value is read straight into an item */
+static bool node_request_has_item(uint8_t opcode) {
+    switch (opcode) {
+    case PROTOCOL_NODE_CMD_SET:
+    case PROTOCOL_NODE_CMD_REPLICA_SET:
+    case PROTOCOL_NODE_CMD_HANDOFF_SET:
+    case PROTOCOL_NODE_CMD_ADD:
+    case PROTOCOL_NODE_CMD_REPLACE:
+    case PROTOCOL_NODE_CMD_APPEND:
+    case PROTOCOL_NODE_CMD_PREPEND:
+    case PROTOCOL_NODE_CMD_CAS:
+        return true;
+    }
+    return false;
+}
+
+/* Maps a client's store command to the request forwarding it, and back */
+static uint8_t node_store_opcode(int comm) {
+    switch (comm) {
+    case NREAD_ADD:
+        return PROTOCOL_NODE_CMD_ADD;
+    case NREAD_REPLACE:
+        return PROTOCOL_NODE_CMD_REPLACE;
+    case NREAD_APPEND:
+        return PROTOCOL_NODE_CMD_APPEND;
+    case NREAD_PREPEND:
+        return PROTOCOL_NODE_CMD_PREPEND;
+    case NREAD_CAS:
+        return PROTOCOL_NODE_CMD_CAS;
+    }
+    return PROTOCOL_NODE_CMD_SET;
+}
+
+static int node_store_command(uint8_t opcode) {
+    switch (opcode) {
+    case PROTOCOL_NODE_CMD_ADD:
+        return NREAD_ADD;
+    case PROTOCOL_NODE_CMD_REPLACE:
+        return NREAD_REPLACE;
+    case PROTOCOL_NODE_CMD_APPEND:
+        return NREAD_APPEND;
+    case PROTOCOL_NODE_CMD_PREPEND:
+        return NREAD_PREPEND;
+    case PROTOCOL_NODE_CMD_CAS:
+        return NREAD_CAS;
+    }
+    return NREAD_SET;
 }
 
-static float distance_squared(Point p1,Point p2){
-    float x_component = p1.x  - p2.x;
-    float y_component = p1.y  - p2.y;
-    return x_component*x_component + y_component*y_component;
+static int node_send_key(int fd, uint8_t magic, uint8_t opcode, uint16_t status, char *key, size_t nkey) {
+    protocol_node_header h;
+    memset(&h, 0, sizeof(h));
+    h.request.magic = magic;
+    h.request.opcode = opcode;
+    h.request.status = status;
+    h.request.keylen = nkey;
+    return node_send_packet(fd, &h, key, NULL);
 }
 
-static void centroid(ZoneBoundary b,Point *c){
-    c->x = b.from.x+ (b.to.x-b.from.x)/2;
-    c->y = b.from.y+ (b.to.y-b.from.y)/2;
+/*
+ * Every node keeps a copy of the bootstrap's map of all zones, so a client
+ * request goes straight to the owner of its key in one hop. The map is
+ * refetched whenever our neighbours change and every ZONE_MAP_INTERVAL
+ * seconds. A request that reaches a node which doesn't own the key, because
+ * the sender's map was stale, is routed greedily from there.
+ */
+#define ZONE_MAP_PORT "11314"
+#define ZONE_MAP_INTERVAL 2
+
+/* host:port where a node serves clients, as published in the zone map */
+typedef char client_address[64];
+
+typedef struct tagZoneMap {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool stale;             /* refetch without waiting for the interval */
+    unsigned int version;   /* bootstrap's version of the entries */
+    int count;
+    node_info *nodes;       /* replaced as a whole by each fetch */
+    uint64_t *capacity;     /* capacity weight, 0 if not reported */
+    client_address *clients; /* "NULL" if not reported */
+} zone_map;
+
+static zone_map cluster_map = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+static volatile unsigned int neighbour_table_version = 0;
+static pthread_t zone_map_thread;
+
+static void zone_map_changed(void) {
+    pthread_mutex_lock(&cluster_map.lock);
+    cluster_map.stale = true;
+    pthread_cond_signal(&cluster_map.cond);
+    pthread_mutex_unlock(&cluster_map.lock);
+}
+
+static int is_propagation_port_in_zone_map(char *port) {
+    int i, found = 0;
+    pthread_mutex_lock(&cluster_map.lock);
+    for (i = 0; i < cluster_map.count && !found; i++)
+        found = strcmp(cluster_map.nodes[i].request_propogation, port) == 0;
+    pthread_mutex_unlock(&cluster_map.lock);
+    return found;
 }
 
-static node_info get_neighbour_information(char *key)
-{
-	int counter;
-	ZoneBoundary bounds;
-	Point resolved_point = key_point(key);
-	node_info best_neighbour;
-	float closest_distance = 99999999;
-	for(counter=0;counter<10;counter++)
-	{
-	    if(strcmp(neighbour[counter].node_removal,"NULL") || strcmp(neighbour[counter].request_propogation,"NULL"))
-        {
-            bounds=neighbour[counter].boundary;
-            if(is_within_boundary(resolved_point,bounds)==1)
-            {
-                return neighbour[counter];
-            }
-            else {
-                Point c;
-                centroid(neighbour[counter].boundary,&c);
-                float distance_from_this_neighbour = distance_squared(c,resolved_point);
-                fprintf(stderr,"Distance squared = %f\n",distance_from_this_neighbour);
-                if(closest_distance>distance_from_this_neighbour){
-                    best_neighbour = neighbour[counter];
-                    closest_distance = distance_from_this_neighbour;
-                }
-            }
-		}
-	}
-	fprintf(stderr,"Did not find point belonging directly onto any neighbour, propogating the request through the cluster by choosing the best neighbour\n");
-	fprintf(stderr,"Chosen neighbour.request_propagation=%s\n",best_neighbour.request_propogation);
-	return best_neighbour;
+/*
+ * A node's capacity weight says how much of the keyspace it should hold
+ * relative to the others, so machines of different sizes fill their memory
+ * at the same rate. It is the memory limit in megabytes unless set with
+ * -o capacity_weight.
+ */
+static uint64_t capacity_weight(void) {
+    uint64_t weight = settings.capacity_weight;
+    if (weight == 0)
+        weight = settings.maxbytes / (1024 * 1024);
+    return weight ? weight : 1;
 }
 
-static void print_boundaries(ZoneBoundary b) {
-	if (settings.verbose > 1) {
-		fprintf(stderr, "[(%f,%f) to (%f,%f)]\n", b.from.x, b.from.y, b.to.x,
-				b.to.y);
-	}
+/* Returns the capacity weight the map has for a node, or 0 if unknown. */
+static uint64_t zone_map_capacity(char *port) {
+    int i;
+    uint64_t weight = 0;
+    pthread_mutex_lock(&cluster_map.lock);
+    for (i = 0; i < cluster_map.count; i++) {
+        if (strcmp(cluster_map.nodes[i].request_propogation, port) == 0) {
+            weight = cluster_map.capacity[i];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&cluster_map.lock);
+    return weight;
 }
 
-static void print_all_boundaries() {
-	if (settings.verbose > 1) {
-		fprintf(stderr, "Current boundaries:\n");
-		fprintf(stderr, "World boundary:");
-		print_boundaries(world_boundary);
-		fprintf(stderr, "My boundary:");
-		print_boundaries(me.boundary);
-		fprintf(stderr, "My new boundary:");
-		print_boundaries(my_new_boundary);
-	}
+/* Our own client address, so clients can be sent straight to us. */
+static void my_client_address(client_address addr) {
+    snprintf(addr, sizeof(client_address), "%s:%d", settings.node_host, settings.port);
 }
 
-static void print_node_info(node_info n){
-    fprintf(stderr,"(%s,%s,%s,((%f,%f) to (%f,%f)))\n",
-                n.join_request,
-                n.request_propogation,
+/* Returns 1 and the owner of p if the map knows another node owns it. */
+static int zone_map_lookup(Point p, node_info *owner) {
+    int i, found = 0;
+    pthread_mutex_lock(&cluster_map.lock);
+    for (i = 0; i < cluster_map.count && !found; i++) {
+        if (is_within_boundary(p, cluster_map.nodes[i].boundary) == 1 &&
+                strcmp(cluster_map.nodes[i].request_propogation, me.request_propogation) != 0) {
+            *owner = cluster_map.nodes[i];
+            found = 1;
+        }
+    }
+    pthread_mutex_unlock(&cluster_map.lock);
+    return found;
+}
+
+/*
+ * Each poll also reports how loaded we are, so the bootstrap can send a
+ * joining node to whoever carries the most rather than the largest zone:
+ * "version join prop curr_items curr_bytes gets/s sets/s evictions/s capacity client".
+ * The rates cover the time since the previous poll, and client is the
+ * address the bootstrap publishes for us.
+ */
+static void zone_map_load_summary(char *buf) {
+    static uint64_t last_gets, last_sets, last_evictions;
+    static struct timeval last_poll;
+    struct thread_stats thread_stats;
+    struct slab_stats slab_stats;
+    uint64_t evicted[POWER_LARGEST];
+    uint64_t evictions = 0, items, bytes;
+    struct timeval now;
+    client_address client;
+    double secs;
+    int i;
+
+    threadlocal_stats_aggregate(&thread_stats);
+    slab_stats_aggregate(&thread_stats, &slab_stats);
+    item_stats_evictions(evicted);
+    for (i = 0; i < POWER_LARGEST; i++)
+        evictions += evicted[i];
+    STATS_LOCK();
+    items = stats.curr_items;
+    bytes = stats.curr_bytes;
+    STATS_UNLOCK();
+
+    gettimeofday(&now, NULL);
+    secs = (now.tv_sec - last_poll.tv_sec) + (now.tv_usec - last_poll.tv_usec) / 1000000.0;
+    if (last_poll.tv_sec == 0 || secs <= 0)
+        secs = 0;
+    my_client_address(client);
+    sprintf(buf, "%u %s %s %llu %llu %.1f %.1f %.1f %llu %s", cluster_map.version,
+            me.join_request[0] ? me.join_request : "NULL",
+            me.request_propogation[0] ? me.request_propogation : "NULL",
+            (unsigned long long)items, (unsigned long long)bytes,
+            secs ? (thread_stats.get_cmds - last_gets) / secs : 0,
+            secs ? (slab_stats.set_cmds - last_sets) / secs : 0,
+            secs ? (evictions - last_evictions) / secs : 0,
+            (unsigned long long)capacity_weight(), client);
+    last_gets = thread_stats.get_cmds;
+    last_sets = slab_stats.set_cmds;
+    last_evictions = evictions;
+    last_poll = now;
+}
+
+/* Asks the bootstrap for the map if it changed since our version. */
+static void fetch_zone_map(void) {
+    protocol_node_header h;
+    node_info *nodes = NULL, *old_nodes;
+    uint64_t *capacity = NULL, *old_capacity;
+    client_address *clients = NULL, *old_clients;
+    unsigned long long weight;
+    unsigned int version;
+    int count = 0, size = 0;
+    char buf[1024];
+    char address[NODE_ADDR_LEN];
+    int sockfd;
+
+    bootstrap_port_address(address, ZONE_MAP_PORT);
+    if ((sockfd = node_connect(address, false)) == -1)
+        return;
+    zone_map_load_summary(buf);
+    if (node_send_message(sockfd, PROTOCOL_NODE_CMD_ZONE_MAP, buf) == -1 ||
+            node_recv_message(sockfd, &h, buf, sizeof(buf)) == -1 ||
+            h.request.opcode != PROTOCOL_NODE_CMD_ZONE_MAP) {
+        close(sockfd);
+        return;
+    }
+    version = strtoul(buf, NULL, 10);
+    while (node_recv_message(sockfd, &h, buf, sizeof(buf)) == 0 &&
+            h.request.opcode == PROTOCOL_NODE_CMD_NODE_INFO) {
+        if (count == size) {
+            node_info *n;
+            uint64_t *w;
+            client_address *a;
+            size = size ? size * 2 : 16;
+            if ((n = realloc(nodes, size * sizeof(node_info))) != NULL)
+                nodes = n;
+            if ((w = realloc(capacity, size * sizeof(uint64_t))) != NULL)
+                capacity = w;
+            if ((a = realloc(clients, size * sizeof(client_address))) != NULL)
+                clients = a;
+            if (n == NULL || w == NULL || a == NULL) {
+                h.request.opcode = PROTOCOL_NODE_CMD_NOOP;
+                break;
+            }
+        }
+        /* the entry ends with the node's capacity weight and client address */
+        weight = 0;
+        strcpy(clients[count], "NULL");
+        sscanf(buf, "%*s %*s (%*f,%*f) to (%*f,%*f) %llu %63s", &weight, clients[count]);
+        capacity[count] = weight;
+        deserialize_node_info(buf, &nodes[count++]);
+    }
+    close(sockfd);
+    if (h.request.opcode != PROTOCOL_NODE_CMD_END || version == cluster_map.version) {
+        free(nodes);
+        free(capacity);
+        free(clients);
+        return;
+    }
+
+    pthread_mutex_lock(&cluster_map.lock);
+    old_nodes = cluster_map.nodes;
+    old_capacity = cluster_map.capacity;
+    old_clients = cluster_map.clients;
+    cluster_map.nodes = nodes;
+    cluster_map.capacity = capacity;
+    cluster_map.clients = clients;
+    cluster_map.count = count;
+    cluster_map.version = version;
+    pthread_mutex_unlock(&cluster_map.lock);
+    free(old_nodes);
+    free(old_capacity);
+    free(old_clients);
+    /* lets the neighbour pools keep connections to every node in the map */
+    neighbour_table_version++;
+    if (settings.verbose > 1)
+        fprintf(stderr, "zone map: version %u, %d nodes\n", version, count);
+    if (settings.replicas > 0)
+        drop_stale_replicas();
+}
+
+/*
+ * "stats cluster" publishes the zone map to clients: its version, then the
+ * client address and zone of every node. A client that maps keys to points
+ * the way key_point() does can send each request straight to its owner.
+ */
+static void process_stat_cluster(ADD_STAT add_stats, void *c) {
+    char zone[128];
+    int i;
+
+    pthread_mutex_lock(&cluster_map.lock);
+    APPEND_STAT("version", "%u", cluster_map.version);
+    for (i = 0; i < cluster_map.count; i++) {
+        ZoneBoundary b = cluster_map.nodes[i].boundary;
+        if (strcmp(cluster_map.clients[i], "NULL") == 0)
+            continue;
+        snprintf(zone, sizeof(zone), "(%f,%f) to (%f,%f)", b.from.x, b.from.y, b.to.x, b.to.y);
+        APPEND_STAT(cluster_map.clients[i], "%s", zone);
+    }
+    pthread_mutex_unlock(&cluster_map.lock);
+}
+
+static void *zone_map_thread_routine(void *args) {
+    struct timeval now;
+    struct timespec deadline;
+
+    /* drop_stale_replicas() looks up items from here */
+    item_lock_granular_thread();
+    while (1) {
+        fetch_zone_map();
+
+        pthread_mutex_lock(&cluster_map.lock);
+        gettimeofday(&now, NULL);
+        deadline.tv_sec = now.tv_sec + ZONE_MAP_INTERVAL;
+        deadline.tv_nsec = now.tv_usec * 1000;
+        while (!cluster_map.stale &&
+                pthread_cond_timedwait(&cluster_map.cond, &cluster_map.lock, &deadline) == 0)
+            ;
+        cluster_map.stale = false;
+        pthread_mutex_unlock(&cluster_map.lock);
+    }
+    return 0;
+}
+
+/*
+ * A heartbeat thread sends a NOOP every HEARTBEAT_INTERVAL_MS to the
+ * propagation port of each neighbour and of every node in the zone map. A
+ * node that hasn't answered for SUSPECT_TIMEOUT_MS is suspected: routing
+ * skips it, forwards to it fail at once and the pools drop their
+ * connections to it, so losing a node costs a bounded blip rather than
+ * stalled requests. A suspected node that answers again is trusted again.
+ * The table of watched nodes is sized from the neighbour table and the map,
+ * and only the heartbeat thread resizes it, under peers_lock.
+ */
+#define HEARTBEAT_INTERVAL_MS 500
+#define HEARTBEAT_TIMEOUT_MS 500
+#define SUSPECT_TIMEOUT_MS 1500
+#define HEARTBEAT_PEERS_INITIAL 8
+
+typedef struct {
+    char port[NODE_ADDR_LEN]; /* empty for a free slot */
+    int fd;                 /* only used by the heartbeat thread */
+    struct timeval last_ok;
+    bool suspected;
+    bool current;           /* still a neighbour or in the map */
+} peer_health;
+
+static peer_health *peers;
+static int peer_slots;
+static pthread_mutex_t peers_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t heartbeat_thread;
+
+static bool node_suspected(const char *port) {
+    bool suspected = false;
+    int i;
+    pthread_mutex_lock(&peers_lock);
+    for (i = 0; i < peer_slots; i++) {
+        if (strcmp(peers[i].port, port) == 0) {
+            suspected = peers[i].suspected;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&peers_lock);
+    return suspected;
+}
+
+/* Makes room for slots peers, called with peers_lock held. */
+static bool peers_grow(int slots) {
+    peer_health *grown;
+
+    if (slots <= peer_slots)
+        return true;
+    if ((grown = realloc(peers, slots * sizeof(peer_health))) == NULL) {
+        fprintf(stderr, "heartbeat: no memory to watch %d nodes\n", slots);
+        return false;
+    }
+    memset(grown + peer_slots, 0, (slots - peer_slots) * sizeof(peer_health));
+    peers = grown;
+    peer_slots = slots;
+    return true;
+}
+
+/* Starts watching port, called with peers_lock held. */
+static void peer_watch(const char *port) {
+    int i, free_slot = -1;
+
+    if (strcmp(port, "NULL") == 0 || strcmp(port, me.request_propogation) == 0)
+        return;
+    for (i = 0; i < peer_slots; i++) {
+        if (strcmp(peers[i].port, port) == 0) {
+            peers[i].current = true;
+            return;
+        }
+        if (peers[i].port[0] == '\0' && free_slot == -1)
+            free_slot = i;
+    }
+    if (free_slot == -1) {
+        /* slots of nodes that left are only freed after the refresh */
+        if (!peers_grow(peer_slots ? peer_slots * 2 : HEARTBEAT_PEERS_INITIAL))
+            return;
+        free_slot = i;
+    }
+    snprintf(peers[free_slot].port, sizeof(peers[free_slot].port), "%s", port);
+    peers[free_slot].fd = -1;
+    gettimeofday(&peers[free_slot].last_ok, NULL);
+    peers[free_slot].suspected = false;
+    peers[free_slot].current = true;
+}
+
+/* Syncs the watched ports with our neighbours and the zone map. */
+static void peers_refresh(void) {
+    char (*ports)[NODE_ADDR_LEN];
+    int i, count = 0;
+
+    pthread_mutex_lock(&cluster_map.lock);
+    if ((ports = malloc((cluster_map.count + 1) * sizeof(*ports))) != NULL) {
+        for (i = 0; i < cluster_map.count; i++)
+            strcpy(ports[count++], cluster_map.nodes[i].request_propogation);
+    }
+    pthread_mutex_unlock(&cluster_map.lock);
+
+    pthread_mutex_lock(&peers_lock);
+    peers_grow(count + neighbour_slots);
+    for (i = 0; i < peer_slots; i++)
+        peers[i].current = false;
+    for (i = 0; i < count; i++)
+        peer_watch(ports[i]);
+    free(ports);
+    for (i = 0; i < neighbour_slots; i++)
+        peer_watch(neighbour[i].request_propogation);
+    for (i = 0; i < peer_slots; i++) {
+        if (peers[i].port[0] != '\0' && !peers[i].current) {
+            if (peers[i].fd != -1)
+                close(peers[i].fd);
+            memset(&peers[i], 0, sizeof(peers[i]));
+        }
+    }
+    pthread_mutex_unlock(&peers_lock);
+}
+
+static bool heartbeat_ping(peer_health *p, char *port) {
+    struct timeval timeout = { 0, HEARTBEAT_TIMEOUT_MS * 1000 };
+    protocol_node_header h;
+    char buf[64];
+
+    if (p->fd == -1) {
+        if ((p->fd = node_connect_timeout(port, HEARTBEAT_TIMEOUT_MS)) == -1)
+            return false;
+        setsockopt(p->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(p->fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    }
+    if (node_send_message(p->fd, PROTOCOL_NODE_CMD_NOOP, NULL) == -1 ||
+            node_recv_message(p->fd, &h, buf, sizeof(buf)) == -1 ||
+            h.request.opcode != PROTOCOL_NODE_CMD_NOOP) {
+        close(p->fd);
+        p->fd = -1;
+        return false;
+    }
+    return true;
+}
+
+static void *heartbeat_thread_routine(void *args) {
+    struct timespec interval = { 0, HEARTBEAT_INTERVAL_MS * 1000000L };
+    struct timeval now;
+    char port[NODE_ADDR_LEN];
+    bool alive, changed;
+    int i;
+
+    while (1) {
+        nanosleep(&interval, NULL);
+        peers_refresh();
+        changed = false;
+        for (i = 0; i < peer_slots; i++) {
+            /* only this thread changes a slot's port and fd, or the table */
+            pthread_mutex_lock(&peers_lock);
+            strcpy(port, peers[i].port);
+            pthread_mutex_unlock(&peers_lock);
+            if (port[0] == '\0')
+                continue;
+
+            alive = heartbeat_ping(&peers[i], port);
+            gettimeofday(&now, NULL);
+            pthread_mutex_lock(&peers_lock);
+            if (alive) {
+                peers[i].last_ok = now;
+                if (peers[i].suspected) {
+                    fprintf(stderr, "heartbeat: %s answers again\n", port);
+                    peers[i].suspected = false;
+                    changed = true;
+                }
+            } else if (!peers[i].suspected &&
+                    (now.tv_sec - peers[i].last_ok.tv_sec) * 1000 +
+                    (now.tv_usec - peers[i].last_ok.tv_usec) / 1000 >= SUSPECT_TIMEOUT_MS) {
+                fprintf(stderr, "heartbeat: no answer from %s, suspecting it\n", port);
+                peers[i].suspected = true;
+                changed = true;
+            }
+            pthread_mutex_unlock(&peers_lock);
+        }
+        /* makes the worker pools drop connections to suspected nodes */
+        if (changed) {
+            neighbour_table_version++;
+            notify_neighbour_pools();
+        }
+    }
+    return 0;
+}
+
+/*
+ * With -o redirect a node doesn't forward an ascii client's request for a
+ * key it doesn't own. It answers "MOVED <host:port> <epoch>" instead,
+ * naming the owner from the zone map, whose version is the epoch. The
+ * client retries there, and refetches "stats cluster" when the epoch is
+ * newer than its copy. Keys whose owner isn't in the map yet, or is
+ * suspected dead, are still forwarded, as is everything during a split or
+ * merge.
+ */
+static bool zone_map_moved(conn *c, char *key, char *moved, size_t size) {
+    Point p = key_point(key);
+    bool found = false;
+    char port[NODE_ADDR_LEN];
+    int i;
+
+    if (!settings.redirect || c->protocol != ascii_prot || mode != NORMAL_NODE ||
+            is_within_boundary(p, me.boundary) == 1)
+        return false;
+    pthread_mutex_lock(&cluster_map.lock);
+    for (i = 0; i < cluster_map.count && !found; i++) {
+        if (is_within_boundary(p, cluster_map.nodes[i].boundary) == 1 &&
+                strcmp(cluster_map.clients[i], "NULL") != 0) {
+            snprintf(moved, size, "MOVED %s %u", cluster_map.clients[i], cluster_map.version);
+            strcpy(port, cluster_map.nodes[i].request_propogation);
+            found = true;
+        }
+    }
+    pthread_mutex_unlock(&cluster_map.lock);
+    return found && strcmp(port, me.request_propogation) != 0 && !node_suspected(port);
+}
+
+/* Redirects a get whose keys all belong to the same other node. */
+static bool redirect_get(conn *c, token_t *key_token) {
+    char moved[128], first[128];
+    token_t *t;
+
+    for (t = key_token; t->length != 0; t++) {
+        if (!zone_map_moved(c, t->value, moved, sizeof(moved)))
+            return false;
+        if (t == key_token)
+            strcpy(first, moved);
+        else if (strcmp(first, moved) != 0)
+            return false;
+    }
+    /* keys past the ones tokenized so far haven't been checked */
+    if (t == key_token || t->value != NULL)
+        return false;
+    out_string(c, first);
+    return true;
+}
+
+/*
+ * Picks the node to forward a key to: its owner according to the zone map,
+ * or the greedy choice among our neighbours. Requests from other nodes are
+ * only here because the sender's map was stale, so they are routed greedily.
+ */
+static node_info route_key(conn *c, char *key) {
+    node_info owner;
+    if (handoff_moving(key)) {
+        if (handoff_role == HANDOFF_GIVING)
+            handoff_key(c, key);
+        return handoff_peer;
+    }
+    if (c->protocol != node_prot && zone_map_lookup(key_point(key), &owner))
+        return owner;
+    return get_neighbour_information(key);
+}
+
+/*
+ * Every worker thread keeps a pool of persistent connections to the request
+ * propagation port of each neighbour. Forwarded requests are written to them
+ * without waiting for the reply: the client connection is parked in
+ * conn_forwarding and resumed once all of its requests are answered, so one
+ * worker can keep many requests in flight. A neighbour answers the requests
+ * of one connection in order, so replies are matched against a FIFO of
+ * outstanding requests. The pool is resynced against neighbour[] whenever
+ * the table version changes. It holds a connection to any node of the zone
+ * map we forward to, so it doubles when full rather than reuse a slot that
+ * may have requests in flight.
+ */
+#define NEIGHBOUR_POOL_INITIAL 8
+
+typedef struct forward_request forward_request;
+
+/*
+ * Called with the reply status, or -1 if the neighbour could not be reached.
+ * For a GET hit it is an unlinked item the handler has to item_remove().
+ */
+typedef void (*forward_handler)(conn *c, forward_request *fr, int status, item *it);
+
+struct forward_request {
+    conn *c;
+    forward_handler handler;
+    uint8_t opcode;
+    int slot;               /* position of the key in a multiget */
+    char port[NODE_ADDR_LEN]; /* node it was sent to */
+    bool registered;        /* the replier will invalidate our near-cache copy */
+    uint64_t cas;           /* cas of the item the reply was about */
+    size_t nkey;
+    char key[KEY_MAX_LENGTH + 1];
+    forward_request *next;
+};
+
+typedef struct tagPooledConnection {
+    char port[NODE_ADDR_LEN];
+    int fd;
+    struct event event;
+    short ev_flags;
+    struct event_base *base;
+    char *wbuf;             /* requests not written yet */
+    size_t wsize;
+    size_t wbytes;
+    size_t wsent;
+    char *rbuf;             /* replies not complete yet */
+    size_t rsize;
+    size_t rbytes;
+    forward_request *head;  /* requests waiting for a reply, oldest first */
+    forward_request *tail;
+    unsigned int generation; /* bumped whenever the connection is closed */
+} pooled_connection;
+
+static void pooled_connection_handler(const int fd, const short which, void *arg);
+static void neighbour_pool_flush(void);
+
+typedef struct tagNeighbourPool {
+    unsigned int version;
+    int slots;
+    pooled_connection **conns; /* never move, their events point at them */
+} neighbour_pool;
+
+static pthread_key_t neighbour_pool_t;
+
+static void neighbour_table_changed(void) {
+    neighbour_table_version++;
+    zone_map_changed();
+}
+
+static void neighbour_pool_free(void *arg) {
+    neighbour_pool *pool = arg;
+    int i;
+    for (i = 0; i < pool->slots; i++) {
+        if (pool->conns[i]->fd != -1)
+            close(pool->conns[i]->fd);
+        free(pool->conns[i]->wbuf);
+        free(pool->conns[i]->rbuf);
+        free(pool->conns[i]);
+    }
+    free(pool->conns);
+    free(pool);
+}
+
+/*
+ * Hands the reply to the request's handler and resumes the connection that
+ * sent it once it has nothing left in flight.
+ */
+static void forward_done(forward_request *fr, int status, item *it) {
+    conn *c = fr->c;
+
+    fr->handler(c, fr, status, it);
+    if (c != NULL && --c->forwards == 0 && c->state == conn_forwarding) {
+        c->forwarded(c);
+        drive_machine(c);
+    }
+}
+
+/*
+ * Sends what c queued and parks it until its forwarded requests are
+ * answered, or completes it now.
+ */
+static void conn_wait_for_forwards(conn *c, void (*forwarded)(conn *c)) {
+    neighbour_pool_flush();
+    if (c->forwards > 0) {
+        c->forwarded = forwarded;
+        conn_set_state(c, conn_forwarding);
+    } else {
+        forwarded(c);
+    }
+}
+
+/* Closes the connection and fails every request still waiting on it. */
+static void pooled_connection_close(pooled_connection *pc) {
+    forward_request *fr = pc->head;
+
+    pc->head = pc->tail = NULL;
+    pc->generation++;
+    if (pc->fd != -1) {
+        if (pc->ev_flags != 0)
+            event_del(&pc->event);
+        close(pc->fd);
+    }
+    pc->fd = -1;
+    pc->ev_flags = 0;
+    pc->wbytes = pc->wsent = 0;
+    pc->rbytes = 0;
+
+    while (fr != NULL) {
+        forward_request *next = fr->next;
+        forward_done(fr, -1, NULL);
+        free(fr);
+        fr = next;
+    }
+}
+
+static int is_propagation_port_of_a_neighbour(char *port) {
+    int i;
+    for (i = 0; i < neighbour_slots; i++) {
+        if (strcmp(neighbour[i].request_propogation, "NULL") != 0 &&
+                strcmp(neighbour[i].request_propogation, port) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+/* Drops connections to suspected nodes and to those no longer our neighbours or in the map. */
+static void neighbour_pool_resync(neighbour_pool *pool) {
+    int i;
+    pool->version = neighbour_table_version;
+    for (i = 0; i < pool->slots; i++) {
+        pooled_connection *pc = pool->conns[i];
+        if (pc->fd != -1 && ((!is_propagation_port_of_a_neighbour(pc->port) &&
+                !is_propagation_port_in_zone_map(pc->port)) || node_suspected(pc->port))) {
+            if (settings.verbose > 1)
+                fprintf(stderr, "neighbour pool: dropping connection to %s\n", pc->port);
+            pooled_connection_close(pc);
+        }
+    }
+}
+
+/* Doubles the pool; returns false if out of memory. */
+static bool neighbour_pool_grow(neighbour_pool *pool) {
+    int i, slots = pool->slots ? pool->slots * 2 : NEIGHBOUR_POOL_INITIAL;
+    pooled_connection **conns = realloc(pool->conns, slots * sizeof(pooled_connection *));
+
+    if (conns == NULL)
+        return false;
+    pool->conns = conns;
+    for (i = pool->slots; i < slots; i++) {
+        if ((conns[i] = calloc(1, sizeof(pooled_connection))) == NULL)
+            break;
+        conns[i]->fd = -1;
+    }
+    pool->slots = i;
+    return i == slots;
+}
+
+static neighbour_pool *get_neighbour_pool(void) {
+    neighbour_pool *pool = pthread_getspecific(neighbour_pool_t);
+    if (pool == NULL) {
+        pool = calloc(1, sizeof(neighbour_pool));
+        if (pool == NULL || !neighbour_pool_grow(pool)) {
+            perror("Failed to allocate neighbour pool");
+            exit(EXIT_FAILURE);
+        }
+        pool->version = neighbour_table_version;
+        pthread_setspecific(neighbour_pool_t, pool);
+    }
+    if (pool->version != neighbour_table_version)
+        neighbour_pool_resync(pool);
+    return pool;
+}
+
+static bool pooled_connection_update_event(pooled_connection *pc, const short new_flags) {
+    if (pc->ev_flags == new_flags)
+        return true;
+    if (pc->ev_flags != 0 && event_del(&pc->event) == -1)
+        return false;
+    event_set(&pc->event, pc->fd, new_flags, pooled_connection_handler, pc);
+    event_base_set(pc->base, &pc->event);
+    pc->ev_flags = new_flags;
+    if (event_add(&pc->event, 0) == -1) {
+        pc->ev_flags = 0;
+        return false;
+    }
+    return true;
+}
+
+/* Writes as much of the queued requests as the socket takes. */
+static int pooled_connection_flush(pooled_connection *pc) {
+    while (pc->wsent < pc->wbytes) {
+        ssize_t res = write(pc->fd, pc->wbuf + pc->wsent, pc->wbytes - pc->wsent);
+        if (res > 0) {
+            pc->wsent += res;
+        } else if (res == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return pooled_connection_update_event(pc, EV_READ | EV_WRITE | EV_PERSIST) ? 0 : -1;
+        } else {
+            if (settings.verbose > 0)
+                perror("Failed to write to neighbour");
+            return -1;
+        }
+    }
+    pc->wbytes = pc->wsent = 0;
+    return pooled_connection_update_event(pc, EV_READ | EV_PERSIST) ? 0 : -1;
+}
+
+static bool grow_buffer(char **buf, size_t *size, size_t needed) {
+    size_t nsize = *size ? *size : DATA_BUFFER_SIZE;
+    char *nbuf;
+
+    while (nsize < needed)
+        nsize *= 2;
+    if (nsize == *size)
+        return true;
+    if ((nbuf = realloc(*buf, nsize)) == NULL)
+        return false;
+    *buf = nbuf;
+    *size = nsize;
+    return true;
+}
+
+/* Resyncs this thread's pool if the table changed; see notify_neighbour_pools(). */
+void neighbour_pool_sync(void) {
+    neighbour_pool *pool = pthread_getspecific(neighbour_pool_t);
+    if (pool != NULL && pool->version != neighbour_table_version)
+        neighbour_pool_resync(pool);
+}
+
+/* Sends the requests queued on every connection of this thread's pool. */
+static void neighbour_pool_flush(void) {
+    neighbour_pool *pool = pthread_getspecific(neighbour_pool_t);
+    int i;
+
+    if (pool == NULL)
+        return;
+    for (i = 0; i < pool->slots; i++) {
+        pooled_connection *pc = pool->conns[i];
+        if (pc->fd != -1 && pc->wsent < pc->wbytes && pooled_connection_flush(pc) == -1)
+            pooled_connection_close(pc);
+    }
+}
+
+/* Builds the unlinked item carried by a GET hit. */
+static item *pooled_connection_reply_item(char *key, size_t nkey, protocol_node_header *h, char *value) {
+    item *it = item_alloc(key, nkey, h->request.flags, realtime(h->request.exptime), h->request.vallen + 2);
+    if (it == NULL) {
+        fprintf(stderr, "forward_request: no memory for key %s\n", key);
+        return NULL;
+    }
+    memcpy(ITEM_data(it), value, h->request.vallen);
+    memcpy(ITEM_data(it) + h->request.vallen, "\r\n", 2);
+    ITEM_set_cas(it, ntohll(h->request.cas));
+    return it;
+}
+
+/* Successful replies to these carry an item */
+static bool node_reply_has_item(uint8_t opcode) {
+    switch (opcode) {
+    case PROTOCOL_NODE_CMD_GET:
+    case PROTOCOL_NODE_CMD_GETKQ:
+    case PROTOCOL_NODE_CMD_INCREMENT:
+    case PROTOCOL_NODE_CMD_DECREMENT:
+    case PROTOCOL_NODE_CMD_TOUCH:
+        return true;
+    }
+    return false;
+}
+
+static bool is_reply_to(forward_request *fr, protocol_node_header *h, char *key) {
+    return h->request.opcode == fr->opcode && h->request.keylen == fr->nkey &&
+            memcmp(key, fr->key, fr->nkey) == 0;
+}
+
+/* Hands a reply to the request at the head of the queue. */
+static void pooled_connection_pop(pooled_connection *pc, int status, item *it) {
+    forward_request *fr = pc->head;
+
+    pc->head = fr->next;
+    if (pc->head == NULL)
+        pc->tail = NULL;
+    /* may resume the connection, which can send more or close us */
+    forward_done(fr, status, it);
+    free(fr);
+}
+
+static void pooled_connection_read(pooled_connection *pc) {
+    protocol_node_header h;
+    char key[KEY_MAX_LENGTH + 1];
+    unsigned int generation = pc->generation;
+    forward_request *fr;
+    ssize_t res;
+    size_t need;
+    item *it;
+
+    if (pc->rbytes == pc->rsize && !grow_buffer(&pc->rbuf, &pc->rsize, pc->rbytes + 1)) {
+        pooled_connection_close(pc);
+        return;
+    }
+    res = read(pc->fd, pc->rbuf + pc->rbytes, pc->rsize - pc->rbytes);
+    if (res == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return;
+    if (res <= 0) {
+        /* an idle connection the neighbour closed, or a broken one */
+        if (settings.verbose > 1)
+            fprintf(stderr, "neighbour pool: connection to %s closed\n", pc->port);
+        pooled_connection_close(pc);
+        return;
+    }
+    pc->rbytes += res;
+
+    while (pc->rbytes >= sizeof(h.bytes)) {
+        memcpy(h.bytes, pc->rbuf, sizeof(h.bytes));
+        node_header_ntoh(&h);
+        if (h.request.magic != PROTOCOL_NODE_RES || h.request.keylen > KEY_MAX_LENGTH) {
+            fprintf(stderr, "neighbour pool: invalid reply from %s\n", pc->port);
+            pooled_connection_close(pc);
+            return;
+        }
+        need = sizeof(h.bytes) + h.request.keylen + h.request.vallen;
+        if (pc->rbytes < need) {
+            if (!grow_buffer(&pc->rbuf, &pc->rsize, need))
+                pooled_connection_close(pc);
+            return;
+        }
+
+        memcpy(key, pc->rbuf + sizeof(h.bytes), h.request.keylen);
+        key[h.request.keylen] = '\0';
+        it = NULL;
+        if (node_reply_has_item(h.request.opcode) && h.request.status == PROTOCOL_NODE_RESPONSE_SUCCESS) {
+            it = pooled_connection_reply_item(key, h.request.keylen, &h, pc->rbuf + sizeof(h.bytes) + h.request.keylen);
+            if (it == NULL)
+                h.request.status = PROTOCOL_NODE_RESPONSE_ENOMEM;
+        }
+        pc->rbytes -= need;
+        memmove(pc->rbuf, pc->rbuf + need, pc->rbytes);
+
+        /* the quiet gets this reply skipped over were misses */
+        while ((fr = pc->head) != NULL && fr->opcode == PROTOCOL_NODE_CMD_GETKQ &&
+                !is_reply_to(fr, &h, key)) {
+            pooled_connection_pop(pc, PROTOCOL_NODE_RESPONSE_KEY_ENOENT, NULL);
+            if (pc->generation != generation)
+                goto closed;
+        }
+        if (fr == NULL || fr->opcode != h.request.opcode) {
+            fprintf(stderr, "neighbour pool: unexpected reply %x from %s\n", h.request.opcode, pc->port);
+            if (it)
+                item_remove(it);
+            pooled_connection_close(pc);
+            return;
+        }
+        fr->registered = h.request.reserved != 0;
+        fr->cas = ntohll(h.request.cas);
+        pooled_connection_pop(pc, h.request.status, it);
+        if (pc->generation != generation)
+            return;
+    }
+    return;
+
+closed:
+    if (it)
+        item_remove(it);
+}
+
+static void pooled_connection_handler(const int fd, const short which, void *arg) {
+    pooled_connection *pc = arg;
+
+    if ((which & EV_WRITE) && pooled_connection_flush(pc) == -1) {
+        pooled_connection_close(pc);
+        return;
+    }
+    if (which & EV_READ)
+        pooled_connection_read(pc);
+}
+
+static pooled_connection *pooled_connection_to(node_info *n, struct event_base *base) {
+    neighbour_pool *pool = get_neighbour_pool();
+    pooled_connection *free_slot = NULL;
+    int i;
+
+    for (i = 0; i < pool->slots; i++) {
+        pooled_connection *pc = pool->conns[i];
+        if (pc->fd == -1) {
+            if (free_slot == NULL)
+                free_slot = pc;
+        } else if (strcmp(pc->port, n->request_propogation) == 0) {
+            return pc;
+        }
+    }
+    if (free_slot == NULL) {
+        neighbour_pool_grow(pool);
+        if (i == pool->slots) {
+            fprintf(stderr, "neighbour pool: no memory for a connection to %s\n", n->request_propogation);
+            return NULL;
+        }
+        free_slot = pool->conns[i];
+    }
+    if ((free_slot->fd = node_connect(n->request_propogation, true)) == -1)
+        return NULL;
+    snprintf(free_slot->port, sizeof(free_slot->port), "%s", n->request_propogation);
+    free_slot->base = base;
+    if (!pooled_connection_update_event(free_slot, EV_READ | EV_WRITE | EV_PERSIST)) {
+        close(free_slot->fd);
+        free_slot->fd = -1;
+        return NULL;
+    }
+    return free_slot;
+}
+
+/* Fills the host order header of a request for key, carrying it if not NULL. */
+static void node_request_header(protocol_node_header *h, uint8_t opcode, size_t nkey, item *it) {
+    if (it) {
+        node_item_header(h, PROTOCOL_NODE_REQ, opcode, it);
+    } else {
+        memset(h, 0, sizeof(*h));
+        h->request.magic = PROTOCOL_NODE_REQ;
+        h->request.opcode = opcode;
+        h->request.keylen = nkey;
+        if (settings.near_cache > 0 &&
+                (opcode == PROTOCOL_NODE_CMD_GET || opcode == PROTOCOL_NODE_CMD_GETKQ)) {
+            h->request.flags = 1;
+            h->request.vallen = strlen(me.request_propogation);
+        }
+    }
+}
+
+/* Queues one framed request on pc; h is in host order and followed by key and value. */
+static bool pooled_connection_append_packet(pooled_connection *pc, protocol_node_header *h, char *key, char *value) {
+    protocol_node_header nh = *h;
+    size_t nkey = h->request.keylen, vallen = h->request.vallen;
+    char *p;
+
+    if (!grow_buffer(&pc->wbuf, &pc->wsize, pc->wbytes + sizeof(nh.bytes) + nkey + vallen))
+        return false;
+    node_header_hton(&nh);
+
+    p = pc->wbuf + pc->wbytes;
+    memcpy(p, nh.bytes, sizeof(nh.bytes));
+    memcpy(p + sizeof(nh.bytes), key, nkey);
+    if (vallen)
+        memcpy(p + sizeof(nh.bytes) + nkey, value, vallen);
+    pc->wbytes += sizeof(nh.bytes) + nkey + vallen;
+    return true;
+}
+
+/* Queues one framed request on pc; it is the value of a SET, a GET carries our address instead. */
+static bool pooled_connection_append(pooled_connection *pc, uint8_t opcode, char *key, size_t nkey, item *it) {
+    protocol_node_header h;
+
+    node_request_header(&h, opcode, nkey, it);
+    return pooled_connection_append_packet(pc, &h, key, it ? ITEM_data(it) : me.request_propogation);
+}
+
+/*
+ * Queues one request for a neighbour, h and value as for
+ * pooled_connection_append_packet(). handler is called with the reply, or
+ * with -1 right away if the request can't be sent. Callers follow up with
+ * conn_wait_for_forwards(), which writes out everything queued so far.
+ */
+static void forward_packet_to_neighbour(conn *c, node_info *neighbour, protocol_node_header *h,
+        char *key, char *value, forward_handler handler, int slot) {
+    forward_request *fr = calloc(1, sizeof(forward_request));
+    uint8_t opcode = h->request.opcode;
+    size_t nkey = h->request.keylen;
+    pooled_connection *pc;
+
+    c->forwards++;
+    if (fr == NULL) {
+        forward_request failed = { .c = c, .handler = handler, .opcode = opcode, .slot = slot };
+        forward_done(&failed, -1, NULL);
+        return;
+    }
+    fr->c = c;
+    fr->handler = handler;
+    fr->opcode = opcode;
+    fr->slot = slot;
+    fr->nkey = nkey;
+    memcpy(fr->key, key, nkey);
+    fr->key[nkey] = '\0';
+    snprintf(fr->port, sizeof(fr->port), "%s", neighbour->request_propogation);
+
+    if (settings.verbose > 1)
+        fprintf(stderr, "forward_request : opcode %x for key %s to %s\n", opcode, fr->key, neighbour->request_propogation);
+    pc = node_suspected(neighbour->request_propogation) ? NULL :
+            pooled_connection_to(neighbour, c->thread->base);
+    if (pc == NULL || !pooled_connection_append_packet(pc, h, key, value)) {
+        forward_done(fr, -1, NULL);
+        free(fr);
+        return;
+    }
+    if (pc->tail)
+        pc->tail->next = fr;
+    else
+        pc->head = fr;
+    pc->tail = fr;
+}
+
+/* Queues one key operation for a neighbour; it carries the value of a SET, as for pooled_connection_append(). */
+static void forward_to_neighbour(conn *c, node_info *neighbour, uint8_t opcode,
+        char *key, size_t nkey, item *it, forward_handler handler, int slot) {
+    protocol_node_header h;
+
+    node_request_header(&h, opcode, nkey, it);
+    forward_packet_to_neighbour(c, neighbour, &h, key, it ? ITEM_data(it) : me.request_propogation, handler, slot);
+}
+
+/* Handlers for requests that complete a single command */
+static void forward_keep_status(conn *c, forward_request *fr, int status, item *it) {
+    c->forward_status = status;
+    c->cas = fr->cas;
+    if (it)
+        item_remove(it);
+}
+
+static void forward_keep_item(conn *c, forward_request *fr, int status, item *it) {
+    c->forward_status = status;
+    c->cas = fr->cas;
+    c->item = it;
+}
+
+static void forward_ignore(conn *c, forward_request *fr, int status, item *it) {
+    if (it)
+        item_remove(it);
+}
+
+/* Lets the replies still owed to c, which is being closed, go nowhere. */
+static void forward_abandon(conn *c) {
+    neighbour_pool *pool = pthread_getspecific(neighbour_pool_t);
+    forward_request *fr;
+    int i;
+
+    if (pool == NULL || c->forwards == 0)
+        return;
+    for (i = 0; i < pool->slots; i++) {
+        for (fr = pool->conns[i]->head; fr != NULL; fr = fr->next) {
+            if (fr->c == c) {
+                fr->c = NULL;
+                fr->handler = forward_ignore;
+            }
+        }
+    }
+    c->forwards = 0;
+}
+
+/*
+ * With -o replicas=N an owner mirrors its sets and deletes to N zones that
+ * share an edge with its own: those across its right edge first, then its
+ * left, top and bottom. Zones are only cut along x for now, so the top and
+ * bottom come into play once they are cut along y too. Every node can work
+ * out a zone's replicas from the zone map, so reads of a key are spread
+ * over its owner and replicas, and a read the owner can't answer is
+ * retried on a replica. Mirroring is asynchronous and unanswered, so a
+ * replica may briefly serve an older value. When the map changes, a node
+ * drops the copies of zones it no longer mirrors, see drop_stale_replicas().
+ */
+#define ZONE_EDGE_EPSILON 0.001
+
+static bool same_edge(float a, float b) {
+    return fabs(a - b) < ZONE_EDGE_EPSILON;
+}
+
+/* Whether b lies across side (right, left, top, bottom) of zone, sharing part of the edge. */
+static bool zone_across(ZoneBoundary zone, ZoneBoundary b, int side) {
+    switch (side) {
+    case 0:
+        return same_edge(b.from.x, zone.to.x) && b.from.y < zone.to.y && b.to.y > zone.from.y;
+    case 1:
+        return same_edge(b.to.x, zone.from.x) && b.from.y < zone.to.y && b.to.y > zone.from.y;
+    case 2:
+        return same_edge(b.from.y, zone.to.y) && b.from.x < zone.to.x && b.to.x > zone.from.x;
+    default:
+        return same_edge(b.to.y, zone.from.y) && b.from.x < zone.to.x && b.to.x > zone.from.x;
+    }
+}
+
+/* Fills replicas with the nodes mirroring zone and returns how many there are. */
+static int replicas_of(ZoneBoundary zone, node_info *replicas) {
+    int i, side, count = 0;
+
+    pthread_mutex_lock(&cluster_map.lock);
+    for (side = 0; side < 4 && count < settings.replicas; side++) {
+        for (i = 0; i < cluster_map.count && count < settings.replicas; i++) {
+            if (zone_across(zone, cluster_map.nodes[i].boundary, side))
+                replicas[count++] = cluster_map.nodes[i];
+        }
+    }
+    pthread_mutex_unlock(&cluster_map.lock);
+    return count;
+}
+
+static bool is_me(node_info *n) {
+    return strcmp(n->request_propogation, me.request_propogation) == 0;
+}
+
+/* Mirrors our current copy of key to our replicas, or its deletion if we have none. */
+static void replicate_key(conn *c, char *key) {
+    node_info replicas[2];
+    size_t nkey = strlen(key);
+    item *it;
+    int i, count;
+
+    if (settings.replicas == 0 || mode != NORMAL_NODE)
+        return;
+    if ((count = replicas_of(me.boundary, replicas)) == 0)
+        return;
+    it = item_get(key, nkey);
+    for (i = 0; i < count; i++) {
+        pooled_connection *pc;
+        if (is_me(&replicas[i]) || node_suspected(replicas[i].request_propogation) ||
+                (pc = pooled_connection_to(&replicas[i], c->thread->base)) == NULL)
+            continue;
+        pooled_connection_append(pc, it ? PROTOCOL_NODE_CMD_REPLICA_SET : PROTOCOL_NODE_CMD_REPLICA_DELETE,
+                key, nkey, it);
+    }
+    if (it)
+        item_remove(it);
+    neighbour_pool_flush();
+}
+
+/*
+ * With -o near_cache=<bytes> a node keeps the values it fetched from other
+ * nodes for near_cache_ttl seconds, so hot remote keys are served without a
+ * forward. The copies are malloc'd outside the slabs, so they never take
+ * -m memory from the keys we own nor push those out; near_cache caps them
+ * on its own, the least recently used going first. Whoever
+ * served a value remembers who cached it and sends an INVALIDATE when the
+ * key is set or deleted there. That record is a fixed table where a busy
+ * slot can push out an older reader, so the TTL bounds how stale a copy
+ * can get.
+ */
+#define NEAR_CACHE_BUCKETS 4096
+#define NEAR_READERS_SIZE 4096
+#define NEAR_READERS_PER_KEY 4
+
+typedef struct near_entry near_entry;
+
+struct near_entry {
+    item *it;
+    rel_time_t expires;
+    near_entry *h_next;     /* hash chain */
+    near_entry *prev;       /* LRU, most recently used at the head */
+    near_entry *next;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    near_entry *buckets[NEAR_CACHE_BUCKETS];
+    near_entry *head;
+    near_entry *tail;
+    uint64_t bytes;
+} near_cache = { PTHREAD_MUTEX_INITIALIZER };
+
+static near_entry **near_cache_find(const char *key, size_t nkey) {
+    near_entry **e = &near_cache.buckets[hash64(key, nkey) % NEAR_CACHE_BUCKETS];
+    while (*e != NULL && ((*e)->it->nkey != nkey || memcmp(ITEM_key((*e)->it), key, nkey) != 0))
+        e = &(*e)->h_next;
+    return e;
+}
+
+/* Unlinks the entry at *e; its item is returned for the caller to release. */
+static item *near_cache_unlink(near_entry **e) {
+    near_entry *entry = *e;
+    item *it = entry->it;
+
+    *e = entry->h_next;
+    if (entry->prev)
+        entry->prev->next = entry->next;
+    else
+        near_cache.head = entry->next;
+    if (entry->next)
+        entry->next->prev = entry->prev;
+    else
+        near_cache.tail = entry->prev;
+    near_cache.bytes -= ITEM_ntotal(it);
+    free(entry);
+    STATS_LOCK();
+    stats.near_cache_items--;
+    stats.near_cache_bytes = near_cache.bytes;
+    STATS_UNLOCK();
+    return it;
+}
+
+/* Returns a referenced copy of key if a fresh one is cached. */
+static item *near_cache_get(const char *key, size_t nkey) {
+    near_entry **e, *entry;
+    item *it = NULL, *stale = NULL;
+
+    if (settings.near_cache == 0)
+        return NULL;
+    pthread_mutex_lock(&near_cache.lock);
+    if ((entry = *(e = near_cache_find(key, nkey))) != NULL) {
+        if (entry->expires <= current_time ||
+                (entry->it->exptime != 0 && entry->it->exptime <= current_time)) {
+            stale = near_cache_unlink(e);
+        } else {
+            it = entry->it;
+            refcount_incr(&it->refcount);
+            if (entry->prev) {
+                /* move to the head of the LRU */
+                entry->prev->next = entry->next;
+                if (entry->next)
+                    entry->next->prev = entry->prev;
+                else
+                    near_cache.tail = entry->prev;
+                entry->prev = NULL;
+                entry->next = near_cache.head;
+                near_cache.head->prev = entry;
+                near_cache.head = entry;
+            }
+        }
+    }
+    pthread_mutex_unlock(&near_cache.lock);
+    if (stale)
+        item_remove(stale);
+    if (it) {
+        STATS_LOCK();
+        stats.near_cache_hits++;
+        STATS_UNLOCK();
+    }
+    return it;
+}
+
+static void near_cache_remove(const char *key, size_t nkey) {
+    near_entry **e;
+    item *it = NULL;
+
+    if (settings.near_cache == 0)
+        return;
+    pthread_mutex_lock(&near_cache.lock);
+    if (*(e = near_cache_find(key, nkey)) != NULL)
+        it = near_cache_unlink(e);
+    pthread_mutex_unlock(&near_cache.lock);
+    if (it)
+        item_remove(it);
+}
+
+/* Keeps a copy of it, a value fetched from another node. */
+static void near_cache_store(item *reply) {
+    near_entry **e, *entry;
+    item *it, *old[8];
+    int i, nold = 0;
+
+    if (settings.near_cache == 0 || ITEM_ntotal(reply) > settings.near_cache)
+        return;
+    if ((entry = calloc(1, sizeof(near_entry))) == NULL)
+        return;
+    if ((it = item_copy_unslabbed(reply)) == NULL) {
+        free(entry);
+        return;
+    }
+    entry->it = it;
+    entry->expires = current_time + settings.near_cache_ttl;
+
+    pthread_mutex_lock(&near_cache.lock);
+    if (*(e = near_cache_find(ITEM_key(it), it->nkey)) != NULL)
+        old[nold++] = near_cache_unlink(e);
+    while (near_cache.bytes + ITEM_ntotal(it) > settings.near_cache && nold < 8) {
+        near_entry *lru = near_cache.tail;
+        old[nold++] = near_cache_unlink(near_cache_find(ITEM_key(lru->it), lru->it->nkey));
+    }
+    /* evictions may have changed the chain we found */
+    e = near_cache_find(ITEM_key(it), it->nkey);
+    if (near_cache.bytes + ITEM_ntotal(it) > settings.near_cache) {
+        pthread_mutex_unlock(&near_cache.lock);
+        free(entry);
+        old[nold++] = it;
+    } else {
+        entry->h_next = *e;
+        *e = entry;
+        entry->next = near_cache.head;
+        if (near_cache.head)
+            near_cache.head->prev = entry;
+        else
+            near_cache.tail = entry;
+        near_cache.head = entry;
+        near_cache.bytes += ITEM_ntotal(it);
+        pthread_mutex_unlock(&near_cache.lock);
+        STATS_LOCK();
+        stats.near_cache_items++;
+        stats.near_cache_bytes = near_cache.bytes;
+        STATS_UNLOCK();
+    }
+    for (i = 0; i < nold; i++)
+        item_remove(old[i]);
+}
+
+typedef struct {
+    uint64_t hv;
+    rel_time_t until;
+    uint32_t readers[NEAR_READERS_PER_KEY];  /* see near_reader_id() */
+} near_readers;
+
+static near_readers near_reader_table[NEAR_READERS_SIZE];
+static pthread_mutex_t near_readers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Addresses of the readers seen so far; a reader is noted by its index + 1. */
+static char (*near_reader_addresses)[NODE_ADDR_LEN];
+static uint32_t near_reader_count, near_reader_slots;
+
+/* Returns the number standing for address, or 0 if out of memory. Called with near_readers_lock. */
+static uint32_t near_reader_id(const char *address, size_t len) {
+    uint32_t i;
+
+    if (len == 0 || len >= NODE_ADDR_LEN)
+        return 0;
+    for (i = 0; i < near_reader_count; i++) {
+        if (strncmp(near_reader_addresses[i], address, len) == 0 &&
+                near_reader_addresses[i][len] == '\0')
+            return i + 1;
+    }
+    if (near_reader_count == near_reader_slots) {
+        uint32_t slots = near_reader_slots ? near_reader_slots * 2 : 16;
+        char (*addresses)[NODE_ADDR_LEN] = realloc(near_reader_addresses, slots * sizeof(*addresses));
+        if (addresses == NULL)
+            return 0;
+        near_reader_addresses = addresses;
+        near_reader_slots = slots;
+    }
+    memcpy(near_reader_addresses[near_reader_count], address, len);
+    near_reader_addresses[near_reader_count][len] = '\0';
+    return ++near_reader_count;
+}
+
+/* Notes that the node at address near-caches the value of key we just served. */
+static bool near_reader_add(const char *key, size_t nkey, const char *address, size_t len) {
+    uint64_t hv = hash64(key, nkey);
+    near_readers *r = &near_reader_table[hv % NEAR_READERS_SIZE];
+    uint32_t id;
+    int i, free_slot = 0;
+
+    pthread_mutex_lock(&near_readers_lock);
+    if ((id = near_reader_id(address, len)) == 0) {
+        pthread_mutex_unlock(&near_readers_lock);
+        return false;
+    }
+    if (r->hv != hv || r->until <= current_time)
+        memset(r, 0, sizeof(*r));
+    r->hv = hv;
+    r->until = current_time + settings.near_cache_ttl + 1;
+    for (i = 0; i < NEAR_READERS_PER_KEY; i++) {
+        if (r->readers[i] == id)
+            break;
+        if (r->readers[i] == 0 && free_slot == 0)
+            free_slot = i + 1;
+    }
+    if (i == NEAR_READERS_PER_KEY)
+        r->readers[free_slot ? free_slot - 1 : id % NEAR_READERS_PER_KEY] = id;
+    pthread_mutex_unlock(&near_readers_lock);
+    return true;
+}
+
+/* Tells the nodes near-caching key that it changed. */
+static void near_readers_invalidate(conn *c, const char *key, size_t nkey) {
+    uint64_t hv = hash64(key, nkey);
+    near_readers *r = &near_reader_table[hv % NEAR_READERS_SIZE];
+    node_info readers[NEAR_READERS_PER_KEY];
+    int i, count = 0;
+
+    pthread_mutex_lock(&near_readers_lock);
+    if (r->hv != hv || r->until <= current_time) {
+        pthread_mutex_unlock(&near_readers_lock);
+        return;
+    }
+    for (i = 0; i < NEAR_READERS_PER_KEY; i++) {
+        if (r->readers[i] == 0)
+            continue;
+        memset(&readers[count], 0, sizeof(node_info));
+        strcpy(readers[count++].request_propogation, near_reader_addresses[r->readers[i] - 1]);
+    }
+    memset(r, 0, sizeof(*r));
+    pthread_mutex_unlock(&near_readers_lock);
+
+    for (i = 0; i < count; i++) {
+        pooled_connection *pc;
+        if ((pc = pooled_connection_to(&readers[i], c->thread->base)) != NULL)
+            pooled_connection_append(pc, PROTOCOL_NODE_CMD_INVALIDATE, (char *)key, nkey, NULL);
+    }
+    neighbour_pool_flush();
+}
+
+/* Called whenever we changed key on behalf of a client or a neighbour. */
+static void key_changed(conn *c, char *key) {
+    replicate_key(c, key);
+    near_readers_invalidate(c, key, strlen(key));
+}
+
+/*
+ * A split or merge hands handoff_zone from the GIVING node to the TAKING
+ * one, which owns it from the start: writes are not lost and reads don't
+ * miss while the keys are streamed across. The giving node forwards every
+ * request for a key of the zone to the taking node, and hands over its copy
+ * of the key, or word that it has none, ahead of the first one. The taking
+ * node serves a key itself once it has been handed over or streamed to it,
+ * and until then sends requests for it to the giving node, which hands it
+ * over on the way back. Whatever it got first settles the key, so a stale
+ * copy arriving later by the other path is dropped.
+ */
+static bool handoff_moving(char *key) {
+    return handoff_role != HANDOFF_NONE && is_within_boundary(key_point(key), handoff_zone) == 1;
+}
+
+/* Sends handoff_peer our copy of key on the pooled connection the request follows. */
+static void handoff_key(conn *c, char *key) {
+    size_t nkey = strlen(key);
+    item *it = item_get(key, nkey);
+    pooled_connection *pc = pooled_connection_to(&handoff_peer, c->thread->base);
+
+    if (pc != NULL && pooled_connection_append(pc,
+            it ? PROTOCOL_NODE_CMD_HANDOFF_SET : PROTOCOL_NODE_CMD_HANDOFF_DELETE, key, nkey, it) && it) {
+        item_unlink(it);
+    }
+    if (it)
+        item_remove(it);
+}
+
+
+/*
+ * Picks who serves a read of key: its owner or one of the owner's replicas,
+ * taking turns. Returns false if it is our own replica.
+ */
+static bool read_target(conn *c, char *key, node_info *target) {
+    node_info replicas[2];
+    int count;
+    unsigned int turn;
+
+    if (settings.replicas == 0 || handoff_moving(key) ||
+            !zone_map_lookup(key_point(key), target)) {
+        *target = route_key(c, key);
+        return true;
+    }
+    count = replicas_of(target->boundary, replicas);
+    turn = c->thread->read_turn++ % (count + 1);
+    if (turn > 0)
+        *target = replicas[turn - 1];
+    return !is_me(target);
+}
+
+/*
+ * Finds another copy of key for a read that target couldn't answer. Returns
+ * false if there is none; true with *target NULL if we hold it.
+ */
+static bool read_failover(conn *c, char *key, char *failed, node_info *target) {
+    node_info replicas[2];
+    int i, count;
+
+    if (settings.replicas == 0 || !zone_map_lookup(key_point(key), target))
+        return false;
+    if (strcmp(target->request_propogation, failed) != 0)
+        return true;
+    count = replicas_of(target->boundary, replicas);
+    for (i = 0; i < count; i++) {
+        if (strcmp(replicas[i].request_propogation, failed) != 0) {
+            *target = replicas[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Collects the keys we hold of other zones, leaving those a handoff is moving. */
+static void collect_replica_key(const char *key, const size_t nkey, void *arg) {
+    char buf[KEY_MAX_LENGTH + 1];
+
+    memcpy(buf, key, nkey);
+    buf[nkey] = '\0';
+    if (is_within_boundary(key_point(buf), me.boundary) != 1 && !handoff_moving(buf))
+        mylist_add((my_list *)arg, buf);
+}
+
+/*
+ * Drops our copies of keys whose owner, by the zone map, no longer has us
+ * as a replica. A split or handoff can move a key to an owner that doesn't
+ * mirror to us, and the copy left here would miss its writes, yet be read
+ * again if we became one of its replicas later. Called on each new map.
+ */
+static void drop_stale_replicas(void) {
+    node_info owner, replicas[2];
+    my_list keys;
+    int i, j, count, dropped = 0;
+
+    if (mode != NORMAL_NODE)
+        return;
+    mylist_init("replica_keys", &keys);
+    item_foreach_key(collect_replica_key, &keys);
+    for (i = 0; i < keys.size; i++) {
+        if (!zone_map_lookup(key_point(keys.array[i]), &owner))
+            continue;
+        count = replicas_of(owner.boundary, replicas);
+        for (j = 0; j < count && !is_me(&replicas[j]); j++)
+            ;
+        if (j == count)
+            dropped += delete_key_locally(keys.array[i]);
+    }
+    if (settings.verbose > 0 && dropped > 0)
+        fprintf(stderr, "dropped %d copies of zones we no longer mirror\n", dropped);
+    mylist_delete_all(&keys);
+}
+
+static float distance_squared(Point p1,Point p2){
+    float x_component = p1.x  - p2.x;
+    float y_component = p1.y  - p2.y;
+    return x_component*x_component + y_component*y_component;
+}
+
+static void centroid(ZoneBoundary b,Point *c){
+    c->x = b.from.x+ (b.to.x-b.from.x)/2;
+    c->y = b.from.y+ (b.to.y-b.from.y)/2;
+}
+
+/*
+ * Which edge of ours neighbour n borders, so a key outside our zone is
+ * handed to the neighbour on the side it lies towards.
+ */
+enum neighbour_side { SIDE_LEFT, SIDE_RIGHT, SIDE_BELOW, SIDE_ABOVE, SIDE_NONE };
+
+static enum neighbour_side neighbour_side(ZoneBoundary mine, ZoneBoundary n) {
+    if (same_edge(n.to.x, mine.from.x))
+        return SIDE_LEFT;
+    if (same_edge(n.from.x, mine.to.x))
+        return SIDE_RIGHT;
+    if (same_edge(n.to.y, mine.from.y))
+        return SIDE_BELOW;
+    if (same_edge(n.from.y, mine.to.y))
+        return SIDE_ABOVE;
+    return SIDE_NONE;
+}
+
+/* The side of mine that p lies beyond, along the axis it is furthest out on. */
+static enum neighbour_side side_towards(ZoneBoundary mine, Point p) {
+    float dx = p.x < mine.from.x ? mine.from.x - p.x : (p.x >= mine.to.x ? p.x - mine.to.x : 0);
+    float dy = p.y < mine.from.y ? mine.from.y - p.y : (p.y >= mine.to.y ? p.y - mine.to.y : 0);
+    if (dx == 0 && dy == 0)
+        return SIDE_NONE;
+    if (dx >= dy)
+        return p.x < mine.from.x ? SIDE_LEFT : SIDE_RIGHT;
+    return p.y < mine.from.y ? SIDE_BELOW : SIDE_ABOVE;
+}
+
+/*
+ * Picks the next hop for key. A neighbour owning the key is returned
+ * directly; otherwise the key goes to the neighbour on the side it lies
+ * towards whose edge spans the key's other coordinate, so each hop makes
+ * progress along one axis. The centroid distance is only a fallback for
+ * when no neighbour sits on that side.
+ */
+static node_info get_neighbour_information(char *key)
+{
+	int counter;
+	Point resolved_point = key_point(key);
+	enum neighbour_side towards = side_towards(me.boundary, resolved_point);
+	node_info best_neighbour = NULL_NODE_INFO;
+	float closest_distance = 99999999;
+	float best_span_distance = 99999999;
+	bool on_side = false;
+	for(counter=0;counter<neighbour_slots;counter++)
+	{
+	    node_info *n = &neighbour[counter];
+	    if(is_neighbour_info_not_valid(*n))
+	        continue;
+	    /* a suspected neighbour is routed around */
+	    if(node_suspected(n->request_propogation))
+	        continue;
+	    if(is_within_boundary(resolved_point,n->boundary)==1)
+	        return *n;
+	    if(towards != SIDE_NONE && neighbour_side(me.boundary,n->boundary) == towards) {
+	        /* how far the key's other coordinate is from this neighbour's edge */
+	        float c = (towards == SIDE_LEFT || towards == SIDE_RIGHT) ? resolved_point.y : resolved_point.x;
+	        float lo = (towards == SIDE_LEFT || towards == SIDE_RIGHT) ? n->boundary.from.y : n->boundary.from.x;
+	        float hi = (towards == SIDE_LEFT || towards == SIDE_RIGHT) ? n->boundary.to.y : n->boundary.to.x;
+	        float span_distance = c < lo ? lo - c : (c >= hi ? c - hi : 0);
+	        if(!on_side || span_distance < best_span_distance){
+	            best_neighbour = *n;
+	            best_span_distance = span_distance;
+	            on_side = true;
+	        }
+	    }
+	    else if(!on_side) {
+	        Point c;
+	        centroid(n->boundary,&c);
+	        float distance_from_this_neighbour = distance_squared(c,resolved_point);
+	        if(closest_distance>distance_from_this_neighbour){
+	            best_neighbour = *n;
+	            closest_distance = distance_from_this_neighbour;
+	        }
+	    }
+	}
+	if (settings.verbose > 1)
+	    fprintf(stderr,"Key is not in any neighbour's zone, forwarding it to %s\n",best_neighbour.request_propogation);
+	return best_neighbour;
+}
+
+static void print_boundaries(ZoneBoundary b) {
+	if (settings.verbose > 1) {
+		fprintf(stderr, "[(%f,%f) to (%f,%f)]\n", b.from.x, b.from.y, b.to.x,
+				b.to.y);
+	}
+}
+
+static void print_all_boundaries() {
+	if (settings.verbose > 1) {
+		fprintf(stderr, "Current boundaries:\n");
+		fprintf(stderr, "World boundary:");
+		print_boundaries(world_boundary);
+		fprintf(stderr, "My boundary:");
+		print_boundaries(me.boundary);
+		fprintf(stderr, "My new boundary:");
+		print_boundaries(my_new_boundary);
+	}
+}
+
+static void print_node_info(node_info n){
+    fprintf(stderr,"(%s,%s,%s,((%f,%f) to (%f,%f)))\n",
+                n.join_request,
+                n.request_propogation,
                 n.node_removal,
                 n.boundary.from.x,
                 n.boundary.from.y,
@@ -3227,41 +5334,637 @@ static void print_node_info(node_info n){
             );
 }
 
-static void print_ecosystem(){
-    fprintf(stderr,"------------\n");
-    fprintf(stderr,"Me:");
-    print_node_info(me);
-    int i=0;
-    fprintf(stderr,"Neighbours list:\n");
-    fprintf(stderr,"(Port numbers, boundary)\n");
-    for(i=0;i<10;i++){
-        if(strcmp(neighbour[i].node_removal,"NULL") || strcmp(neighbour[i].request_propogation,"NULL"))
-        {
-            fprintf(stderr,"%d\n",i);
-            print_node_info(neighbour[i]);
+static void print_ecosystem(){
+    /* it follows every change of our zone or neighbours */
+    if (settings.verbose < 2)
+        return;
+    fprintf(stderr,"------------\n");
+    fprintf(stderr,"Me:");
+    print_node_info(me);
+    int i=0;
+    fprintf(stderr,"Neighbours list:\n");
+    fprintf(stderr,"(Port numbers, boundary)\n");
+    for(i=0;i<neighbour_slots;i++){
+        if(strcmp(neighbour[i].node_removal,"NULL") || strcmp(neighbour[i].request_propogation,"NULL"))
+        {
+            fprintf(stderr,"%d\n",i);
+            print_node_info(neighbour[i]);
+        }
+    }
+    fprintf(stderr,"------------\n");
+}
+
+/*
+ * Keys of a get are resolved into c->ilist slots in request order. Keys
+ * owned by a neighbour are sent to it as one batch of quiet gets closed by
+ * a NOOP, so every owner is asked once and all of them in parallel; their
+ * slots are filled in by get_forwarded() as the hits come back.
+ * complete_get_response() then writes out the hits in order.
+ */
+/*
+ * Settles the reply to a batched get: returns true if it failed and was
+ * retried on a replica, which answers to the same handler and slot.
+ */
+static bool get_reply_retried(conn *c, forward_request *fr, int status, item **it) {
+    node_info replica;
+
+    if (status == -1 && fr->opcode == PROTOCOL_NODE_CMD_GETKQ &&
+            read_failover(c, fr->key, fr->port, &replica)) {
+        if (settings.verbose > 0)
+            fprintf(stderr, "get of %s: %s is unreachable, reading a replica\n", fr->key, fr->port);
+        if (is_me(&replica)) {
+            *it = item_get(fr->key, fr->nkey);
+        } else {
+            /* the failover is a plain get, answered on its own */
+            forward_to_neighbour(c, &replica, PROTOCOL_NODE_CMD_GET, fr->key, fr->nkey, NULL, fr->handler, fr->slot);
+            neighbour_pool_flush();
+            return true;
+        }
+    }
+    if (*it && fr->registered)
+        near_cache_store(*it);
+    if (settings.detail_enabled) {
+        stats_prefix_record_get(fr->key, fr->nkey, NULL != *it);
+    }
+    return false;
+}
+
+static void get_forwarded(conn *c, forward_request *fr, int status, item *it) {
+    if (!get_reply_retried(c, fr, status, &it))
+        *(c->ilist + fr->slot) = it;
+}
+
+typedef struct {
+    int count;
+    int size;
+    node_info *owner;       /* grows with the owners of a command's keys */
+} get_batches;
+
+/*
+ * Remembers info as one of the owners the batches are closed with. Returns
+ * the opcode to ask it with: a quiet get, or if we are out of memory a plain
+ * get, which is answered without a NOOP.
+ */
+static uint8_t get_batch_owner(get_batches *batches, node_info *info) {
+    int i;
+
+    for (i = 0; i < batches->count; i++) {
+        if (strcmp(batches->owner[i].request_propogation, info->request_propogation) == 0)
+            return PROTOCOL_NODE_CMD_GETKQ;
+    }
+    if (batches->count == batches->size) {
+        int nsize = batches->size ? batches->size * 2 : NEIGHBOUR_POOL_INITIAL;
+        node_info *nowner = realloc(batches->owner, sizeof(node_info) * nsize);
+        if (nowner == NULL)
+            return PROTOCOL_NODE_CMD_GET;
+        batches->owner = nowner;
+        batches->size = nsize;
+    }
+    batches->owner[batches->count++] = *info;
+    return PROTOCOL_NODE_CMD_GETKQ;
+}
+
+static void get_batch_to(conn *c, get_batches *batches, node_info *info, char *key, size_t nkey, int slot) {
+    uint8_t opcode = get_batch_owner(batches, info);
+    *(c->ilist + slot) = NULL;
+    forward_to_neighbour(c,info,opcode,key,nkey,NULL,get_forwarded,slot);
+}
+
+/* Batches key for whoever serves it; returns false if we hold its replica. */
+static bool get_batch_key(conn *c, get_batches *batches, char *key, size_t nkey, int slot) {
+    node_info info;
+
+    if (!read_target(c, key, &info))
+        return false;
+    get_batch_to(c, batches, &info, key, nkey, slot);
+    return true;
+}
+
+static void get_batches_reset(get_batches *batches) {
+    free(batches->owner);
+    batches->owner = NULL;
+    batches->count = batches->size = 0;
+}
+
+static void get_batches_close(conn *c, get_batches *batches) {
+    int i;
+    for (i = 0; i < batches->count; i++)
+        forward_to_neighbour(c,&batches->owner[i],PROTOCOL_NODE_CMD_NOOP,"",0,NULL,forward_ignore,0);
+    get_batches_reset(batches);
+}
+
+/*
+ * Binary gets of keys in other zones. Pipelined GETQ/GETKQ are added to a
+ * batch kept on the connection and queued for their owners as they are
+ * parsed, grouped per owner as in an ascii multiget. The batch is closed
+ * with a NOOP to each owner once the client sends anything else or we have
+ * run out of input, and its hits are then written out ahead of the reply
+ * to whatever comes next. Keys we serve ourselves are answered right away.
+ * A plain GET/GETK closes the batch it is added to.
+ */
+typedef struct {
+    item *it;               /* filled in by bin_get_forwarded() */
+    uint32_t opaque;
+    uint8_t opcode;         /* as the client sent it */
+    protocol_binary_response_get rsp;
+} bin_get;
+
+struct bin_get_batch {
+    get_batches owners;
+    bin_get *gets;
+    int size;
+    int used;
+};
+
+/*
+ * key must be terminated, which binary keys in the read buffer are not.
+ * During a handoff the zone is the taking node's, but only for keys it has.
+ */
+static bool key_in_other_zone(char *key) {
+    if (handoff_moving(key))
+        return handoff_role == HANDOFF_GIVING || tombstone_contains(&handoff_settled, key) != 1;
+    return is_within_boundary(key_point(key), me.boundary) != 1;
+}
+
+static bool bin_get_batch_open(conn *c) {
+    return c->bin_gets != NULL && c->bin_gets->used > 0;
+}
+
+static void bin_get_forwarded(conn *c, forward_request *fr, int status, item *it) {
+    if (!get_reply_retried(c, fr, status, &it))
+        c->bin_gets->gets[fr->slot].it = it;
+}
+
+/*
+ * Adds the get c is processing to its batch if another node serves the
+ * key. Returns false if we answer it ourselves, with *it our copy if any;
+ * a get that can't be batched is answered as a miss.
+ */
+static bool bin_get_batch_key(conn *c, char *key, size_t nkey, item **it) {
+    struct bin_get_batch *b = c->bin_gets;
+    char zkey[KEY_MAX_LENGTH + 1];
+    node_info info;
+    bin_get *g;
+
+    memcpy(zkey, key, nkey);
+    zkey[nkey] = '\0';
+    *it = NULL;
+    if (!key_in_other_zone(zkey) || (*it = near_cache_get(zkey, nkey)) != NULL)
+        return false;
+    if (!read_target(c, zkey, &info)) {
+        /* a key we replicate is read here, unless our copy is missing */
+        if ((*it = item_get(zkey, nkey)) != NULL)
+            return false;
+        info = route_key(c, zkey);
+    }
+
+    if (b == NULL && (b = c->bin_gets = calloc(1, sizeof(struct bin_get_batch))) == NULL)
+        return false;
+    if (b->used == b->size) {
+        int nsize = b->size ? b->size * 2 : ITEM_LIST_INITIAL;
+        bin_get *ngets = realloc(b->gets, sizeof(bin_get) * nsize);
+        if (ngets == NULL)
+            return false;
+        b->gets = ngets;
+        b->size = nsize;
+    }
+    g = &b->gets[b->used++];
+    g->it = NULL;
+    g->opaque = c->opaque;
+    g->opcode = c->binary_header.request.opcode;
+    forward_to_neighbour(c, &info, get_batch_owner(&b->owners, &info), zkey, nkey, NULL,
+            bin_get_forwarded, b->used - 1);
+    return true;
+}
+
+static void bin_get_header(bin_get *g, uint16_t status, uint8_t extlen,
+        uint16_t keylen, uint32_t bodylen, uint64_t cas) {
+    protocol_binary_response_header *header = &g->rsp.message.header;
+
+    memset(header, 0, sizeof(*header));
+    header->response.magic = (uint8_t) PROTOCOL_BINARY_RES;
+    header->response.opcode = g->opcode;
+    header->response.keylen = htons(keylen);
+    header->response.extlen = extlen;
+    header->response.datatype = (uint8_t) PROTOCOL_BINARY_RAW_BYTES;
+    header->response.status = htons(status);
+    header->response.bodylen = htonl(bodylen);
+    header->response.opaque = g->opaque;
+    header->response.cas = htonll(cas);
+}
+
+/* Writes out the answers to a closed batch; only plain gets report misses. */
+static void complete_bin_get_batch(conn *c) {
+    struct bin_get_batch *b = c->bin_gets;
+    int i, hits = 0;
+
+    if (b->used > c->isize) {
+        item **new_list = realloc(c->ilist, sizeof(item *) * b->used);
+        if (new_list == NULL) {
+            bin_get_batch_release(c);
+            write_bin_error(c, PROTOCOL_BINARY_RESPONSE_ENOMEM, 0);
+            return;
         }
+        c->ilist = new_list;
+        c->isize = b->used;
     }
-    fprintf(stderr,"------------\n");
+    c->msgcurr = 0;
+    c->msgused = 0;
+    c->iovused = 0;
+    if (add_msghdr(c) != 0) {
+        bin_get_batch_release(c);
+        write_bin_error(c, PROTOCOL_BINARY_RESPONSE_ENOMEM, 0);
+        return;
+    }
+
+    for (i = 0; i < b->used; i++) {
+        bin_get *g = &b->gets[i];
+        item *it = g->it;
+        bool keyed = g->opcode == PROTOCOL_BINARY_CMD_GETK || g->opcode == PROTOCOL_BINARY_CMD_GETKQ;
+        bool quiet = g->opcode == PROTOCOL_BINARY_CMD_GETQ || g->opcode == PROTOCOL_BINARY_CMD_GETKQ;
+
+        pthread_mutex_lock(&c->thread->stats.mutex);
+        c->thread->stats.get_cmds++;
+        if (it)
+            c->thread->stats.slab_stats[it->slabs_clsid].get_hits++;
+        else
+            c->thread->stats.get_misses++;
+        pthread_mutex_unlock(&c->thread->stats.mutex);
+
+        if (it == NULL) {
+            if (quiet)
+                continue;
+            /* the plain get is the last of its batch, its key is still in rbuf */
+            if (keyed) {
+                bin_get_header(g, PROTOCOL_BINARY_RESPONSE_KEY_ENOENT, 0, c->keylen, c->keylen, 0);
+                add_iov(c, g->rsp.bytes, sizeof(g->rsp.message.header));
+                add_iov(c, binary_get_key(c), c->keylen);
+            } else {
+                bin_get_header(g, PROTOCOL_BINARY_RESPONSE_KEY_ENOENT, 0, 0, strlen("Not found"), 0);
+                add_iov(c, g->rsp.bytes, sizeof(g->rsp.message.header));
+                add_iov(c, "Not found", strlen("Not found"));
+            }
+            continue;
+        }
+
+        MEMCACHED_COMMAND_GET(c->sfd, ITEM_key(it), it->nkey,
+                it->nbytes, ITEM_get_cas(it));
+        /* the length has two unnecessary bytes ("\r\n") */
+        bin_get_header(g, 0, sizeof(g->rsp.message.body), keyed ? it->nkey : 0,
+                sizeof(g->rsp.message.body) + (keyed ? it->nkey : 0) + it->nbytes - 2,
+                ITEM_get_cas(it));
+        g->rsp.message.body.flags = htonl(strtoul(ITEM_suffix(it), NULL, 10));
+        add_iov(c, g->rsp.bytes, sizeof(g->rsp.bytes));
+        if (keyed)
+            add_iov(c, ITEM_key(it), it->nkey);
+        add_iov(c, ITEM_data(it), it->nbytes - 2);
+        *(c->ilist + hits++) = it;
+    }
+    b->used = 0;
+
+    c->icurr = c->ilist;
+    c->ileft = hits;
+    if (c->iovused > 0) {
+        conn_set_state(c, conn_mwrite);
+        c->write_and_go = conn_new_cmd;
+    } else {
+        conn_set_state(c, conn_new_cmd);
+    }
+}
+
+/* Sends the batch's NOOPs and parks c until its owners have answered. */
+static void bin_get_batch_close(conn *c) {
+    get_batches_close(c, &c->bin_gets->owners);
+    conn_wait_for_forwards(c, complete_bin_get_batch);
+}
+
+/* Drops the hits of a batch that will not be written out. */
+static void bin_get_batch_release(conn *c) {
+    struct bin_get_batch *b = c->bin_gets;
+    int i;
+
+    if (b == NULL)
+        return;
+    for (i = 0; i < b->used; i++) {
+        if (b->gets[i].it)
+            item_remove(b->gets[i].it);
+    }
+    b->used = 0;
+    get_batches_reset(&b->owners);
+}
+
+static void bin_get_batch_free(conn *c) {
+    if (c->bin_gets) {
+        get_batches_reset(&c->bin_gets->owners);
+        free(c->bin_gets->gets);
+        free(c->bin_gets);
+        c->bin_gets = NULL;
+    }
+}
+
+/*
+ * Every other command on a key in another zone is sent to its owner, which
+ * executes it atomically and answers in one round trip; the completions
+ * below turn its answer into the client's reply.
+ */
+static void forward_key_to_owner(conn *c, uint8_t opcode, char *key, size_t nkey,
+        item *it, void (*completion)(conn *c)) {
+    node_info info = route_key(c, key);
+
+    near_cache_remove(key, nkey);
+    forward_to_neighbour(c, &info, opcode, key, nkey, it, forward_keep_status, 0);
+    conn_wait_for_forwards(c, completion);
+}
+
+static void forward_arithmetic(conn *c, char *key, size_t nkey, bool incr, uint64_t delta,
+        uint64_t initial, uint32_t exptime, uint64_t cas, void (*completion)(conn *c)) {
+    protocol_node_header h;
+    uint64_t value[2];
+    node_info info = route_key(c, key);
+
+    value[0] = htonll(delta);
+    value[1] = htonll(initial);
+    node_request_header(&h, incr ? PROTOCOL_NODE_CMD_INCREMENT : PROTOCOL_NODE_CMD_DECREMENT, nkey, NULL);
+    h.request.vallen = sizeof(value);
+    h.request.exptime = exptime;
+    h.request.cas = htonll(cas);
+    near_cache_remove(key, nkey);
+    forward_packet_to_neighbour(c, &info, &h, key, (char *) value, forward_keep_item, 0);
+    conn_wait_for_forwards(c, completion);
+}
+
+static void forward_touch(conn *c, char *key, size_t nkey, uint32_t exptime, void (*completion)(conn *c)) {
+    protocol_node_header h;
+    node_info info = route_key(c, key);
+
+    node_request_header(&h, PROTOCOL_NODE_CMD_TOUCH, nkey, NULL);
+    h.request.exptime = exptime;
+    near_cache_remove(key, nkey);
+    forward_packet_to_neighbour(c, &info, &h, key, NULL, forward_keep_item, 0);
+    conn_wait_for_forwards(c, completion);
+}
+
+static void complete_forwarded_store(conn *c) {
+    switch (c->forward_status) {
+    case PROTOCOL_NODE_RESPONSE_SUCCESS:
+        out_string(c, "STORED");
+        break;
+    case PROTOCOL_NODE_RESPONSE_KEY_EEXISTS:
+        out_string(c, "EXISTS");
+        break;
+    case PROTOCOL_NODE_RESPONSE_KEY_ENOENT:
+        out_string(c, "NOT_FOUND");
+        break;
+    case PROTOCOL_NODE_RESPONSE_NOT_STORED:
+        out_string(c, "NOT_STORED");
+        break;
+    case PROTOCOL_NODE_RESPONSE_ENOMEM:
+        out_string(c, "SERVER_ERROR out of memory storing object");
+        break;
+    default:
+        out_string(c, "SERVER_ERROR neighbour unreachable");
+    }
+}
+
+static void complete_forwarded_arithmetic(conn *c) {
+    char temp[INCR_MAX_STORAGE_LEN];
+    item *it = c->item;
+
+    switch (c->forward_status) {
+    case PROTOCOL_NODE_RESPONSE_SUCCESS:
+        snprintf(temp, sizeof(temp), "%.*s", it->nbytes - 2, ITEM_data(it));
+        item_remove(it);
+        c->item = NULL;
+        out_string(c, temp);
+        break;
+    case PROTOCOL_NODE_RESPONSE_KEY_ENOENT:
+        out_string(c, "NOT_FOUND");
+        break;
+    case PROTOCOL_NODE_RESPONSE_DELTA_BADVAL:
+        out_string(c, "CLIENT_ERROR cannot increment or decrement non-numeric value");
+        break;
+    case PROTOCOL_NODE_RESPONSE_ENOMEM:
+        out_string(c, "SERVER_ERROR out of memory");
+        break;
+    default:
+        out_string(c, "SERVER_ERROR neighbour unreachable");
+    }
+}
+
+static void complete_forwarded_touch(conn *c) {
+    switch (c->forward_status) {
+    case PROTOCOL_NODE_RESPONSE_SUCCESS:
+        item_remove(c->item);
+        c->item = NULL;
+        out_string(c, "TOUCHED");
+        break;
+    case PROTOCOL_NODE_RESPONSE_KEY_ENOENT:
+        out_string(c, "NOT_FOUND");
+        break;
+    default:
+        out_string(c, "SERVER_ERROR neighbour unreachable");
+    }
+}
+
+static void complete_bin_forwarded(conn *c) {
+    switch (c->forward_status) {
+    case PROTOCOL_NODE_RESPONSE_SUCCESS:
+        write_bin_response(c, NULL, 0, 0, 0);
+        break;
+    case PROTOCOL_NODE_RESPONSE_KEY_ENOENT:
+        write_bin_error(c, PROTOCOL_BINARY_RESPONSE_KEY_ENOENT, 0);
+        break;
+    case PROTOCOL_NODE_RESPONSE_KEY_EEXISTS:
+        write_bin_error(c, PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS, 0);
+        break;
+    case PROTOCOL_NODE_RESPONSE_NOT_STORED:
+        /* as complete_update_bin() reports a store that didn't happen */
+        if (c->cmd == NREAD_ADD)
+            write_bin_error(c, PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS, 0);
+        else if (c->cmd == NREAD_REPLACE)
+            write_bin_error(c, PROTOCOL_BINARY_RESPONSE_KEY_ENOENT, 0);
+        else
+            write_bin_error(c, PROTOCOL_BINARY_RESPONSE_NOT_STORED, 0);
+        break;
+    case PROTOCOL_NODE_RESPONSE_DELTA_BADVAL:
+        write_bin_error(c, PROTOCOL_BINARY_RESPONSE_DELTA_BADVAL, 0);
+        break;
+    case PROTOCOL_NODE_RESPONSE_ENOMEM:
+        write_bin_error(c, PROTOCOL_BINARY_RESPONSE_ENOMEM, 0);
+        break;
+    default:
+        write_bin_error(c, PROTOCOL_BINARY_RESPONSE_ETMPFAIL, 0);
+    }
+}
+
+static void complete_bin_forwarded_arithmetic(conn *c) {
+    protocol_binary_response_incr *rsp = (protocol_binary_response_incr *) c->wbuf;
+    item *it = c->item;
+
+    if (c->forward_status != PROTOCOL_NODE_RESPONSE_SUCCESS) {
+        complete_bin_forwarded(c);
+        return;
+    }
+    rsp->message.body.value = htonll(strtoull(ITEM_data(it), NULL, 10));
+    item_remove(it);
+    c->item = NULL;
+    write_bin_response(c, &rsp->message.body, 0, 0, sizeof(rsp->message.body.value));
+}
+
+static void complete_bin_forwarded_touch(conn *c) {
+    item *it = c->item;
+
+    if (c->forward_status != PROTOCOL_NODE_RESPONSE_SUCCESS &&
+            c->forward_status != PROTOCOL_NODE_RESPONSE_KEY_ENOENT) {
+        complete_bin_forwarded(c);
+        return;
+    }
+    c->item = NULL;
+    write_bin_touch(c, it, binary_get_key(c), c->binary_header.request.keylen);
+}
+
+static void complete_get_response(conn *c, bool return_cas) {
+	int slots = c->ileft;
+	int i, hits = 0;
+	item *it;
+	char *suffix;
+	bool failed = c->forward_status == PROTOCOL_NODE_RESPONSE_ENOMEM;
+	bool bad_key = c->forward_status == PROTOCOL_NODE_RESPONSE_EINVAL;
+
+	for (i = 0; i < slots; i++) {
+		it = *(c->ilist + i);
+		if (it == NULL) {
+			pthread_mutex_lock(&c->thread->stats.mutex);
+			c->thread->stats.get_misses++;
+			c->thread->stats.get_cmds++;
+			pthread_mutex_unlock(&c->thread->stats.mutex);
+			continue;
+		}
+		if (failed || bad_key) {
+			item_remove(it);
+			continue;
+		}
+
+		/*
+		 * Construct the response. Each hit adds three elements to the
+		 * outgoing data list:
+		 *   "VALUE "
+		 *   key
+		 *   " " + flags + " " + data length + "\r\n" + data (with \r\n)
+		 */
+
+		if (return_cas) {
+			MEMCACHED_COMMAND_GET(c->sfd, ITEM_key(it), it->nkey,
+					it->nbytes, ITEM_get_cas(it));
+			/* Goofy mid-flight realloc. */
+			if (hits >= c->suffixsize) {
+				char **new_suffix_list = realloc(c->suffixlist,
+						sizeof(char *) * c->suffixsize * 2);
+				if (new_suffix_list) {
+					c->suffixsize *= 2;
+					c->suffixlist = new_suffix_list;
+				} else {
+					item_remove(it);
+					failed = true;
+					continue;
+				}
+			}
+
+			suffix = cache_alloc(c->thread->suffix_cache);
+			if (suffix == NULL ) {
+				item_remove(it);
+				failed = true;
+				continue;
+			}
+			*(c->suffixlist + hits) = suffix;
+			int suffix_len = snprintf(suffix, SUFFIX_SIZE, " %llu\r\n",
+					(unsigned long long) ITEM_get_cas(it));
+			if (add_iov(c, "VALUE ", 6) != 0
+					|| add_iov(c, ITEM_key(it), it->nkey) != 0
+					|| add_iov(c, ITEM_suffix(it), it->nsuffix - 2) != 0
+					|| add_iov(c, suffix, suffix_len) != 0
+					|| add_iov(c, ITEM_data(it), it->nbytes) != 0) {
+				cache_free(c->thread->suffix_cache, suffix);
+				item_remove(it);
+				failed = true;
+				continue;
+			}
+		} else {
+			MEMCACHED_COMMAND_GET(c->sfd, ITEM_key(it), it->nkey,
+					it->nbytes, ITEM_get_cas(it));
+			if (add_iov(c, "VALUE ", 6) != 0
+					|| add_iov(c, ITEM_key(it), it->nkey) != 0
+					|| add_iov(c, ITEM_suffix(it),
+							it->nsuffix + it->nbytes) != 0) {
+				item_remove(it);
+				failed = true;
+				continue;
+			}
+		}
+
+		if (settings.verbose > 1)
+			fprintf(stderr, ">%d sending key %s\n", c->sfd,
+					ITEM_key(it));
+
+		/* item_get() has incremented it->refcount for us */
+		pthread_mutex_lock(&c->thread->stats.mutex);
+		c->thread->stats.slab_stats[it->slabs_clsid].get_hits++;
+		c->thread->stats.get_cmds++;
+		pthread_mutex_unlock(&c->thread->stats.mutex);
+		item_update(it);
+		*(c->ilist + hits) = it;
+		hits++;
+	}
+
+	c->icurr = c->ilist;
+	c->ileft = hits;
+	if (return_cas) {
+		c->suffixcurr = c->suffixlist;
+		c->suffixleft = hits;
+	}
+
+	if (settings.verbose > 1)
+		fprintf(stderr, ">%d END\n", c->sfd);
+
+	/*
+	 If the loop was terminated because of out-of-memory, it is not
+	 reliable to add END\r\n to the buffer, because it might not end
+	 in \r\n. So we send SERVER_ERROR instead.
+	 */
+	if (bad_key) {
+		out_string(c, "CLIENT_ERROR bad command line format");
+	} else if (failed || add_iov(c, "END\r\n", 5) != 0
+			|| (IS_UDP(c->transport) && build_udp_headers(c) != 0)) {
+		out_string(c, "SERVER_ERROR out of memory writing get response");
+	} else {
+		conn_set_state(c, conn_mwrite);
+		c->msgcurr = 0;
+	}
+}
+
+static void complete_get_command(conn *c) {
+	complete_get_response(c, false);
+}
+
+static void complete_gets_command(conn *c) {
+	complete_get_response(c, true);
 }
 
 /* ntokens is overwritten here... shrug.. */
 static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens,
 		bool return_cas) {
 	char *key;
-	char key2[1024];
 	size_t nkey;
-	int i = 0, time;
+	int i = 0;
 	item *it;
 	token_t *key_token = &tokens[KEY_TOKEN];
-	char *suffix;
+	get_batches batches;
 	assert(c != NULL);
-	char buf[1024];//, value[1024];
-	int flag;
-	int length;
-//	char *ptr_to_value;
-	it = NULL;
 
-    print_ecosystem();
+    batches.count = batches.size = 0;
+    batches.owner = NULL;
+	if (redirect_get(c, key_token))
+		return;
 
 	do {
 		while (key_token->length != 0) {
@@ -3270,205 +5973,56 @@ static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens,
 			nkey = key_token->length;
 
 			if (nkey > KEY_MAX_LENGTH) {
-				out_string(c, "CLIENT_ERROR bad command line format");
-				return;
+				if (i == 0 && c->forwards == 0) {
+					out_string(c, "CLIENT_ERROR bad command line format");
+					return;
+				}
+				/* answered once the keys already forwarded are back */
+				c->forward_status = PROTOCOL_NODE_RESPONSE_EINVAL;
+				break;
+			}
+			if (i >= c->isize) {
+				item **new_list = realloc(c->ilist, sizeof(item *) * c->isize * 2);
+				if (new_list) {
+					c->isize *= 2;
+					c->ilist = new_list;
+				} else {
+					c->forward_status = PROTOCOL_NODE_RESPONSE_ENOMEM;
+					break;
+				}
 			}
+			it = NULL;
 			Point resolved_point = key_point(key);
 			if (settings.verbose > 1)
 				fprintf(stderr, "Key %s resolves to point  = (%f,%f)\n", key,
 						resolved_point.x, resolved_point.y);
 
-            if(mode == NORMAL_NODE){
-                if(is_within_boundary(resolved_point,me.boundary)==1){
-                    it = item_get(key, nkey);
-                }
-                else{
-                    fprintf(stderr,"Point (%f,%f) is not in zoneboundry([%f,%f],[%f,%f])\n", resolved_point.x,resolved_point.y,me.boundary.from.x,me.boundary.from.y,me.boundary.to.x,me.boundary.to.y);
-
-                    node_info info = get_neighbour_information(key);
-
-                    //adding sleep
-                    usleep(1000);
-
-
-                    request_neighbour(key,buf,"get",&info,NULL);
-                    fprintf(stderr, "buf is : %s\n",buf);
-                    char *global_data_entry=(char*)pthread_getspecific(global_data_entry_t);
-                    fprintf(stderr," value is %s\n",global_data_entry);
-                    if(strncmp(buf,"NOT FOUND",9))
-                    {
-                        deserialize_key_value_str(key2,&flag,&time,&length,buf);
-                        fprintf(stderr,"final:%s %d %d %d",key2,flag,time,length);
-                        char *flag_as_str = (char*)malloc(sizeof(char)*5);
-                        sprintf(flag_as_str,"%d",flag);
-                        char *length_as_str = (char*)malloc(sizeof(char)*5);
-                        sprintf(length_as_str,"%d",length);
-  //                      ptr_to_value=value;
-                        add_iov(c, "VALUE ", 6);
-                        add_iov(c, key2, strlen(key2));
-                        add_iov(c, " ", 1);
-                        add_iov(c,  flag_as_str,strlen(flag_as_str));
-                        add_iov(c, " ", 1);
-                        add_iov(c,  length_as_str, strlen(length_as_str));
-                        add_iov(c, "\r\n", 2);
-                        pretty_print(global_data_entry,length,"process_get,received_this_value_from_neighbour");
-                        add_iov(c, global_data_entry,length);
-                        add_iov(c, "\r\n", 2);
-                        free(global_data_entry);
-                    }
-                }
+            if(!key_in_other_zone(key)){
+                it = item_get(key, nkey);
             }
-            else
-                if( mode == SPLITTING_PARENT_INIT ||
-                    mode == SPLITTING_PARENT_MIGRATING ||
-                    mode == SPLITTING_CHILD_INIT ||
-                    mode == SPLITTING_CHILD_MIGRATING ||
-                    mode == MERGING_PARENT_INIT ||
-                    mode == MERGING_PARENT_MIGRATING ||
-                    mode == MERGING_CHILD_INIT ||
-                    mode == MERGING_CHILD_MIGRATING
-                    )
-            {
-                if(is_within_boundary(resolved_point,my_new_boundary)==1){
-                    it = item_get(key, nkey);
+            else{
+                /* a key we replicate is read here, unless our copy is missing */
+                if ((it = near_cache_get(key, nkey)) != NULL)
+                    ;
+                else if (!get_batch_key(c, &batches, key, nkey, i) &&
+                        (it = item_get(key, nkey)) == NULL) {
+                    node_info owner = route_key(c, key);
+                    get_batch_to(c, &batches, &owner, key, nkey, i);
                 }
-                else{
-                    if(mylist_contains(&trash_both,key)==1)
-                    {
-                        fprintf(stderr,"key present in trash list, ignoring GETs\n");
-                        it=NULL;
-                    }
-                    else
-                    {
-                        fprintf(stderr,"Point (%f,%f)\n is not in new zoneboundry([%f,%f],[%f,%f])\n", resolved_point.x,resolved_point.y,my_new_boundary.from.x,my_new_boundary.from.y,my_new_boundary.to.x,my_new_boundary.to.y);
-
-                        it= item_get(key,nkey);
-                        if(it==NULL)
-                        {
-                            node_info info = get_neighbour_information(key);
-                            fprintf(stderr,"\n-------info-%s-\n",info.request_propogation);
-							request_neighbour(key,buf,"get",&info,NULL);
-							fprintf(stderr, "buf is : %s\n",buf);
-                            char *global_data_entry=(char*)pthread_getspecific(global_data_entry_t);
-							fprintf(stderr," value is %s\n",global_data_entry);
-							if(strncmp(buf,"NOT FOUND",9))
-							{
-								deserialize_key_value_str(key2,&flag,&time,&length,buf);
-								char *flag_as_str = (char*)malloc(sizeof(char)*5);
-                                sprintf(flag_as_str,"%d",flag);
-								char *length_as_str = (char*)malloc(sizeof(char)*5);
-                                sprintf(length_as_str,"%d",length);
-								fprintf(stderr,"final:%s %d %d %d",key2,flag,time,length);
-//								ptr_to_value=value;
-								add_iov(c, "VALUE ", 6);
-								add_iov(c, key2, strlen(key2));
-								add_iov(c, " ", 1);
-								add_iov(c,  flag_as_str,strlen(flag_as_str));
-								add_iov(c, " ", 1);
-								add_iov(c,  length_as_str, strlen(length_as_str));
-								add_iov(c, "\r\n", 2);
-                                pretty_print(global_data_entry,length,"process_get,received_this_value_from_neighbour");
-								add_iov(c, global_data_entry, length);
-								add_iov(c, "\r\n", 2);
-                                free(global_data_entry);
-
-							}
-                        }
-                    }
+                if (it == NULL) {
+                    i++;
+                    key_token++;
+                    continue;
                 }
             }
 
             if (settings.detail_enabled) {
                 stats_prefix_record_get(key, nkey, NULL != it);
             }
-            if (it) {
-                if (i >= c->isize) {
-                    item **new_list = realloc(c->ilist, sizeof(item *) * c->isize * 2);
-                    if (new_list) {
-                        c->isize *= 2;
-                        c->ilist = new_list;
-                    } else {
-                        item_remove(it);
-                        break;
-                    }
-                }
-
-				/*
-				 * Construct the response. Each hit adds three elements to the
-				 * outgoing data list:
-				 *   "VALUE "
-				 *   key
-				 *   " " + flags + " " + data length + "\r\n" + data (with \r\n)
-				 */
-
-				if (return_cas) {
-					MEMCACHED_COMMAND_GET(c->sfd, ITEM_key(it), it->nkey,
-							it->nbytes, ITEM_get_cas(it));
-					/* Goofy mid-flight realloc. */
-					if (i >= c->suffixsize) {
-						char **new_suffix_list = realloc(c->suffixlist,
-								sizeof(char *) * c->suffixsize * 2);
-						if (new_suffix_list) {
-							c->suffixsize *= 2;
-							c->suffixlist = new_suffix_list;
-						} else {
-							item_remove(it);
-							break;
-						}
-					}
-
-					suffix = cache_alloc(c->thread->suffix_cache);
-					if (suffix == NULL ) {
-						out_string(c,
-								"SERVER_ERROR out of memory making CAS suffix");
-						item_remove(it);
-						return;
-					}
-					*(c->suffixlist + i) = suffix;
-					int suffix_len = snprintf(suffix, SUFFIX_SIZE, " %llu\r\n",
-							(unsigned long long) ITEM_get_cas(it));
-					if (add_iov(c, "VALUE ", 6) != 0
-							|| add_iov(c, ITEM_key(it), it->nkey) != 0
-							|| add_iov(c, ITEM_suffix(it), it->nsuffix - 2) != 0
-							|| add_iov(c, suffix, suffix_len) != 0
-							|| add_iov(c, ITEM_data(it), it->nbytes) != 0) {
-						item_remove(it);
-						break;
-					}
-				} else {
-					MEMCACHED_COMMAND_GET(c->sfd, ITEM_key(it), it->nkey,
-							it->nbytes, ITEM_get_cas(it));
-					if (add_iov(c, "VALUE ", 6) != 0
-							|| add_iov(c, ITEM_key(it), it->nkey) != 0
-							|| add_iov(c, ITEM_suffix(it),
-									it->nsuffix + it->nbytes) != 0) {
-						item_remove(it);
-						break;
-					}
-				}
-
-
-                pretty_print(ITEM_data(it), it->nbytes,"process_get_command,all_cases");
-				if (settings.verbose > 1)
-					fprintf(stderr, ">%d sending key %s\n", c->sfd,
-							ITEM_key(it));
-
-				/* item_get() has incremented it->refcount for us */
-				pthread_mutex_lock(&c->thread->stats.mutex);
-				c->thread->stats.slab_stats[it->slabs_clsid].get_hits++;
-				c->thread->stats.get_cmds++;
-				pthread_mutex_unlock(&c->thread->stats.mutex);
-				item_update(it);
-				*(c->ilist + i) = it;
-				i++;
-
-			} else {
-				pthread_mutex_lock(&c->thread->stats.mutex);
-				c->thread->stats.get_misses++;
-				c->thread->stats.get_cmds++;
-				pthread_mutex_unlock(&c->thread->stats.mutex);
-				MEMCACHED_COMMAND_GET(c->sfd, key, nkey, -1, 0);
-			}
+            if (it == NULL)
+                MEMCACHED_COMMAND_GET(c->sfd, key, nkey, -1, 0);
+            *(c->ilist + i) = it;
+            i++;
 
 			key_token++;
 		}
@@ -3477,37 +6031,16 @@ static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens,
 		 * If the command string hasn't been fully processed, get the next set
 		 * of tokens.
 		 */
-		if (key_token->value != NULL ) {
+		if (key_token->value != NULL && c->forward_status == 0) {
 			ntokens = tokenize_command(key_token->value, tokens, MAX_TOKENS);
 			key_token = tokens;
 		}
 
-	} while (key_token->value != NULL );
+	} while (key_token->value != NULL && c->forward_status == 0);
 
-	c->icurr = c->ilist;
 	c->ileft = i;
-	if (return_cas) {
-		c->suffixcurr = c->suffixlist;
-		c->suffixleft = i;
-	}
-
-	if (settings.verbose > 1)
-		fprintf(stderr, ">%d END\n", c->sfd);
-
-	/*
-	 If the loop was terminated because of out-of-memory, it is not
-	 reliable to add END\r\n to the buffer, because it might not end
-	 in \r\n. So we send SERVER_ERROR instead.
-	 */
-	if (key_token->value != NULL || add_iov(c, "END\r\n", 5) != 0
-			|| (IS_UDP(c->transport) && build_udp_headers(c) != 0)) {
-		out_string(c, "SERVER_ERROR out of memory writing get response");
-	} else {
-		conn_set_state(c, conn_mwrite);
-		c->msgcurr = 0;
-	}
-
-	return;
+	get_batches_close(c, &batches);
+	conn_wait_for_forwards(c, return_cas ? complete_gets_command : complete_get_command);
 }
 
 static void process_update_command(conn *c, token_t *tokens,
@@ -3567,53 +6100,22 @@ static void process_update_command(conn *c, token_t *tokens,
 		stats_prefix_record_set(key, nkey);
 	}
 
-    if(mode == NORMAL_NODE){
-        Point resolved_point = key_point(key);
-        if(settings.verbose > 1)
-            fprintf(stderr,"Key %s resolves to point  = (%f,%f)\n", key,resolved_point.x,resolved_point.y);
-
-        if(is_within_boundary(resolved_point,my_new_boundary) == 1){
-            pthread_mutex_lock(&list_of_keys_lock);
-            mylist_delete(&list_of_keys, key);
-            mylist_add(&list_of_keys, key);
-            pthread_mutex_unlock(&list_of_keys_lock);
-        }
-        else {
-        // this update command request will be propagated to the right node when the code reaches drive_machine case conn_nread
-        }
-    }
-    else if( mode == SPLITTING_PARENT_INIT ||
-        mode == SPLITTING_PARENT_MIGRATING ||
-        mode == SPLITTING_CHILD_INIT ||
-        mode == SPLITTING_CHILD_MIGRATING ||
-        mode == MERGING_PARENT_INIT ||
-        mode == MERGING_PARENT_MIGRATING ||
-        mode == MERGING_CHILD_INIT ||
-        mode == MERGING_CHILD_MIGRATING
-    )
     {
         Point resolved_point = key_point(key);
+        char moved[128];
         if(settings.verbose > 1)
-        fprintf(stderr,"Key %s resolves to point  = (%f,%f)\n", key,resolved_point.x,resolved_point.y);
+            fprintf(stderr,"Key %s resolves to point  = (%f,%f)\n", key,resolved_point.x,resolved_point.y);
 
-        if(is_within_boundary(resolved_point,my_new_boundary) == 1){
-            pthread_mutex_lock(&list_of_keys_lock);
-            mylist_delete(&list_of_keys, key);
-            mylist_add(&list_of_keys, key);
-            pthread_mutex_unlock(&list_of_keys_lock);
-        }
-        else{
-            fprintf(stderr,"Point (%f,%f)\n is not in zoneboundry([%f,%f],[%f,%f])\n", resolved_point.x,resolved_point.y,my_new_boundary.from.x,my_new_boundary.from.y,my_new_boundary.to.x,my_new_boundary.to.y);
-            //fprintf(stderr,"SIMULATING PUT IGNORE; STORING key in trash_both");
-            out_string(c, "STORED");
-            mylist_add(&trash_both,key);
+        if (zone_map_moved(c, key, moved, sizeof(moved))) {
+            out_string(c, moved);
+            /* swallow the data line */
+            c->write_and_go = conn_swallow;
+            c->sbytes = vlen;
+            return;
         }
+        // keys outside our zone are forwarded once the value is read, see complete_nread_ascii()
     }
 
-    char *key_to_transfer=(char*)malloc(sizeof(char)*1024);
-    sprintf(key_to_transfer,"%s",key);
-    pthread_setspecific(key_to_transfer_t,key_to_transfer);
-    fprintf(stderr,"-------%d------",vlen);
     it = item_alloc(key, nkey, flags, realtime(exptime), vlen);
 
 	if (it == 0) {
@@ -3665,19 +6167,27 @@ static void process_touch_command(conn *c, token_t *tokens,
 	key = tokens[KEY_TOKEN].value;
 	nkey = tokens[KEY_TOKEN].length;
 
-	pthread_mutex_lock(&list_of_keys_lock);
-	mylist_delete(&list_of_keys, key);
-	mylist_add(&list_of_keys, key);
-	pthread_mutex_unlock(&list_of_keys_lock);
 
 	if (!safe_strtol(tokens[2].value, &exptime_int)) {
 		out_string(c, "CLIENT_ERROR invalid exptime argument");
 		return;
 	}
 
+	if (!handoff_hold_if_ours(key)) {
+		char moved[128];
+		if (zone_map_moved(c, key, moved, sizeof(moved)))
+			out_string(c, moved);
+		else
+			forward_touch(c, key, nkey, exptime_int, complete_forwarded_touch);
+		return;
+	}
+
 	it = item_touch(key, nkey, realtime(exptime_int));
+	handoff_release();
 	if (it) {
 		item_update(it);
+		if (mode == NORMAL_NODE)
+			key_changed(c, key);
 		pthread_mutex_lock(&c->thread->stats.mutex);
 		c->thread->stats.touch_cmds++;
 		c->thread->stats.slab_stats[it->slabs_clsid].touch_hits++;
@@ -3701,6 +6211,7 @@ static void process_arithmetic_command(conn *c, token_t *tokens,
 	uint64_t delta;
 	char *key;
 	size_t nkey;
+	enum delta_result_type ret;
 
 	assert(c != NULL);
 
@@ -3714,18 +6225,28 @@ static void process_arithmetic_command(conn *c, token_t *tokens,
 	key = tokens[KEY_TOKEN].value;
 	nkey = tokens[KEY_TOKEN].length;
 
-	pthread_mutex_lock(&list_of_keys_lock);
-	mylist_delete(&list_of_keys, key);
-	mylist_add(&list_of_keys, key);
-	pthread_mutex_unlock(&list_of_keys_lock);
 
 	if (!safe_strtoull(tokens[2].value, &delta)) {
 		out_string(c, "CLIENT_ERROR invalid numeric delta argument");
 		return;
 	}
 
-	switch (add_delta(c, key, nkey, incr, delta, temp, NULL )) {
+	if (!handoff_hold_if_ours(key)) {
+		char moved[128];
+		if (zone_map_moved(c, key, moved, sizeof(moved)))
+			out_string(c, moved);
+		else
+			forward_arithmetic(c, key, nkey, incr, delta, 0, 0xffffffff, 0,
+					complete_forwarded_arithmetic);
+		return;
+	}
+
+	ret = add_delta(c, key, nkey, incr, delta, temp, NULL );
+	handoff_release();
+	switch (ret) {
 	case OK:
+		if (mode == NORMAL_NODE)
+			key_changed(c, key);
 		out_string(c, temp);
 		break;
 	case NON_NUMERIC:
@@ -3842,17 +6363,18 @@ enum delta_result_type do_add_delta(conn *c, const char *key, const size_t nkey,
 	return OK;
 }
 
+/* Called holding the zone, see handoff_hold_if_ours(), which it releases. */
 static void _normal_delete_operation(conn *c, char* key,size_t nkey){
     item *it;
-    pthread_mutex_lock(&list_of_keys_lock);
-    mylist_delete(&list_of_keys, key);
-    pthread_mutex_unlock(&list_of_keys_lock);
 
     if (settings.detail_enabled) {
         stats_prefix_record_delete(key, nkey);
     }
 
     it = item_get(key, nkey);
+    if (it)
+        item_unlink(it);
+    handoff_release();
     if (it) {
         MEMCACHED_COMMAND_DELETE(c->sfd, ITEM_key(it), it->nkey);
 
@@ -3860,8 +6382,8 @@ static void _normal_delete_operation(conn *c, char* key,size_t nkey){
         c->thread->stats.slab_stats[it->slabs_clsid].delete_hits++;
         pthread_mutex_unlock(&c->thread->stats.mutex);
 
-        item_unlink(it);
         item_remove(it);      /* release our reference */
+        key_changed(c, key);
         out_string(c, "DELETED");
     } else {
         pthread_mutex_lock(&c->thread->stats.mutex);
@@ -3872,11 +6394,23 @@ static void _normal_delete_operation(conn *c, char* key,size_t nkey){
     }
 }
 
+static void complete_forwarded_delete(conn *c) {
+    switch (c->forward_status) {
+    case PROTOCOL_NODE_RESPONSE_SUCCESS:
+        out_string(c, "DELETED");
+        break;
+    case PROTOCOL_NODE_RESPONSE_KEY_ENOENT:
+        out_string(c, "NOT_FOUND");
+        break;
+    default:
+        out_string(c, "SERVER_ERROR neighbour unreachable");
+    }
+}
+
 static void process_delete_command(conn *c, token_t *tokens,
 		const size_t ntokens) {
 	char *key;
 	size_t nkey;
-	char buf[1024];
 	assert(c != NULL);
 
 	if (ntokens > 3) {
@@ -3898,44 +6432,20 @@ static void process_delete_command(conn *c, token_t *tokens,
 		out_string(c, "CLIENT_ERROR bad command line format");
 		return;
 	}
-	Point resolved_point = key_point(key);
 
-    if(mode == NORMAL_NODE){
-        if(is_within_boundary(resolved_point,me.boundary)==1){
-          _normal_delete_operation(c,key,nkey);
-        }
-        else{
-            fprintf(stderr,"Point (%f,%f)\n is not in zoneboundry([%f,%f],[%f,%f])\n", resolved_point.x,resolved_point.y,me.boundary.from.x,me.boundary.from.y,me.boundary.to.x,me.boundary.to.y);
-            node_info info = get_neighbour_information(key);
-            request_neighbour(key,buf,"delete",&info,NULL);
-            out_string(c, "DELETED");
-        }
+    if(handoff_hold_if_ours(key)){
+        _normal_delete_operation(c,key,nkey);
     }
-    else
-        if( mode == SPLITTING_PARENT_INIT ||
-            mode == SPLITTING_PARENT_MIGRATING ||
-            mode == SPLITTING_CHILD_INIT ||
-            mode == SPLITTING_CHILD_MIGRATING ||
-            mode == MERGING_PARENT_INIT ||
-            mode == MERGING_PARENT_MIGRATING ||
-            mode == MERGING_CHILD_INIT ||
-            mode == MERGING_CHILD_MIGRATING
-        )
-    {
-        if(is_within_boundary(resolved_point,my_new_boundary)==1){
-            _normal_delete_operation(c,key,nkey);
-        }
-        else
-        {
-            fprintf(stderr,"Point (%f,%f)\n is not in zoneboundry([%f,%f],[%f,%f])\n", resolved_point.x,resolved_point.y,my_new_boundary.from.x,my_new_boundary.from.y,my_new_boundary.to.x,my_new_boundary.to.y);
-            pthread_mutex_lock(&list_of_keys_lock);
-            mylist_delete(&list_of_keys, key);
-            mylist_add(&trash_both, key);
-            pthread_mutex_unlock(&list_of_keys_lock);
-
-            //out_string(c, "IGNORING DELETE; KEY STORED IN TRASH LIST");
-            out_string(c, "DELETED");
+    else{
+        char moved[128];
+        if (zone_map_moved(c, key, moved, sizeof(moved))) {
+            out_string(c, moved);
+            return;
         }
+        near_cache_remove(key, nkey);
+        node_info info = route_key(c, key);
+        forward_to_neighbour(c,&info,PROTOCOL_NODE_CMD_DELETE,key,nkey,NULL,forward_keep_status,0);
+        conn_wait_for_forwards(c, complete_forwarded_delete);
     }
 }
 
@@ -3975,112 +6485,314 @@ static void process_slabs_automove_command(conn *c, token_t *tokens,
 	return;
 }
 
-static void delete_key_locally(char *key) {
+/* Returns 1 if the key was found and deleted. */
+static int delete_key_locally(char *key) {
 	int nkey = strlen(key);
 	item* it = item_get(key, nkey);
 	if (it) {
 		item_unlink(it);
 		item_remove(it);
-		pthread_mutex_lock(&list_of_keys_lock);
-		mylist_delete(&list_of_keys, key);
-		pthread_mutex_unlock(&list_of_keys_lock);
+		return 1;
 	}
-}
-static void delete_key_on_child(int child_fd, char *key) {
-	//adding sleep before...
-	usleep(1000);
-	send(child_fd, key, strlen(key), 0);
-	usleep(1000);
-}
-
-static void receive_and_store_key_value(int sockfd,char* out_param_key,char *out_buf){
-    char key[1024];
-	int flag1, flag2, flag3, numbytes;
-
-    char buf2[1024];
-    memset(buf2, 0, 1024);
-    if ((numbytes = recv(sockfd, buf2, sizeof(buf2), 0)) == -1) {
-        perror("recv");
-        exit(1);
-    }
-    fprintf(stderr, "received %s\n", buf2);
-
-    deserialize_key_value_str(key, &flag1, &flag2, &flag3, buf2);
-    fprintf(stderr, "Client side:%s,%d,%d,%d\n", key, flag1, flag2, flag3);
+	return 0;
+}
 
-    item *it;
-    it = item_get(key, strlen(key));
-    fprintf(stderr,"store_key_value key %s\n",key);
-    if (it) {
-        item_unlink(it);
-        item_remove(it);
+/* Stores an item received from another node, replacing any older value. */
+static void link_item_locally(char *key, item *it) {
+    item *old_it = item_get(key, strlen(key));
+    if (settings.verbose > 1)
+        fprintf(stderr,"store_key_value key %s\n",key);
+    if (old_it) {
+        item_unlink(old_it);
+        item_remove(old_it);
     }
-    it = item_alloc(key, strlen(key), flag1, realtime(flag2), flag3+2);
-
-    //reads value in binary format from network
-    char *ptr = ITEM_data(it);
-    char *temp;
-    read(sockfd, ptr, flag3);
-    temp=ptr+flag3;
+    item_link(it);
 
+}
 
-  //  ptr=ptr+it->nbytes;
-    strcpy(temp,"\r\n");
-    item_link(it);
-    pretty_print(ITEM_data(it),flag3+2,"receive_and_store_key_value");
+/*
+ * A worker holds zone_lock from finding a key ours until it changed our copy,
+ * and whatever moves keys in or out of our zone waits for it: the keys a
+ * handoff collects after handoff_begin() include every write we acknowledged
+ * before, and later ones are forwarded. Holds are never nested and never span
+ * forwarding or key_changed(), which may run other connections.
+ */
+static bool handoff_hold_if_ours(char *key) {
+    pthread_rwlock_rdlock(&zone_lock);
+    if (!key_in_other_zone(key))
+        return true;
+    pthread_rwlock_unlock(&zone_lock);
+    return false;
+}
+
+static void handoff_release(void) {
+    pthread_rwlock_unlock(&zone_lock);
+}
+
+/* Takes the giving node's copy of key, it == NULL if it had none, unless settled. */
+static void handoff_receive(char *key, item *it) {
+    /* settled and stored at once, so a write right after isn't overwritten */
+    pthread_rwlock_wrlock(&zone_lock);
+    if (handoff_role == HANDOFF_TAKING && handoff_moving(key) &&
+            tombstone_add(&handoff_settled, key)) {
+        if (it)
+            link_item_locally(key, it);
+        else
+            delete_key_locally(key);
+    }
+    pthread_rwlock_unlock(&zone_lock);
+}
+
+static void handoff_begin(int role, ZoneBoundary zone, node_info *peer) {
+    pthread_rwlock_wrlock(&zone_lock);
+    pthread_mutex_lock(&handoff_lock);
+    tombstone_new_epoch(&handoff_settled);
+    handoff_zone = zone;
+    handoff_peer = *peer;
+    handoff_role = role;
+    pthread_mutex_unlock(&handoff_lock);
+    pthread_rwlock_unlock(&zone_lock);
+    fprintf(stderr, "handoff: %s zone ", role == HANDOFF_GIVING ? "giving" : "taking");
+    print_boundaries(zone);
+}
+
+/* Our zone becomes *boundary, if given, as the handoff ends. */
+static void handoff_end(ZoneBoundary *boundary) {
+    pthread_rwlock_wrlock(&zone_lock);
+    pthread_mutex_lock(&handoff_lock);
+    if (boundary)
+        me.boundary = *boundary;
+    handoff_role = HANDOFF_NONE;
+    tombstone_new_epoch(&handoff_settled);
+    pthread_cond_broadcast(&handoff_cond);
+    pthread_mutex_unlock(&handoff_lock);
+    pthread_rwlock_unlock(&zone_lock);
+}
+
+/* A lazily joined child may still be taking its zone when asked to split or merge. */
+static void handoff_wait(void) {
+    pthread_mutex_lock(&handoff_lock);
+    while (handoff_role != HANDOFF_NONE)
+        pthread_cond_wait(&handoff_cond, &handoff_lock);
+    pthread_mutex_unlock(&handoff_lock);
+}
 
-    pthread_mutex_lock(&list_of_keys_lock);
-    mylist_delete(&list_of_keys, key);
-    mylist_add(&list_of_keys, key);
-    pthread_mutex_unlock(&list_of_keys_lock);
-    if(out_param_key){
-        strcpy(out_param_key,key);
+/*
+ * Split and merge stream keys in batches of MIGRATE_BATCH items, written
+ * straight from item memory with one writev, and read back through a
+ * MIGRATE_BUFFER_SIZE buffer. settings.migration_rate caps the bytes per
+ * second so foreground traffic isn't starved; progress shows in stats.
+ */
+#define MIGRATE_BATCH 64
+#define MIGRATE_BUFFER_SIZE (64 * 1024)
+
+typedef struct {
+    struct timeval started;
+    struct timeval reported;
+    uint64_t keys;
+    uint64_t bytes;
+} migration_progress;
+
+static double seconds_since(struct timeval *then) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - then->tv_sec) + (now.tv_usec - then->tv_usec) / 1000000.0;
+}
+
+static void migration_start(migration_progress *p) {
+    memset(p, 0, sizeof(*p));
+    gettimeofday(&p->started, NULL);
+    p->reported = p->started;
+    STATS_LOCK();
+    stats.migration_running = true;
+    stats.migration_keys_per_sec = stats.migration_bytes_per_sec = 0;
+    STATS_UNLOCK();
+}
+
+static void migration_account(migration_progress *p, uint64_t keys, uint64_t bytes) {
+    double elapsed = seconds_since(&p->started);
+
+    p->keys += keys;
+    p->bytes += bytes;
+    STATS_LOCK();
+    stats.migration_keys += keys;
+    stats.migration_bytes += bytes;
+    if (elapsed > 0) {
+        stats.migration_keys_per_sec = p->keys / elapsed;
+        stats.migration_bytes_per_sec = p->bytes / elapsed;
     }
-    if(out_buf){
-        strcpy(out_buf,buf2);
+    STATS_UNLOCK();
+    if (settings.verbose > 0 && seconds_since(&p->reported) >= 1) {
+        gettimeofday(&p->reported, NULL);
+        fprintf(stderr, "migration: %llu keys, %llu bytes (%.0f keys/s, %.0f bytes/s)\n",
+                (unsigned long long)p->keys, (unsigned long long)p->bytes,
+                p->keys / elapsed, p->bytes / elapsed);
     }
 }
 
-static void _receive_keys_and_trash_keys(int sockfd) {
-	int MAXDATASIZE = 1024;
-	int total_keys_to_be_received = 0;
-	char buf[1024],buf2[1024];
-	int  numbytes, i = 0;
-	memset(buf, '\0', 1024);
-	if ((numbytes = recv(sockfd, buf,  sizeof(buf), 0)) == -1) {
-		perror("recv");
-		exit(1);
-	}
-	total_keys_to_be_received = atoi(buf);
-	fprintf(stderr, "Total keys to be received = %d\n",
-			total_keys_to_be_received);
+/* Sleeps until the bytes sent so far fit within settings.migration_rate. */
+static void migration_throttle(migration_progress *p) {
+    struct timespec delay;
+    double ahead;
+
+    if (settings.migration_rate == 0)
+        return;
+    ahead = (double)p->bytes / settings.migration_rate - seconds_since(&p->started);
+    if (ahead <= 0)
+        return;
+    delay.tv_sec = (time_t)ahead;
+    delay.tv_nsec = (long)((ahead - delay.tv_sec) * 1000000000);
+    while (nanosleep(&delay, &delay) == -1 && errno == EINTR)
+        ;
+}
+
+static void migration_finish(migration_progress *p) {
+    double elapsed = seconds_since(&p->started);
+    STATS_LOCK();
+    stats.migration_running = false;
+    STATS_UNLOCK();
+    fprintf(stderr, "migration: %llu keys, %llu bytes in %.3f s\n",
+            (unsigned long long)p->keys, (unsigned long long)p->bytes, elapsed);
+}
+
+typedef struct {
+    int fd;
+    size_t pos;
+    size_t len;
+    char buf[MIGRATE_BUFFER_SIZE];
+} node_stream;
+
+/* Like node_recv_all, but reads ahead into s->buf. */
+static int node_stream_read(node_stream *s, void *dst, size_t len) {
+    char *ptr = dst;
+    ssize_t res;
+    size_t chunk;
+
+    while (len > 0) {
+        if (s->pos == s->len) {
+            /* large values skip the buffer */
+            if (len >= sizeof(s->buf))
+                return node_recv_all(s->fd, ptr, len);
+            res = recv(s->fd, s->buf, sizeof(s->buf), 0);
+            if (res == 0)
+                return -1;
+            if (res == -1) {
+                if (errno == EINTR)
+                    continue;
+                return -1;
+            }
+            s->pos = 0;
+            s->len = res;
+        }
+        chunk = s->len - s->pos < len ? s->len - s->pos : len;
+        memcpy(ptr, s->buf + s->pos, chunk);
+        s->pos += chunk;
+        ptr += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
 
-	for (i = 0; i < total_keys_to_be_received; i++) {
-	    receive_and_store_key_value(sockfd,NULL,NULL);
-	}
+static int node_stream_skip(node_stream *s, size_t len) {
+    char scratch[1024];
+    while (len > 0) {
+        size_t chunk = len > sizeof(scratch) ? sizeof(scratch) : len;
+        if (node_stream_read(s, scratch, chunk) == -1)
+            return -1;
+        len -= chunk;
+    }
+    return 0;
+}
 
-	// The following should not be required, but without it, parent didn't receive trash list keys from child when child was departing
-	usleep(1000);
+/* Reads the header and key of the next message of a migration stream. */
+static int node_stream_message(node_stream *s, protocol_node_header *h, char *key) {
+    if (node_stream_read(s, h->bytes, sizeof(h->bytes)) == -1)
+        return -1;
+    if (h->request.magic != PROTOCOL_NODE_REQ) {
+        fprintf(stderr, "node_stream_message: invalid magic %x\n", h->request.magic);
+        return -1;
+    }
+    node_header_ntoh(h);
+    if (h->request.keylen > KEY_MAX_LENGTH ||
+            node_stream_read(s, key, h->request.keylen) == -1)
+        return -1;
+    key[h->request.keylen] = '\0';
+    return 0;
+}
 
-	memset(buf, '\0', 1024);
-	if ((numbytes = recv(sockfd, buf, MAXDATASIZE - 1, 0)) == -1) {
-		perror("recv");
-		exit(1);
-	}
-	total_keys_to_be_received = atoi(buf);
-	fprintf(stderr, "Total keys to be deleted = %d\n",
-			total_keys_to_be_received);
+/*
+ * Reads the value that follows h into a new unlinked item. *result is NULL
+ * if there was no memory for it, in which case the value is skipped.
+ */
+static int node_stream_item(node_stream *s, protocol_node_header *h, char *key, item **result) {
+    item *it = item_alloc(key, h->request.keylen, h->request.flags,
+            realtime(h->request.exptime), h->request.vallen + 2);
+    *result = NULL;
+    if (it == NULL) {
+        fprintf(stderr, "node_stream_item: no memory for key %s\n", key);
+        return node_stream_skip(s, h->request.vallen);
+    }
+    if (node_stream_read(s, ITEM_data(it), h->request.vallen) == -1) {
+        item_remove(it);
+        return -1;
+    }
+    memcpy(ITEM_data(it) + h->request.vallen, "\r\n", 2);
+    ITEM_set_cas(it, ntohll(h->request.cas));
+    *result = it;
+    return 0;
+}
 
-	for (i = 0; i < total_keys_to_be_received; i++) {
-		memset(buf2, '\0', 1024);
-		if ((numbytes = recv(sockfd, buf2, sizeof(buf2), 0)) == -1) {
-			perror("recv");
-			exit(1);
-		}
-		fprintf(stderr, "Received %s\n", buf2);
-		delete_key_locally(buf2);
-		fprintf(stderr, "deleting key %s\n", buf2);
-	}
+/*
+ * Receives the MIGRATE stream sent by _migrate_key_values, up to its END.
+ * Items go through handoff_receive(), so a key already handed over on
+ * its own isn't overwritten with the older copy. The receiver keeps to
+ * settings.migration_rate as well, so a lazily joined child can hold the
+ * stream of keys it hasn't been asked for in the background.
+ */
+static void _receive_keys(int sockfd) {
+	protocol_node_header h;
+	char key[KEY_MAX_LENGTH + 1];
+	item *it;
+	int received = 0;
+	node_stream *stream = malloc(sizeof(node_stream));
+	migration_progress progress;
+
+	if (stream == NULL) {
+	    fprintf(stderr, "_receive_keys: out of memory\n");
+	    exit(1);
+	}
+	stream->fd = sockfd;
+	stream->pos = stream->len = 0;
+
+	migration_start(&progress);
+	while (1) {
+	    if (node_stream_message(stream, &h, key) == -1) {
+	        perror("_receive_keys");
+	        exit(1);
+	    }
+	    if (h.request.opcode == PROTOCOL_NODE_CMD_END)
+	        break;
+	    if (h.request.opcode != PROTOCOL_NODE_CMD_MIGRATE) {
+	        fprintf(stderr, "_receive_keys: unexpected message %x\n", h.request.opcode);
+	        exit(1);
+	    }
+	    if (node_stream_item(stream, &h, key, &it) == -1) {
+	        perror("_receive_keys");
+	        exit(1);
+	    }
+	    if (it) {
+	        handoff_receive(key, it);
+	        item_remove(it);
+	        received++;
+	    }
+	    migration_account(&progress, 1,
+	            sizeof(h.bytes) + h.request.keylen + h.request.vallen);
+	    if (progress.keys % MIGRATE_BATCH == 0)
+	        migration_throttle(&progress);
+	}
+	migration_finish(&progress);
+	fprintf(stderr, "Total keys received = %d\n", received);
+	free(stream);
 }
 
 static void serialize_port_numbers(char *me_request_propogation,
@@ -4096,109 +6808,145 @@ static void serialize_port_numbers(char *me_request_propogation,
 static void deserialize_port_numbers2(char *s,char *neighbour_request_propogation,
 		char *neighbour_node_removal)
 {
-	sscanf(s, " %s %s ", neighbour_request_propogation,
+	sscanf(s, " %63s %63s ", neighbour_request_propogation,
 				neighbour_node_removal);
 }
 
+/*
+ * Sends every key of keys_to_send still linked here, MIGRATE_BATCH items
+ * per writev, then END. Keys already handed over on their own are gone.
+ * The caller deletes the keys once the other node has answered END.
+ */
 static void _migrate_key_values(int another_node_fd, my_list keys_to_send) {
-	int i = 0;
-	char *ptr, buf[1024], key_and_metadata_str[1024];
+	protocol_node_header headers[MIGRATE_BATCH];
+	struct iovec iov[MIGRATE_BATCH * 3];
+	item *batch[MIGRATE_BATCH];
+	int i, j, n = 0, iovcnt = 0;
+	uint64_t bytes = 0;
+	migration_progress progress;
 
-	fprintf(stderr, "The list of keys to be sent:\n");
-	mylist_print(&keys_to_send);
-
-	//v imp sleep
-	usleep(100000);
-	//usleep(10000*5);
-	sprintf(buf, "%d", keys_to_send.size);
-	if (send(another_node_fd, buf, strlen(buf), 0) == -1)
-		perror("send");
+	if (settings.verbose > 1) {
+		fprintf(stderr, "The list of keys to be sent:\n");
+		mylist_print(&keys_to_send);
+	}
 
+	migration_start(&progress);
 	for (i = 0; i < keys_to_send.size; i++) {
 		char *key = keys_to_send.array[i];
-		if(mylist_contains(&trash_both,key) != 1){
-			//adding one more zero
-            usleep(1000000);
-            fprintf(stderr,"key to migrate is %s\n",key);
-            fprintf(stderr,"length is %d\n",(int)strlen(key));
-            item *it = item_get(key, strlen(key));
-            ptr = strtok(ITEM_suffix(it), " ");
-            fprintf(stderr, "nbytes---%d", it->nbytes-2);
-            serialize_key_value_str(key, ptr, it->exptime, it->nbytes-2, key_and_metadata_str);
-            fprintf(stderr, "sending key_and_metadata_str %s\n", key_and_metadata_str);
-            send(another_node_fd, key_and_metadata_str, strlen(key_and_metadata_str), 0);
-            //adding zero
-            usleep(100000);
-            char *v = ITEM_data(it);
-            send(another_node_fd,v,it->nbytes-2,0);
-		}
-		delete_key_locally(key);
-	}
-}
-
-static void _trash_keys_in_both_nodes(int child_node_fd, my_list trash_both) {
-	int i = 0;
-	char buf[1024];
-	fprintf(stderr,
-			"number of keys to send for deleting is %d\nThe list of keys to be sent for deleting is:\n",
-			trash_both.size);
-	mylist_print(&trash_both);
+		item *it = item_get(key, strlen(key));
+
+		if (it) {
+			protocol_node_header *h = &headers[n];
+			node_item_header(h, PROTOCOL_NODE_REQ, PROTOCOL_NODE_CMD_MIGRATE, it);
+			iov[iovcnt].iov_base = h->bytes;
+			iov[iovcnt++].iov_len = sizeof(h->bytes);
+			iov[iovcnt].iov_base = ITEM_key(it);
+			iov[iovcnt++].iov_len = it->nkey;
+			iov[iovcnt].iov_base = ITEM_data(it);
+			iov[iovcnt++].iov_len = h->request.vallen;
+			bytes += sizeof(h->bytes) + it->nkey + h->request.vallen;
+			node_header_hton(h);
+			batch[n++] = it;
+		}
+		if (n == MIGRATE_BATCH || i == keys_to_send.size - 1) {
+			if (iovcnt > 0 && node_send_all(another_node_fd, iov, iovcnt) == -1)
+				perror("send");
+			for (j = 0; j < n; j++)
+				item_remove(batch[j]);
+			migration_account(&progress, n, bytes);
+			migration_throttle(&progress);
+			n = iovcnt = 0;
+			bytes = 0;
+		}
+	}
+	migration_finish(&progress);
+	if (node_send_key(another_node_fd, PROTOCOL_NODE_REQ, PROTOCOL_NODE_CMD_END, 0, NULL, 0) == -1)
+		perror("send");
+}
+
+/* Drops our copies of keys that now belong to the other node. */
+static void _delete_migrated_keys(my_list keys) {
+	int i;
+	for (i = 0; i < keys.size; i++)
+		delete_key_locally(keys.array[i]);
+}
 
-	sprintf(buf, "%d", trash_both.size);
+/* Collects the keys of linked items, optionally only those within zone. */
+typedef struct {
+    my_list *keys;
+    ZoneBoundary *zone;
+} key_collector;
 
-	//adding sleep before...
-		usleep(100000);
+static void collect_key(const char *key, const size_t nkey, void *arg) {
+    key_collector *collector = arg;
+    char buf[KEY_MAX_LENGTH + 1];
 
-	send(child_node_fd, buf, strlen(buf), 0);
+    memcpy(buf, key, nkey);
+    buf[nkey] = '\0';
+    if (collector->zone == NULL || is_within_boundary(key_point(buf), *collector->zone) == 1)
+        mylist_add(collector->keys, buf);
+}
 
-	//adding zeros
-	usleep(10000);
-	for (i = 0; i < trash_both.size; i++) {
-		char *key = trash_both.array[i];
-		delete_key_locally(key);
-		delete_key_on_child(child_node_fd, key);
-	}
-	mylist_delete_all(&trash_both);
+/*
+ * Cell of the grid along one axis holding the coordinate v, rounded up when
+ * v is the exclusive end of a range.
+ */
+static unsigned int grid_cell(float v, float from, float to, bool round_up) {
+    float cell = (v - from) / (to - from) * ITEM_GRID_SIDE;
+    unsigned int n;
+    if (cell <= 0)
+        return 0;
+    if (cell >= ITEM_GRID_SIDE)
+        return ITEM_GRID_SIDE;
+    n = (unsigned int) cell;
+    return round_up && n < cell ? n + 1 : n;
+}
+
+/* Only the grid cells overlapping zone are visited. */
+static void collect_keys(my_list *keys, ZoneBoundary *zone) {
+    key_collector collector = { keys, zone };
+    mylist_init("keys_to_send", keys);
+    if (zone == NULL) {
+        item_foreach_key(collect_key, &collector);
+        return;
+    }
+    item_foreach_key_in_cells(
+            grid_cell(zone->from.x, world_boundary.from.x, world_boundary.to.x, false),
+            grid_cell(zone->to.x, world_boundary.from.x, world_boundary.to.x, true),
+            grid_cell(zone->from.y, world_boundary.from.y, world_boundary.to.y, false),
+            grid_cell(zone->to.y, world_boundary.from.y, world_boundary.to.y, true),
+            collect_key, &collector);
 }
 
 static void* _parent_split_migrate_phase(void *arg){
-    int i=0;
     my_list keys_to_send;
     int child_fd = *((int*)(arg));
+    char buf[16];
 
     mode = SPLITTING_PARENT_MIGRATING;
     fprintf(stderr,"Mode changed: SPLITTING_PARENT_INIT -> SPLITTING_PARENT_MIGRATING\n");
 
-    pthread_mutex_lock(&list_of_keys_lock);
-    mylist_init("keys_to_send", &keys_to_send);
-    for (i = 0; i < list_of_keys.size; i++) {
-        char *key = list_of_keys.array[i];
-        Point resolved_point = key_point(key);
-        if (is_within_boundary(resolved_point, client_boundary) == 1)
-        {
-            mylist_add(&keys_to_send, key);
-            print_boundaries(client_boundary);
-        }
-    }
-    pthread_mutex_unlock(&list_of_keys_lock);
+    collect_keys(&keys_to_send, &client_boundary);
 
     fprintf(stderr, "Migrating keys:\n");
     _migrate_key_values(child_fd, keys_to_send);
-
-    fprintf(stderr, "Trashing keys in parent and child:\n");
-    _trash_keys_in_both_nodes(child_fd, trash_both);
-
+    /* the child owns the zone once it answers */
+    node_expect_message(child_fd, PROTOCOL_NODE_CMD_END, buf, sizeof(buf), "_parent_split_migrate_phase");
     close(child_fd); // parent doesn't need this
-    me.boundary = my_new_boundary;
-    print_all_boundaries();
+
     mode = NORMAL_NODE;
     fprintf(stderr,"Mode changed: SPLITTING_PARENT_MIGRATING -> NORMAL_NODE\n");
+    /* last, as a join waiting in handoff_wait() goes ahead from here */
+    handoff_end(&my_new_boundary);
+    print_all_boundaries();
+    _delete_migrated_keys(keys_to_send);
+    mylist_delete_all(&keys_to_send);
     print_ecosystem();
     return 0;
 }
 
 typedef struct tagSplitMigrateKeysArgs{
-    int child_fd;
+    int fd;                 /* the other side of the split */
     pthread_key_t *item_lock_type_key;
 } split_migrate_key_args;
 
@@ -4206,186 +6954,262 @@ static void* split_migrate_keys_routine(void *tagArgs){
     split_migrate_key_args *args = tagArgs;
     uint8_t lock_type = ITEM_LOCK_GRANULAR;
     pthread_setspecific(*(args->item_lock_type_key), &lock_type);
-    _parent_split_migrate_phase(&args->child_fd);
+    _parent_split_migrate_phase(&args->fd);
     return 0;
 }
 
-static void getting_key_from_neighbour(char *key, int neighbour_fd) {
-	char *ptr;
+static void complete_forwarded_node_get(conn *c) {
+    if (c->item)
+        write_node_response(c, PROTOCOL_NODE_RESPONSE_SUCCESS, c->item);
+    else
+        write_node_response(c, c->forward_status == -1 ? PROTOCOL_NODE_RESPONSE_ETMPFAIL : PROTOCOL_NODE_RESPONSE_KEY_ENOENT, NULL);
+}
+
+/* Answers a neighbour's GET, forwarding it if the key isn't ours. */
+static void getting_key_from_neighbour(conn *c, char *key, size_t nkey, char *value) {
 	item *it=NULL;
-	char key_and_metadata_str[1024],buf[1024];
-    char key1[1024];
-    int flag1, flag2, flag3;
-    int i;
 
-	Point resolved_point = key_point(key);
-	if(mode == NORMAL_NODE){
-	    if(is_within_boundary(resolved_point,me.boundary)==1)
-    	    it = item_get(key, strlen(key));
-        else{
-            fprintf(stderr,"Point (%f,%f)\n is not in zoneboundry([%f,%f],[%f,%f])\n", resolved_point.x,resolved_point.y,me.boundary.from.x,me.boundary.from.y,me.boundary.to.x,me.boundary.to.y);
-
-            node_info info = get_neighbour_information(key);
-            request_neighbour(key,buf,"get",&info,NULL);
-            fprintf(stderr, "buf is : %s\n",buf);
-            if(strncmp(buf,"NOT FOUND",9)==0){
-                 it=NULL;
-            }
-            else{
-                deserialize_key_value_str(key1, &flag1, &flag2, &flag3, buf);
-                fprintf(stderr, "Client side:%s,%d,%d,%d\n", key1, flag1, flag2, flag3);
+	if(!key_in_other_zone(key))
+	    it = item_get(key, nkey);
+	else if(settings.replicas > 0 && !handoff_moving(key) && (it = item_get(key, nkey)) != NULL)
+	    ;   /* our replica of a neighbour's key */
+	else{
+	    node_info info = route_key(c, key);
+	    forward_to_neighbour(c,&info,PROTOCOL_NODE_CMD_GET,key,nkey,NULL,forward_keep_item,0);
+	    conn_wait_for_forwards(c, complete_forwarded_node_get);
+	    return;
+	}
+	if (it && c->node_header.request.flags != 0 &&
+	        near_reader_add(key, nkey, value, c->node_header.request.vallen))
+	    c->node_header.request.reserved = 1;
+	write_node_response(c, it ? PROTOCOL_NODE_RESPONSE_SUCCESS : PROTOCOL_NODE_RESPONSE_KEY_ENOENT, it);
+}
 
-                it =  item_get(key1, strlen(key1));
-                if (it) {
-                    item_unlink(it);
-                    item_remove(it);
-                }
-                it = item_alloc(key1, strlen(key1), flag1, realtime(flag2), flag3+2);
+static void complete_forwarded_node_status(conn *c) {
+    write_node_response(c, c->forward_status == -1 ? PROTOCOL_NODE_RESPONSE_ETMPFAIL : c->forward_status, NULL);
+}
 
-                char *global_data_entry=(char*)pthread_getspecific(global_data_entry_t);
+static void complete_forwarded_node_result(conn *c) {
+    write_node_response(c, c->forward_status == -1 ? PROTOCOL_NODE_RESPONSE_ETMPFAIL : c->forward_status, c->item);
+}
 
-                fprintf(stderr,"Received in global: %s\n",global_data_entry);
-                ptr = ITEM_data(it);
-                for(i=0;i<flag3;i++){
-                    *ptr=global_data_entry[i];
-                    fprintf(stderr,"ptr=%c,glob=%c\n",*ptr,global_data_entry[i]);
-                    ptr++;
-                }
-                if(global_data_entry) free(global_data_entry);
-                strcpy(ptr,"\r\n");
-                fprintf(stderr,"Copied into ptr: %s\n",ptr);
-            }
-        }
-	}
-	else
-	if( mode == SPLITTING_PARENT_INIT ||
-        mode == SPLITTING_PARENT_MIGRATING ||
-        mode == SPLITTING_CHILD_INIT ||
-        mode == SPLITTING_CHILD_MIGRATING ||
-        mode == MERGING_PARENT_INIT ||
-        mode == MERGING_PARENT_MIGRATING ||
-        mode == MERGING_CHILD_INIT ||
-        mode == MERGING_CHILD_MIGRATING
-        )
-	{
-        if(mylist_contains(&trash_both,key)==1) {
-            fprintf(stderr,"key present in trash list, ignoring GETs\n");
-            it=NULL;
-        }
-        else it = item_get(key, strlen(key));
-	}
-	if(it)
-	{
-		ptr = strtok(ITEM_suffix(it), " ");
-		serialize_key_value_str(key, ptr, it->exptime, it->nbytes - 2, key_and_metadata_str);
-		fprintf(stderr,"key value str:%s\n", key_and_metadata_str);
-		//adding usleep
-		usleep(100000);
-		send(neighbour_fd, key_and_metadata_str, strlen(key_and_metadata_str), 0);
-		//adding zero
-		usleep(100000);
-        char *v = ITEM_data(it);
-        fprintf(stderr,"V is %s\n",v);
-        pretty_print(v,it->nbytes-2,"sending_this_value_to_neighbour_when_neighbour_asks_this_key");
-        send(neighbour_fd,v,it->nbytes-2,0);
-	} else {
-		send(neighbour_fd, "NOT FOUND", 9, 0);
-	}
+/* Passes the request c is processing on towards key's owner; the sender's map was stale. */
+static void node_relay_request(conn *c, char *key, char *value) {
+    protocol_node_header h = c->node_header;
+    node_info info = route_key(c, key);
+
+    h.request.cas = htonll(h.request.cas);
+    forward_packet_to_neighbour(c, &info, &h, key, value, forward_keep_item, 0);
+    conn_wait_for_forwards(c, complete_forwarded_node_result);
 }
 
-static void _propagate_update_command_if_required(char *key_to_transfer,char *set_command_to_execute){
-    char to_transfer[1024];
-    char buf[1024];
-    item *it = item_get(key_to_transfer, strlen(key_to_transfer));
-    char *ppp = ITEM_data(it);
-    pretty_print(ppp,it->nbytes,"just_after_Storing_key_value_locally");
-
-    Point resolved_point = key_point(key_to_transfer);
-    if (is_within_boundary(resolved_point, me.boundary) != 1) {
-        if(mylist_contains(&trash_both,key_to_transfer)!=1) {
-            fprintf(stderr,"storing key %s on neighbour\n",key_to_transfer);
-            // the +4 in the next line removes "set " from set_command_to_execute
-            sprintf(to_transfer, "%s", (set_command_to_execute+4));
-            fprintf(stderr,"set_command_to_execute is %s\n",set_command_to_execute);
-            fprintf(stderr,"to_transfer:%s\n",to_transfer);
-            node_info info = get_neighbour_information(key_to_transfer);
-            request_neighbour(to_transfer, buf, "set",&info,it);
-        }
-        pthread_mutex_lock(&list_of_keys_lock);
-        mylist_delete(&list_of_keys, key_to_transfer);
-        pthread_mutex_unlock(&list_of_keys_lock);
-        delete_key_locally(key_to_transfer);
-        fprintf(stderr,"in _propagate_update_command_if_required, deleted key %s fron this node.\n",key_to_transfer);
+/* Answers with a value that isn't held by an item: the result of an INCREMENT. */
+static void write_node_value(conn *c, char *key, size_t nkey, char *value) {
+    protocol_node_header *h = (protocol_node_header *)c->wbuf;
+    size_t vallen = strlen(value);
+
+    memset(h, 0, sizeof(*h));
+    h->request.magic = PROTOCOL_NODE_RES;
+    h->request.opcode = c->node_header.request.opcode;
+    h->request.keylen = nkey;
+    h->request.vallen = vallen;
+    h->request.opaque = c->node_header.request.opaque;
+    h->request.cas = htonll(c->cas);
+    node_header_hton(h);
+    memcpy(c->wbuf + sizeof(h->bytes), key, nkey);
+    memcpy(c->wbuf + sizeof(h->bytes) + nkey, value, vallen);
+
+    add_iov(c, c->wbuf, sizeof(h->bytes) + nkey + vallen);
+    conn_set_state(c, conn_mwrite);
+    c->write_and_go = conn_new_cmd;
+}
+
+/*
+ * Commands other nodes forward to the owner of a key, so that they are
+ * executed atomically where the key lives and answered in one round trip.
+ */
+static void storing_key_from_neighbour(conn *c, char *key, item *it) {
+    enum store_item_type ret;
+    uint16_t status;
+
+    if (!handoff_hold_if_ours(key)) {
+        node_relay_request(c, key, ITEM_data(it));
+        return;
     }
-    else {
-        fprintf(stderr,"storing key %s locally\n",key_to_transfer);
+    ret = store_item(it, node_store_command(c->node_header.request.opcode), c);
+    handoff_release();
+    switch (ret) {
+    case STORED:
+        key_changed(c, key);
+        status = PROTOCOL_NODE_RESPONSE_SUCCESS;
+        break;
+    case EXISTS:
+        status = PROTOCOL_NODE_RESPONSE_KEY_EEXISTS;
+        break;
+    case NOT_FOUND:
+        status = PROTOCOL_NODE_RESPONSE_KEY_ENOENT;
+        break;
+    default:
+        status = PROTOCOL_NODE_RESPONSE_NOT_STORED;
     }
+    write_node_response(c, status, NULL);
 }
 
-static void updating_key_from_neighbour(int new_fd){
-	char key[1024];
-	char set_command_to_execute_second_half[1024];
-    receive_and_store_key_value(new_fd,key,set_command_to_execute_second_half);
-    fprintf(stderr,"set_command_to_execute_second_half=%s\n",set_command_to_execute_second_half);
+static void arithmetic_from_neighbour(conn *c, char *key, size_t nkey, char *value) {
+    protocol_node_header *h = &c->node_header;
+    bool incr = h->request.opcode == PROTOCOL_NODE_CMD_INCREMENT;
+    char tmpbuf[INCR_MAX_STORAGE_LEN];
+    uint64_t delta, initial, cas = h->request.cas;
+    bool changed = false;
+    item *it;
 
-	if(mode == NORMAL_NODE){
-        char set_command_to_execute[1024];
-	    sprintf(set_command_to_execute,"set %s",set_command_to_execute_second_half);
-	    _propagate_update_command_if_required(key,set_command_to_execute);
+    if (h->request.vallen != sizeof(delta) + sizeof(initial)) {
+        write_node_response(c, PROTOCOL_NODE_RESPONSE_EINVAL, NULL);
+        return;
     }
-    else
-    if( mode == SPLITTING_PARENT_INIT ||
-        mode == SPLITTING_PARENT_MIGRATING ||
-        mode == SPLITTING_CHILD_INIT ||
-        mode == SPLITTING_CHILD_MIGRATING ||
-        mode == MERGING_PARENT_INIT ||
-        mode == MERGING_PARENT_MIGRATING ||
-        mode == MERGING_CHILD_INIT ||
-        mode == MERGING_CHILD_MIGRATING
-        )
-    {
-        if(mylist_contains(&trash_both,key)==1) {
-            fprintf(stderr,"key %s present in trash list, ignoring PUTs\n",key);
+    if (!handoff_hold_if_ours(key)) {
+        node_relay_request(c, key, value);
+        return;
+    }
+    memcpy(&delta, value, sizeof(delta));
+    memcpy(&initial, value + sizeof(delta), sizeof(initial));
+    delta = ntohll(delta);
+    initial = ntohll(initial);
+
+    switch (add_delta(c, key, nkey, incr, delta, tmpbuf, &cas)) {
+    case OK:
+        c->cas = cas;
+        changed = true;
+        write_node_value(c, key, nkey, tmpbuf);
+        break;
+    case NON_NUMERIC:
+        write_node_response(c, PROTOCOL_NODE_RESPONSE_DELTA_BADVAL, NULL);
+        break;
+    case EOM:
+        write_node_response(c, PROTOCOL_NODE_RESPONSE_ENOMEM, NULL);
+        break;
+    case DELTA_ITEM_NOT_FOUND:
+        if (h->request.exptime == 0xffffffff) {
+            pthread_mutex_lock(&c->thread->stats.mutex);
+            if (incr) {
+                c->thread->stats.incr_misses++;
+            } else {
+                c->thread->stats.decr_misses++;
+            }
+            pthread_mutex_unlock(&c->thread->stats.mutex);
+            write_node_response(c, PROTOCOL_NODE_RESPONSE_KEY_ENOENT, NULL);
+            break;
+        }
+        snprintf(tmpbuf, sizeof(tmpbuf), "%llu", (unsigned long long) initial);
+        it = item_alloc(key, nkey, 0, realtime(h->request.exptime), strlen(tmpbuf) + 2);
+        if (it == NULL) {
+            write_node_response(c, PROTOCOL_NODE_RESPONSE_ENOMEM, NULL);
+            break;
         }
-        else{
-            fprintf(stderr,"adding key %s to trash list and ignoring PUT\n",key);
-            mylist_add(&trash_both,key);
+        memcpy(ITEM_data(it), tmpbuf, strlen(tmpbuf));
+        memcpy(ITEM_data(it) + strlen(tmpbuf), "\r\n", 2);
+        if (store_item(it, NREAD_ADD, c) == STORED) {
+            changed = true;
+            write_node_value(c, key, nkey, tmpbuf);
+        } else {
+            write_node_response(c, PROTOCOL_NODE_RESPONSE_NOT_STORED, NULL);
         }
+        item_remove(it);
+        break;
+    case DELTA_ITEM_CAS_MISMATCH:
+        write_node_response(c, PROTOCOL_NODE_RESPONSE_KEY_EEXISTS, NULL);
+        break;
     }
+    handoff_release();
+    if (changed)
+        key_changed(c, key);
 }
 
-static void deleting_key_from_neighbour(char *key){
-    if(mode == NORMAL_NODE){
-    	Point resolved_point = key_point(key);
-        if(is_within_boundary(resolved_point,me.boundary)==1){
-            delete_key_locally(key);
-        }
-        else{
-            fprintf(stderr,"Point (%f,%f)\n is not in zoneboundry([%f,%f],[%f,%f])\n", resolved_point.x,resolved_point.y,me.boundary.from.x,me.boundary.from.y,me.boundary.to.x,me.boundary.to.y);
-            node_info info = get_neighbour_information(key);
-            char buf[1024];
-            request_neighbour(key,buf,"delete",&info,NULL);
-        }
+static void touching_key_from_neighbour(conn *c, char *key, size_t nkey) {
+    item *it;
+
+    if (!handoff_hold_if_ours(key)) {
+        node_relay_request(c, key, NULL);
+        return;
     }
+    it = item_touch(key, nkey, realtime(c->node_header.request.exptime));
+    handoff_release();
+    pthread_mutex_lock(&c->thread->stats.mutex);
+    c->thread->stats.touch_cmds++;
+    if (it)
+        c->thread->stats.slab_stats[it->slabs_clsid].touch_hits++;
     else
-    if( mode == SPLITTING_PARENT_INIT ||
-        mode == SPLITTING_PARENT_MIGRATING ||
-        mode == SPLITTING_CHILD_INIT ||
-        mode == SPLITTING_CHILD_MIGRATING ||
-        mode == MERGING_PARENT_INIT ||
-        mode == MERGING_PARENT_MIGRATING ||
-        mode == MERGING_CHILD_INIT ||
-        mode == MERGING_CHILD_MIGRATING
-        )
-    {
-        if(mylist_contains(&trash_both,key)==1) {
-            fprintf(stderr,"key present in trash list, ignoring DELETE\n");
-        }
-        else{
-            fprintf(stderr,"adding key to trash list and ignoring DELETE\n");
-            mylist_add(&trash_both,key);
-        }
+        c->thread->stats.touch_misses++;
+    pthread_mutex_unlock(&c->thread->stats.mutex);
+
+    if (it) {
+        item_update(it);
+        key_changed(c, key);
+        write_node_response(c, PROTOCOL_NODE_RESPONSE_SUCCESS, it);
+    } else {
+        write_node_response(c, PROTOCOL_NODE_RESPONSE_KEY_ENOENT, NULL);
+    }
+}
+
+/* Stores an item a neighbour sent us and replies once it reached its owner. */
+static void updating_key_from_neighbour(conn *c, char *key, item *it){
+    if (!handoff_hold_if_ours(key)) {
+        /* as in complete_nread_ascii(), pass on the value we were sent */
+        near_cache_remove(key, strlen(key));
+        node_info info = route_key(c, key);
+        forward_to_neighbour(c,&info,PROTOCOL_NODE_CMD_SET,key,strlen(key),it,forward_keep_status,0);
+    } else {
+        link_item_locally(key, it);
+        handoff_release();
+        key_changed(c, key);
+    }
+    conn_wait_for_forwards(c, complete_forwarded_node_status);
+}
+
+/* Deletes a key for a neighbour, forwarding if it isn't ours, and replies. */
+static void deleting_key_from_neighbour(conn *c, char *key){
+    if(handoff_hold_if_ours(key)){
+        int deleted = delete_key_locally(key);
+        handoff_release();
+        if (!deleted)
+            c->forward_status = PROTOCOL_NODE_RESPONSE_KEY_ENOENT;
+        else
+            key_changed(c, key);
+    }
+    else{
+        node_info info = route_key(c, key);
+        forward_to_neighbour(c,&info,PROTOCOL_NODE_CMD_DELETE,key,strlen(key),NULL,forward_keep_status,0);
     }
+    conn_wait_for_forwards(c, complete_forwarded_node_status);
+}
+
+static void serialize_node_info(node_info n,char *buf){
+    memset(buf,'\0',1024);
+    sprintf(buf,"%s %s (%f,%f) to (%f,%f)",
+            n.request_propogation,
+            n.node_removal,
+            n.boundary.from.x,
+            n.boundary.from.y,
+            n.boundary.to.x,
+            n.boundary.to.y
+            );
+    fprintf(stderr,"Serialized111: %s\n",buf);
+}
+
+static void deserialize_node_info(char *buf, node_info *n){
+    memset(n->join_request,'\0',sizeof(n->join_request));
+    memset(n->request_propogation,'\0',sizeof(n->request_propogation));
+    memset(n->node_removal,'\0',sizeof(n->node_removal));
+    sscanf(buf,"%63s %63s (%f,%f) to (%f,%f)",
+                           n->request_propogation,
+                           n->node_removal,
+                           &n->boundary.from.x,
+                           &n->boundary.from.y,
+                           &n->boundary.to.x,
+                           &n->boundary.to.y);
+    char buffer[1024];
+    serialize_node_info(*n,buffer);
+    fprintf(stderr,"Deserialized111: %s\n",buffer);
 }
 
 static int is_neighbour_info_not_valid(node_info n){
@@ -4397,20 +7221,8 @@ static void set_node_info(node_info *n,ZoneBoundary b,char *propagation_port_num
     n->boundary.from.y=b.from.y;
     n->boundary.to.x=b.to.x;
     n->boundary.to.y=b.to.y;
-    sprintf(n->request_propogation,"%s",propagation_port_number);
-    sprintf(n->node_removal,"%s",removal_port_number);
-}
-
-static void add_to_my_neighbours_list(node_info n) {
-    int counter =0;
-    for(counter=0;counter<10;counter++)
-    {
-        if(is_neighbour_info_not_valid(neighbour[counter]))
-        {
-            set_node_info(&neighbour[counter],n.boundary,n.request_propogation,n.node_removal);
-            break;
-        }
-    }
+    snprintf(n->request_propogation,sizeof(n->request_propogation),"%s",propagation_port_number);
+    snprintf(n->node_removal,sizeof(n->node_removal),"%s",removal_port_number);
 }
 
 static void copy_node_info(node_info in,node_info *out){
@@ -4420,146 +7232,355 @@ static void copy_node_info(node_info in,node_info *out){
     strcpy(out->node_removal,in.node_removal);
 }
 
+/*
+ * A zone can border any number of others, so the neighbour table doubles
+ * when it is full. Worker threads read it without a lock: a grown table is
+ * published before the new slot count and the old one is never freed. As
+ * the table only doubles, what is left behind is smaller than the live one.
+ */
+#define NEIGHBOUR_TABLE_INITIAL 8
+
+static void neighbour_table_grow(void) {
+    int i, slots = neighbour_slots ? neighbour_slots * 2 : NEIGHBOUR_TABLE_INITIAL;
+    node_info *table = malloc(slots * sizeof(node_info));
+
+    if (table == NULL) {
+        fprintf(stderr, "Failed to grow the neighbour table to %d entries\n", slots);
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < slots; i++)
+        copy_node_info(i < neighbour_slots ? neighbour[i] : NULL_NODE_INFO, &table[i]);
+    neighbour = table;
+    __sync_synchronize();
+    neighbour_slots = slots;
+}
+
+/* Index of the entry for the node with this propagation port, or -1. */
+static int neighbour_find(char *propagation_port_number) {
+    int i;
+    for (i = 0; i < neighbour_slots; i++) {
+        if (!is_neighbour_info_not_valid(neighbour[i]) &&
+                strcmp(neighbour[i].request_propogation, propagation_port_number) == 0)
+            return i;
+    }
+    return -1;
+}
+
+/* Index of an unused entry, growing the table if there is none. */
+static int neighbour_free_slot(void) {
+    int i;
+    for (i = 0; i < neighbour_slots; i++) {
+        if (is_neighbour_info_not_valid(neighbour[i]))
+            return i;
+    }
+    neighbour_table_grow();
+    return i;
+}
+
+/* Adds n, or refreshes its entry if it is already in the table. */
+static void add_to_my_neighbours_list(node_info n) {
+    int counter = neighbour_find(n.request_propogation);
+    if (counter == -1)
+        counter = neighbour_free_slot();
+    set_node_info(&neighbour[counter],n.boundary,n.request_propogation,n.node_removal);
+    neighbour_table_changed();
+}
+
 static void reset_neighbour_entry(int index){
     copy_node_info(NULL_NODE_INFO,&neighbour[index]);
+    neighbour_table_changed();
 }
 
-static void _update_neighbours_list(char *command, char *propagation_port_number,char *removal_port_number, ZoneBoundary boundary){
-    int i=0;
-    if(strcmp(command,ADD_NEIGHBOUR_COMMAND)==0){
-        for(i =0; i<10; i++){
-            if(!is_neighbour_info_not_valid(neighbour[i]) && strcmp(neighbour[i].request_propogation,propagation_port_number)==0){
-                // node present already, should have received an update command
-                set_node_info(&neighbour[i],boundary,propagation_port_number,removal_port_number);
-                break;
-            }
-            if(is_neighbour_info_not_valid(neighbour[i])){
-                set_node_info(&neighbour[i],boundary,propagation_port_number,removal_port_number);
-                break;
-            }
-        }
+static void _update_neighbours_list(uint8_t opcode, char *propagation_port_number,char *removal_port_number, ZoneBoundary boundary){
+    int i = neighbour_find(propagation_port_number);
+    if(opcode == PROTOCOL_NODE_CMD_ADD_NEIGHBOUR){
+        // a node present already should have received an update command
+        if(i == -1)
+            i = neighbour_free_slot();
+        set_node_info(&neighbour[i],boundary,propagation_port_number,removal_port_number);
     }
-    else if (strcmp(command,REMOVE_NEIGHBOUR_COMMAND)==0){
-        for(i =0; i<10; i++){
-            if(!is_neighbour_info_not_valid(neighbour[i]) && strcmp(neighbour[i].request_propogation,propagation_port_number)==0){
-                reset_neighbour_entry(i);
-                break;
-            }
-        }
+    else if (opcode == PROTOCOL_NODE_CMD_REMOVE_NEIGHBOUR){
+        if(i != -1)
+            reset_neighbour_entry(i);
     }
-    else if(strcmp(command,UPDATE_NEIGHBOUR_COMMAND)==0){
-        for(i =0; i<10; i++){
-            if(!is_neighbour_info_not_valid(neighbour[i]) && strcmp(neighbour[i].request_propogation,propagation_port_number)==0){
-                set_node_info(&neighbour[i],boundary,propagation_port_number,removal_port_number);
-                break;
-            }
-        }
+    else if(opcode == PROTOCOL_NODE_CMD_UPDATE_NEIGHBOUR){
+        if(i != -1)
+            set_node_info(&neighbour[i],boundary,propagation_port_number,removal_port_number);
     }
-    else fprintf(stderr,"Invalid neighbour list change command %s\n",command);
+    else fprintf(stderr,"Invalid neighbour list change command %x\n",opcode);
+    neighbour_table_changed();
 }
 
-static void *node_propagation_thread_routine(void *args){
-	if(settings.verbose>1)
-	        fprintf(stderr,"in node_propagation_thread_routine\n");
-	int sockfd, new_fd; // listen on sock_fd, new connection on new_fd
-	struct sigaction sa;
-
-	int MAXDATASIZE = 1024;
-	char buf[MAXDATASIZE];
-	int numbytes;
+/*
+ * The propagation and removal listeners pick their ports when they start.
+ * Anything that hands our ports to another node waits for both of them.
+ */
+static pthread_mutex_t node_ports_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t node_ports_cond = PTHREAD_COND_INITIALIZER;
+static int node_ports_bound = 0;
 
-	int port = find_port(&sockfd);
-	sprintf(me.request_propogation,"%d",port);
+static void node_port_bound(void) {
+    pthread_mutex_lock(&node_ports_lock);
+    node_ports_bound++;
+    pthread_cond_broadcast(&node_ports_cond);
+    pthread_mutex_unlock(&node_ports_lock);
+}
 
-	if (listen(sockfd, BACKLOG) == -1) {
-		perror("listen");
-		exit(1);
-	}
+static void wait_for_node_ports(void) {
+    pthread_mutex_lock(&node_ports_lock);
+    while (node_ports_bound < 2)
+        pthread_cond_wait(&node_ports_cond, &node_ports_lock);
+    pthread_mutex_unlock(&node_ports_lock);
+}
 
-	sa.sa_handler = sigchld_handler; // reap all dead processes
-	sigemptyset(&sa.sa_mask);
-	sa.sa_flags = SA_RESTART;
+/*
+ * The propagation port is served by the worker threads like a client port.
+ * Connections that start with PROTOCOL_NODE_REQ are switched to node_prot
+ * in try_read_command(), so neighbours can pipeline requests and many of
+ * them are served at once.
+ */
+static void write_node_response(conn *c, uint16_t status, item *it) {
+    protocol_node_header *h = (protocol_node_header *)c->wbuf;
+    uint8_t opcode = c->node_header.request.opcode;
+
+    if (it && item_expired(it) && (opcode == PROTOCOL_NODE_CMD_GET || opcode == PROTOCOL_NODE_CMD_GETKQ)) {
+        /* it expired since we found it; the asker gets a miss */
+        if (c->item == it)
+            c->item = NULL;
+        item_remove(it);
+        it = NULL;
+        status = PROTOCOL_NODE_RESPONSE_KEY_ENOENT;
+    }
+    if (opcode == PROTOCOL_NODE_CMD_GETKQ && it == NULL) {
+        /* quiet get misses aren't answered */
+        conn_set_state(c, conn_new_cmd);
+        return;
+    }
 
-	if (sigaction(SIGCHLD, &sa, NULL ) == -1) {
-		perror("sigaction");
-		exit(1);
-	}
-	fprintf(stderr,
-			"node_propagation_thread_routine : server: waiting for connections...\n");
+    if (it) {
+        node_item_header(h, PROTOCOL_NODE_RES, opcode, it);
+    } else {
+        memset(h, 0, sizeof(*h));
+        h->request.magic = PROTOCOL_NODE_RES;
+        h->request.opcode = opcode;
+        h->request.cas = htonll(c->cas);
+    }
+    h->request.status = status;
+    h->request.opaque = c->node_header.request.opaque;
+    /* set by getting_key_from_neighbour() once the sender is noted as a near-cache reader */
+    h->request.reserved = c->node_header.request.reserved;
+    node_header_hton(h);
 
-	while (1) { // main accept() loop
-	    new_fd = receive_connection_from_client(sockfd,"node_propagation_thread_routine");
-		memset(buf, '\0', 1024);
-		if ((numbytes = recv(new_fd, buf, MAXDATASIZE - 1, 0)) == -1) {
-			perror("recv");
-			exit(1);
-		}
+    add_iov(c, h->bytes, sizeof(h->bytes));
+    if (it) {
+        add_iov(c, ITEM_key(it), it->nkey);
+        add_iov(c, ITEM_data(it), it->nbytes - 2);
+        /* released by reset_cmd_handler() once the response is written */
+        c->item = it;
+    }
+    conn_set_state(c, conn_mwrite);
+    c->write_and_go = conn_new_cmd;
+}
 
-		if (!strcmp(buf, "get")) {
-			memset(buf, '\0', 1024);
-			if ((numbytes = recv(new_fd, buf, MAXDATASIZE - 1, 0)) == -1) {
-				perror("recv");
-				exit(1);
-			}
+static void process_node_update_command(conn *c, char *key, size_t nkey) {
+    protocol_node_header *h = &c->node_header;
+    item *it = item_alloc(key, nkey, h->request.flags, realtime(h->request.exptime), h->request.vallen + 2);
 
-			getting_key_from_neighbour(buf, new_fd);
-		}
-		else if (!strcmp(buf, "set")) {
-			    updating_key_from_neighbour(new_fd);
-			    //adding usleep
-			    usleep(10000);
+    if (it == NULL) {
+        /* swallow the value */
+        c->sbytes = h->request.vallen;
+        if (h->request.opcode == PROTOCOL_NODE_CMD_REPLICA_SET ||
+                h->request.opcode == PROTOCOL_NODE_CMD_HANDOFF_SET) {
+            conn_set_state(c, conn_swallow);
+            return;
+        }
+        write_node_response(c, PROTOCOL_NODE_RESPONSE_ENOMEM, NULL);
+        c->write_and_go = conn_swallow;
+        return;
+    }
+    ITEM_set_cas(it, h->request.cas);
+    c->item = it;
+    c->ritem = ITEM_data(it);
+    c->rlbytes = h->request.vallen;
+    conn_set_state(c, conn_nread);
+}
+
+static void complete_nread_node(conn *c) {
+    item *it = c->item;
+    char key[KEY_MAX_LENGTH + 1];
+
+    memcpy(ITEM_data(it) + it->nbytes - 2, "\r\n", 2);
+    memcpy(key, ITEM_key(it), it->nkey);
+    key[it->nkey] = '\0';
+    c->item = 0;
+    if (c->node_header.request.opcode == PROTOCOL_NODE_CMD_REPLICA_SET) {
+        link_item_locally(key, it);
+        /* keep the owner's cas, so a gets read here can cas there */
+        ITEM_set_cas(it, c->node_header.request.cas);
+        near_readers_invalidate(c, key, it->nkey);
+        conn_set_state(c, conn_new_cmd);
+    } else if (c->node_header.request.opcode == PROTOCOL_NODE_CMD_HANDOFF_SET) {
+        handoff_receive(key, it);
+        conn_set_state(c, conn_new_cmd);
+    } else if (c->node_header.request.opcode == PROTOCOL_NODE_CMD_SET) {
+        updating_key_from_neighbour(c, key, it);
+    } else {
+        storing_key_from_neighbour(c, key, it);
+    }
+    item_remove(it);
+}
 
-            if ((numbytes = send(new_fd, "STORED", strlen("STORED"), 0)) == -1) {
-                perror("recv");
-                exit(1);
-            }
+static void process_node_command(conn *c, char *key, size_t nkey, char *value) {
+    protocol_node_header *h = &c->node_header;
+    char buf[1024];
+    node_info n;
 
+    switch (h->request.opcode) {
+    case PROTOCOL_NODE_CMD_GET:
+    case PROTOCOL_NODE_CMD_GETKQ:
+        getting_key_from_neighbour(c, key, nkey, value);
+        break;
+    case PROTOCOL_NODE_CMD_SET:
+    case PROTOCOL_NODE_CMD_REPLICA_SET:
+    case PROTOCOL_NODE_CMD_HANDOFF_SET:
+    case PROTOCOL_NODE_CMD_ADD:
+    case PROTOCOL_NODE_CMD_REPLACE:
+    case PROTOCOL_NODE_CMD_APPEND:
+    case PROTOCOL_NODE_CMD_PREPEND:
+    case PROTOCOL_NODE_CMD_CAS:
+        process_node_update_command(c, key, nkey);
+        break;
+    case PROTOCOL_NODE_CMD_INCREMENT:
+    case PROTOCOL_NODE_CMD_DECREMENT:
+        arithmetic_from_neighbour(c, key, nkey, value);
+        break;
+    case PROTOCOL_NODE_CMD_TOUCH:
+        touching_key_from_neighbour(c, key, nkey);
+        break;
+    case PROTOCOL_NODE_CMD_REPLICA_DELETE:
+        delete_key_locally(key);
+        near_readers_invalidate(c, key, nkey);
+        conn_set_state(c, conn_new_cmd);
+        break;
+    case PROTOCOL_NODE_CMD_INVALIDATE:
+        near_cache_remove(key, nkey);
+        conn_set_state(c, conn_new_cmd);
+        break;
+    case PROTOCOL_NODE_CMD_HANDOFF_DELETE:
+        handoff_receive(key, NULL);
+        conn_set_state(c, conn_new_cmd);
+        break;
+    case PROTOCOL_NODE_CMD_DELETE:
+        deleting_key_from_neighbour(c, key);
+        break;
+    case PROTOCOL_NODE_CMD_NOOP:
+        write_node_response(c, PROTOCOL_NODE_RESPONSE_SUCCESS, NULL);
+        break;
+    case PROTOCOL_NODE_CMD_ADD_NEIGHBOUR:
+    case PROTOCOL_NODE_CMD_REMOVE_NEIGHBOUR:
+    case PROTOCOL_NODE_CMD_UPDATE_NEIGHBOUR:
+        if (h->request.vallen >= sizeof(buf)) {
+            write_node_response(c, PROTOCOL_NODE_RESPONSE_EINVAL, NULL);
+            break;
         }
-        else if(!strcmp(buf,"delete"))
-        {
-            memset(buf,'\0',1024);
-            if ((numbytes = recv(new_fd, buf, MAXDATASIZE-1, 0)) == -1) {
-                perror("recv");
-                exit(1);
-            }
+        memcpy(buf, value, h->request.vallen);
+        buf[h->request.vallen] = '\0';
+        if (settings.verbose > 1)
+            fprintf(stderr,"Neighbour command %x received: %s\n",h->request.opcode,buf);
+        deserialize_node_info(buf,&n);
+        _update_neighbours_list(h->request.opcode,n.request_propogation,n.node_removal,n.boundary);
+        print_ecosystem();
+        write_node_response(c, PROTOCOL_NODE_RESPONSE_SUCCESS, NULL);
+        break;
+    default:
+        fprintf(stderr,"process_node_command: unknown request %x\n",h->request.opcode);
+        write_node_response(c, PROTOCOL_NODE_RESPONSE_UNKNOWN_COMMAND, NULL);
+    }
+}
 
-            deleting_key_from_neighbour(buf);
-            //adding usleep
-            			    usleep(10000);
-            if ((numbytes = send(new_fd, "DELETED", strlen("DELETED"), 0)) == -1) {
-                perror("recv");
-                exit(1);
-            }
+/* Largest value we buffer for a request that isn't read into an item */
+#define NODE_MAX_MESSAGE (1024 * 1024)
+
+static int try_read_node_command(conn *c) {
+    protocol_node_header *h = &c->node_header;
+    char key[KEY_MAX_LENGTH + 1];
+    size_t need;
+
+    if (c->rbytes < sizeof(h->bytes))
+        return 0;
+    memcpy(h->bytes, c->rcurr, sizeof(h->bytes));
+    node_header_ntoh(h);
+    h->request.cas = ntohll(h->request.cas);
+    if (h->request.magic != PROTOCOL_NODE_REQ || h->request.keylen > KEY_MAX_LENGTH) {
+        if (settings.verbose)
+            fprintf(stderr, "Invalid node request: magic %x, keylen %u\n",
+                    h->request.magic, h->request.keylen);
+        conn_set_state(c, conn_closing);
+        return -1;
+    }
+
+    /* A SET value is read straight into the item, anything else is buffered whole */
+    need = sizeof(h->bytes) + h->request.keylen;
+    if (!node_request_has_item(h->request.opcode)) {
+        if (h->request.vallen > NODE_MAX_MESSAGE) {
+            if (settings.verbose)
+                fprintf(stderr, "Node request of %u bytes is too large\n", h->request.vallen);
+            conn_set_state(c, conn_closing);
+            return -1;
         }
-        else if(!strcmp(buf,ADD_NEIGHBOUR_COMMAND) || !strcmp(buf,REMOVE_NEIGHBOUR_COMMAND) || !strcmp(buf,UPDATE_NEIGHBOUR_COMMAND)){
-            char command[1024],propagation_port_number[1024],removal_port_number[1024],boundarystr[1024];
-            ZoneBoundary boundary;
-            memset(command,'\0',1024);
-            memset(propagation_port_number,'\0',1024);
-            memset(removal_port_number,'\0',1024);
-            memset(boundarystr,'\0',1024);
-
-            fprintf(stderr,"%s command received\n",buf);
-            sprintf(command,"%s",buf);
-
-            memset(buf,'\0',1024);
-            if ((numbytes = recv(new_fd, buf, MAXDATASIZE-1, 0)) == -1) {
-                perror("recv");
-                exit(1);
-            }
-            fprintf(stderr,"Received %s\n",buf);
-            deserialize_port_numbers2(buf,propagation_port_number,removal_port_number);
+        need += h->request.vallen;
+    }
+    if (c->rbytes < need)
+        return 0;
+
+    c->msgcurr = 0;
+    c->msgused = 0;
+    c->iovused = 0;
+    if (add_msghdr(c) != 0) {
+        conn_set_state(c, conn_closing);
+        return -1;
+    }
 
-            boundary = *(_recv_boundary_from_neighbour(new_fd));
+    memcpy(key, c->rcurr + sizeof(h->bytes), h->request.keylen);
+    key[h->request.keylen] = '\0';
+    c->cas = 0;
+    c->rcurr += need;
+    c->rbytes -= need;
+    /* The value stays in the read buffer until the next read */
+    process_node_command(c, key, h->request.keylen, c->rcurr - h->request.vallen);
+    return 1;
+}
 
-            _update_neighbours_list(command,propagation_port_number,removal_port_number,boundary);
-            print_ecosystem();
-        }
-        close(new_fd);
+/*
+ * Opens the request propagation port on an ephemeral port and adds it to
+ * the listening connections of the dispatcher.
+ */
+static void server_socket_node_propagation(void) {
+    int sfd, flags;
+    conn *listen_conn_add;
+    int port = find_port(&sfd);
+
+    if ((flags = fcntl(sfd, F_GETFL, 0)) < 0 ||
+            fcntl(sfd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        perror("setting O_NONBLOCK");
+        exit(EXIT_FAILURE);
+    }
+    if (listen(sfd, settings.backlog) == -1) {
+        perror("listen()");
+        exit(EXIT_FAILURE);
+    }
+    if (!(listen_conn_add = conn_new(sfd, conn_listening, EV_READ | EV_PERSIST, 1,
+            tcp_transport, main_base))) {
+        fprintf(stderr, "failed to create propagation listening connection\n");
+        exit(EXIT_FAILURE);
     }
+    listen_conn_add->next = listen_conn;
+    listen_conn = listen_conn_add;
 
-    close(sockfd);
-	return 0;
+    node_address(me.request_propogation, port);
+    if (settings.verbose > 1)
+        fprintf(stderr, "request propagation port is %d\n", port);
+    node_port_bound();
 }
 
 static ZoneBoundary* _merge_boundaries(ZoneBoundary *a, ZoneBoundary *b) {
@@ -4576,7 +7597,7 @@ static ZoneBoundary* _merge_boundaries(ZoneBoundary *a, ZoneBoundary *b) {
 
 static node_info* get_neighbour_by_boundary(ZoneBoundary *a){
 	int counter;
-    for(counter=0;counter<10;counter++)
+    for(counter=0;counter<neighbour_slots;counter++)
     {
         if(neighbour[counter].boundary.from.x==a->from.x && neighbour[counter].boundary.from.y==a->from.y &&
                 neighbour[counter].boundary.to.x==a->to.x && neighbour[counter].boundary.to.y==a->to.y)
@@ -4587,7 +7608,7 @@ static node_info* get_neighbour_by_boundary(ZoneBoundary *a){
 
 static void remove_from_neighbour_list(ZoneBoundary *a){
 	int counter;
-    for(counter=0;counter<10;counter++)
+    for(counter=0;counter<neighbour_slots;counter++)
     {
         if(neighbour[counter].boundary.from.x==a->from.x && neighbour[counter].boundary.from.y==a->from.y &&
                 neighbour[counter].boundary.to.x==a->to.x && neighbour[counter].boundary.to.y==a->to.y)
@@ -4600,6 +7621,7 @@ static void remove_from_neighbour_list(ZoneBoundary *a){
             neighbour[counter].boundary.to.y=0;
             strcpy(neighbour[counter].node_removal,"NULL");
             strcpy(neighbour[counter].request_propogation,"NULL");
+            neighbour_table_changed();
             break;
         }
         else
@@ -4607,124 +7629,96 @@ static void remove_from_neighbour_list(ZoneBoundary *a){
     }
 }
 
-static void serialize_node_info(node_info n,char *buf){
-    memset(buf,'\0',1024);
-    sprintf(buf,"%s %s (%f,%f) to (%f,%f)",
-            n.request_propogation,
-            n.node_removal,
-            n.boundary.from.x,
-            n.boundary.from.y,
-            n.boundary.to.x,
-            n.boundary.to.y
-            );
-    fprintf(stderr,"Serialized111: %s\n",buf);
-}
-
-static void deserialize_node_info(char *buf, node_info *n){
-    memset(n->join_request,'\0',10);
-    memset(n->request_propogation,'\0',10);
-    memset(n->node_removal,'\0',10);
-    sscanf(buf,"%s %s (%f,%f) to (%f,%f)",
-                           n->request_propogation,
-                           n->node_removal,
-                           &n->boundary.from.x,
-                           &n->boundary.from.y,
-                           &n->boundary.to.x,
-                           &n->boundary.to.y);
-    char buffer[1024];
-    serialize_node_info(*n,buffer);
-    fprintf(stderr,"Deserialized111: %s\n",buffer);
-}
-
 static int is_same_node_info(node_info n1,node_info n2){
     if(strcmp(n1.node_removal,n2.node_removal) == 0 ) return 1;
     return 0;
 }
 
+/* Length of the overlap of [a1,a2] and [b1,b2], negative if they are apart. */
+static float span_overlap(float a1, float a2, float b1, float b2) {
+    return (a2 < b2 ? a2 : b2) - (a1 > b1 ? a1 : b1);
+}
+
+/*
+ * Two zones are neighbours when they share a stretch of edge: one's left or
+ * right edge lies on the other's and their y ranges overlap, or likewise
+ * with a top or bottom edge and x ranges. Zones meeting only at a corner
+ * are not neighbours.
+ */
 static int is_neighbour(ZoneBoundary a, ZoneBoundary b){
-    if(a.from.x == b.to.x){
-        // A is to the right of B in vertical partitioning
-        return 1;
-    }
-    else if(a.to.x == b.from.x){
-        // A is to the left of B in vertical partitioning
-        return 1;
-    }
-    else return -1;
+    if(same_edge(a.from.x,b.to.x) || same_edge(a.to.x,b.from.x))
+        return span_overlap(a.from.y,a.to.y,b.from.y,b.to.y) > ZONE_EDGE_EPSILON;
+    if(same_edge(a.from.y,b.to.y) || same_edge(a.to.y,b.from.y))
+        return span_overlap(a.from.x,a.to.x,b.from.x,b.to.x) > ZONE_EDGE_EPSILON;
+    return 0;
 }
 
-static void _send_add_remove_update_neighbour_command(char *command,int neighbour_fd,node_info n){
+static void _send_add_remove_update_neighbour_command(uint8_t opcode,int neighbour_fd,node_info n){
     char buf[1024];
-    //adding zero
-    usleep(100000);
-    fprintf(stderr,"Sending %s\n",command);
-    if (send(neighbour_fd,command,strlen(command),0)==-1)
-        perror("send");
-
-    //adding zero
-    usleep(1000);
-    memset(buf,'\0',1024);
-    serialize_port_numbers(n.request_propogation, n.node_removal,buf);
-    fprintf(stderr,"Sending %s\n",buf);
-    if (send(neighbour_fd,buf,strlen(buf),0) == -1)
-        perror("send");
-
-    //adding zero
-    usleep(1000);
-    memset(buf,'\0',1024);
-    serialize_boundary(n.boundary,buf);
-    fprintf(stderr,"Sending %s\n",buf);
-    if (send(neighbour_fd,buf,strlen(buf),0) == -1)
-        perror("send");
+    protocol_node_header h;
+    if (neighbour_fd == -1) {
+        /* the heartbeat will mark it suspected, routing already skips it */
+        fprintf(stderr,"Neighbour unreachable, not sending neighbour command %x\n",opcode);
+        return;
+    }
+    serialize_node_info(n,buf);
+    if (settings.verbose > 1)
+        fprintf(stderr,"Sending neighbour command %x: %s\n",opcode,buf);
+    /* Wait for the acknowledgement, so commands reach a neighbour in the order we send them */
+    if (node_send_message(neighbour_fd,opcode,buf) == -1 ||
+            node_recv_message(neighbour_fd,&h,buf,sizeof(buf)) == -1)
+        perror("_send_add_remove_update_neighbour_command");
 }
 
 static void _send_remove_neighbour_command(int neighbour_fd,node_info n){
-    _send_add_remove_update_neighbour_command(REMOVE_NEIGHBOUR_COMMAND,neighbour_fd,n);
+    _send_add_remove_update_neighbour_command(PROTOCOL_NODE_CMD_REMOVE_NEIGHBOUR,neighbour_fd,n);
 }
 
 static void _send_add_neighbour_command(int neighbour_fd,node_info n){
-    _send_add_remove_update_neighbour_command(ADD_NEIGHBOUR_COMMAND,neighbour_fd,n);
+    _send_add_remove_update_neighbour_command(PROTOCOL_NODE_CMD_ADD_NEIGHBOUR,neighbour_fd,n);
 }
 
 static void _send_update_neighbour_command(int neighbour_fd,node_info n){
-    _send_add_remove_update_neighbour_command(UPDATE_NEIGHBOUR_COMMAND,neighbour_fd,n);
+    _send_add_remove_update_neighbour_command(PROTOCOL_NODE_CMD_UPDATE_NEIGHBOUR,neighbour_fd,n);
 }
 
 static void update_my_neighbours_with_my_info(node_info me,node_info *ignore_node,char *caller) {
     int i=0;
-    for(i=0;i<10;i++){
+    for(i=0;i<neighbour_slots;i++){
         if(!is_neighbour_info_not_valid(neighbour[i])){
             if(ignore_node && is_same_node_info(neighbour[i],*ignore_node)) continue;
-            int neighbour_fd = connect_to("localhost",neighbour[i].request_propogation,caller);
+            int neighbour_fd = connect_to(neighbour[i].request_propogation,caller);
             _send_update_neighbour_command(neighbour_fd,me);
-            close(neighbour_fd);
+            if (neighbour_fd != -1)
+                close(neighbour_fd);
         }
     }
 }
 
 static void inform_neighbours_about_new_child(node_info new_node,node_info new_me){
     int counter = 0;
-    for(counter = 0;counter < 10; counter++){
+    for(counter = 0;counter < neighbour_slots; counter++){
         if(!is_neighbour_info_not_valid(neighbour[counter])){
             if(is_neighbour(new_node.boundary,neighbour[counter].boundary)==1){
                 // if this neighbour is no longer my neighbour
                 int should_reset_this_entry = 0;
                 if(is_neighbour(new_me.boundary,neighbour[counter].boundary)!=1){
                     //remove me from neighbour
-                    int neighbour_fd = connect_to("localhost",neighbour[counter].request_propogation,"inform_neighbours_about_new_child");
+                    int neighbour_fd = connect_to(neighbour[counter].request_propogation,"inform_neighbours_about_new_child");
                     fprintf(stderr,"Removing me from neighbour's list via neighbour's port no %s\n",neighbour[counter].request_propogation);
                     _send_remove_neighbour_command(neighbour_fd,new_me);
-                    close(neighbour_fd);
+                    if (neighbour_fd != -1)
+                        close(neighbour_fd);
                     should_reset_this_entry = 1;
                 }
-                usleep(1000);
                 //if this neighbour is neighbour of new_node
                 if(is_neighbour(new_node.boundary,neighbour[counter].boundary)){
                     //add new node to neighbour
-                    int neighbour_fd = connect_to("localhost",neighbour[counter].request_propogation,"inform_neighbours_about_new_child");
+                    int neighbour_fd = connect_to(neighbour[counter].request_propogation,"inform_neighbours_about_new_child");
                     fprintf(stderr,"Removing new node to neighbour's list via neighbour's port no %s\n",neighbour[counter].request_propogation);
                     _send_add_neighbour_command(neighbour_fd,new_node);
-                    close(neighbour_fd);
+                    if (neighbour_fd != -1)
+                        close(neighbour_fd);
                 }
                 if(should_reset_this_entry == 1){
                     reset_neighbour_entry(counter);
@@ -4732,30 +7726,21 @@ static void inform_neighbours_about_new_child(node_info new_node,node_info new_m
             }
         }
     }
-    update_my_neighbours_with_my_info(me,NULL,"inform_neighbours_about_new_child");
+    update_my_neighbours_with_my_info(new_me,NULL,"inform_neighbours_about_new_child");
 }
 
 static void inform_neighbours_about_dying_child(int dying_child_fd,node_info new_me,node_info dying_child){
-    int i=0;
-    int MAXDATASIZE = 1024;
-    char buf[MAXDATASIZE];
-    // dying_child's neighbours
-    memset(buf,'\0',1024);
-    if (recv(dying_child_fd, buf, MAXDATASIZE-1, 0) == -1) {
-        perror("recv");
-        exit(1);
-    }
-
-    int count_of_valid_entries = atoi(buf);
-    fprintf(stderr,"Number of valid node_info in child: %d\n",count_of_valid_entries);
-    for(i=0;i<count_of_valid_entries;i++){
-        usleep(1000);
-        memset(buf,'\0',1024);
+    char buf[1024];
+    protocol_node_header h;
+    // dying_child's neighbours, one NODE_INFO message each, terminated by END
+    while(1){
         node_info n;
-        if (recv(dying_child_fd, buf, MAXDATASIZE-1, 0) == -1) {
+        if (node_recv_message(dying_child_fd, &h, buf, sizeof(buf)) == -1) {
             perror("recv");
             exit(1);
         }
+        if (h.request.opcode == PROTOCOL_NODE_CMD_END)
+            break;
         deserialize_node_info(buf,&n);
         if(strncmp(n.node_removal,"NULL",4)!=0){
             if(!is_same_node_info(n,me)){
@@ -4768,16 +7753,18 @@ static void inform_neighbours_about_dying_child(int dying_child_fd,node_info new
                         n.boundary.to.y
                         );
                 if(is_neighbour(n.boundary,new_me.boundary)){
-                    int neighbour_fd = connect_to("localhost",n.request_propogation,"inform_neighbours_about_dying_child");
+                    int neighbour_fd = connect_to(n.request_propogation,"inform_neighbours_about_dying_child");
                     fprintf(stderr,"Add my new boundary on this neighbour\n");
                     _send_add_neighbour_command(neighbour_fd,new_me);
-                    close(neighbour_fd);
+                    if (neighbour_fd != -1)
+                        close(neighbour_fd);
                 }
                 if(is_neighbour(n.boundary,dying_child.boundary)){
-                    int neighbour_fd = connect_to("localhost",n.request_propogation,"inform_neighbours_about_dying_child");
+                    int neighbour_fd = connect_to(n.request_propogation,"inform_neighbours_about_dying_child");
                     fprintf(stderr,"Remove dying child boundary on this neighbour\n");
                     _send_remove_neighbour_command(neighbour_fd,dying_child);
-                    close(neighbour_fd);
+                    if (neighbour_fd != -1)
+                        close(neighbour_fd);
                 }
                 add_to_my_neighbours_list(n);
             }
@@ -4796,12 +7783,13 @@ static void *node_removal_listener_thread_routine(void *args) {
 	char buf[1024];
 
 	int port = find_port(&sockfd);
-    sprintf(me.node_removal,"%d",port);
+    node_address(me.node_removal, port);
 
 	if (listen(sockfd, BACKLOG) == -1) {
 		perror("listen");
 		exit(1);
 	}
+	node_port_bound();
 
 	sa.sa_handler = sigchld_handler; // reap all dead processes
 	sigemptyset(&sa.sa_mask);
@@ -4816,13 +7804,22 @@ static void *node_removal_listener_thread_routine(void *args) {
 
 	while (1) { // main accept() loop
 	    new_fd = receive_connection_from_client(sockfd,"node_removal_listener_thread_routine");
+	    handoff_wait();
 
             mode = MERGING_PARENT_INIT;
             fprintf(stderr,"Mode changed: NORMAL_NODE -> MERGING_PARENT_INIT\n");
 
     		ZoneBoundary *child_boundary = _recv_boundary_from_neighbour(new_fd);
+            node_info *child_info = get_neighbour_by_boundary(child_boundary);
+            if (child_info == NULL) {
+                fprintf(stderr,"node_removal_listener_thread_routine: the leaving node isn't a neighbour\n");
+                close(new_fd);
+                free(child_boundary);
+                mode = NORMAL_NODE;
+                continue;
+            }
             ZoneBoundary *merged_boundary = _merge_boundaries(&me.boundary,child_boundary);
-            node_info dying_child = *(get_neighbour_by_boundary(child_boundary));
+            node_info dying_child = *child_info;
             node_info new_me;
             copy_node_info(me,&new_me);
             new_me.boundary = *merged_boundary;
@@ -4831,24 +7828,25 @@ static void *node_removal_listener_thread_routine(void *args) {
             fprintf(stderr,"my new boundary:");
             print_boundaries(new_me.boundary);
 
-            ////
-            usleep(1000*10);
+            /* until a key reaches us, its requests go back to the child */
+            handoff_begin(HANDOFF_TAKING, *child_boundary, &dying_child);
             serialize_boundary(*merged_boundary,buf);
-
-            send(new_fd,buf,strlen(buf),0);
-            ///
+            node_send_message(new_fd,PROTOCOL_NODE_CMD_BOUNDARY,buf);
 
             inform_neighbours_about_dying_child(new_fd,new_me,dying_child);
             mode = MERGING_PARENT_MIGRATING;
             fprintf(stderr,"Mode changed: MERGING_PARENT_INIT -> MERGING_PARENT_MIGRATING\n");
 
-            _receive_keys_and_trash_keys(new_fd);
-            me.boundary = *merged_boundary;
-            my_new_boundary = me.boundary;
+            _receive_keys(new_fd);
+            my_new_boundary = *merged_boundary;
+            handoff_end(merged_boundary);
             fprintf(stderr,"My new boundary is:\n");
             print_boundaries(me.boundary);
             print_boundaries(my_new_boundary);
 
+            /* tell the child it may go */
+            if (node_send_key(new_fd, PROTOCOL_NODE_REQ, PROTOCOL_NODE_CMD_END, 0, NULL, 0) == -1)
+                perror("send");
             close(new_fd);
 
             mode = NORMAL_NODE;
@@ -4860,74 +7858,117 @@ static void *node_removal_listener_thread_routine(void *args) {
 
 
 
-static int send_neighbours_to_child(int new_fd){
-	char boundary_str[1024],port_number_str[1024];
+/* Hands the joining child every neighbour of ours that borders its zone. */
+static void send_neighbours_to_child(int new_fd,ZoneBoundary child){
+	char buf[1024];
 	int counter;
-	int flag=0;
-	for(counter=0;counter<10;counter++)
+	for(counter=0;counter<neighbour_slots;counter++)
 	{
-		if(neighbour[counter].boundary.from.x > my_new_boundary.from.x)
+		if(!is_neighbour_info_not_valid(neighbour[counter]) && is_neighbour(child,neighbour[counter].boundary))
 		{
-			flag=1;
-			fprintf(stderr,"\nsending neighbour boundary from parent to be updated in clients neighbour list:%f,%f\n",neighbour[counter].boundary.from.x , my_new_boundary.from.x);
-	        serialize_boundary(neighbour[counter].boundary,boundary_str);
-
-	        //adding usleep
-	        usleep(1000);
-	        send(new_fd,boundary_str,strlen(boundary_str),0);
-	        //adding zero
-	        usleep(1000);
-	        serialize_port_numbers(neighbour[counter].request_propogation,neighbour[counter].node_removal,port_number_str);
-	        send(new_fd,port_number_str,strlen(port_number_str),0);
-	        return counter;
-
+			fprintf(stderr,"\nsending neighbour from parent to be updated in clients neighbour list:%s\n",neighbour[counter].request_propogation);
+	        serialize_node_info(neighbour[counter],buf);
+	        node_send_message(new_fd,PROTOCOL_NODE_CMD_NODE_INFO,buf);
 		}
 	}
-	if(flag==0)
-	{
-	    send(new_fd,"NONE",4,0);
-	    return -1;
-	}
-	return -1;
+	node_send_message(new_fd,PROTOCOL_NODE_CMD_END,NULL);
 }
 
 static void receiving_from_parents_parents_neighbours(int new_sockfd){
-	char buf[1024],propagation_port_number[1024],removal_port_number[1024];
-	int counter;
-	ZoneBoundary boundary;
-
-	recv(new_sockfd, buf,1024, 0);
-	fprintf(stderr,"receiving from parent1:%s",buf);
-	if(strcmp(buf,"NONE"))
-	{
-		deserialize_boundary(buf,&boundary);
-
-		memset(buf,'\0',1024);
-		recv(new_sockfd, buf, 1024, 0);
-		fprintf(stderr,"receiving from parent2:%s",buf);
-		deserialize_port_numbers2(buf,propagation_port_number,removal_port_number);
-		fprintf(stderr,"receiving from parent3:%s,%s",propagation_port_number,removal_port_number);
+	char buf[1024];
+	protocol_node_header h;
+	node_info n;
 
-		for(counter=0;counter<10;counter++)
+	while(1){
+		if (node_recv_message(new_sockfd, &h, buf, sizeof(buf)) == -1) {
+			perror("recv");
+			exit(1);
+		}
+		if(h.request.opcode == PROTOCOL_NODE_CMD_END)
+			break;
+		fprintf(stderr,"receiving from parent1:%s",buf);
+		if(h.request.opcode == PROTOCOL_NODE_CMD_NODE_INFO)
 		{
-			if(is_neighbour_info_not_valid(neighbour[counter]))
-			{
-			    set_node_info(&neighbour[counter],boundary,propagation_port_number,removal_port_number);
-				break;
-			}
+			deserialize_node_info(buf,&n);
+			add_to_my_neighbours_list(n);
 		}
 	}
 }
 
+/* x of the left edge of a grid column */
+static float grid_column_x(unsigned int column) {
+    return world_boundary.from.x +
+            (world_boundary.to.x - world_boundary.from.x) * column / ITEM_GRID_SIDE;
+}
+
+/*
+ * Picks where to cut zone in two along x for a joining node: at the grid
+ * column that leaves the fraction keep of the bytes on our side. Zones are
+ * still cut along x, as the neighbour and merge code expect vertical slabs.
+ * An empty zone is cut at the column nearest the fraction keep of its width.
+ * Either way the cut is a grid column, which the %f boundary serialization
+ * carries unchanged to the child and our neighbours.
+ */
+static float split_point(ZoneBoundary zone, double keep) {
+    unsigned int x0 = grid_cell(zone.from.x, world_boundary.from.x, world_boundary.to.x, false);
+    unsigned int x1 = grid_cell(zone.to.x, world_boundary.from.x, world_boundary.to.x, true);
+    unsigned int y0 = grid_cell(zone.from.y, world_boundary.from.y, world_boundary.to.y, false);
+    unsigned int y1 = grid_cell(zone.to.y, world_boundary.from.y, world_boundary.to.y, true);
+    uint64_t *bytes, total = 0, left = 0, best_left = 0;
+    uint64_t columns[ITEM_GRID_SIDE] = {0};
+    unsigned int x, y, cut;
+    double best_imbalance = -1;
+
+    if (x1 - x0 < 2) {
+        /*
+         * No column inside the zone: cut by width, and keep the cut as %f
+         * prints it, which is what the child and our neighbours will parse.
+         */
+        char printed[32];
+        snprintf(printed, sizeof(printed), "%f", zone.from.x + (zone.to.x - zone.from.x) * keep);
+        return strtof(printed, NULL);
+    }
+    cut = x0 + (unsigned int) ((x1 - x0) * keep + 0.5);
+    if (cut <= x0)
+        cut = x0 + 1;
+    else if (cut >= x1)
+        cut = x1 - 1;
+    if ((bytes = malloc(sizeof(uint64_t) * ITEM_GRID_SIDE * ITEM_GRID_SIDE)) == NULL)
+        return grid_column_x(cut);
+    item_grid_bytes(bytes);
+    for (y = y0; y < y1; y++) {
+        for (x = x0; x < x1; x++)
+            columns[x] += bytes[y * ITEM_GRID_SIDE + x];
+    }
+    free(bytes);
+    for (x = x0; x < x1; x++)
+        total += columns[x];
+    if (total == 0)
+        return grid_column_x(cut);
+
+    for (x = x0 + 1; x < x1; x++) {
+        double imbalance;
+        left += columns[x - 1];
+        imbalance = fabs(left - total * keep);
+        if (best_imbalance < 0 || imbalance < best_imbalance) {
+            best_imbalance = imbalance;
+            best_left = left;
+            cut = x;
+        }
+    }
+    if (settings.verbose > 0)
+        fprintf(stderr, "split: cutting at column %u of [%u,%u), %llu of %llu bytes stay here (%.0f%% wanted)\n",
+                cut, x0, x1, (unsigned long long)best_left, (unsigned long long)total, keep * 100);
+    return grid_column_x(cut);
+}
+
 static void *join_request_listener_thread_routine(void * args) {
 	if (settings.verbose > 1)
 		fprintf(stderr, "in join_request_listener_thread_routine ");
 
 	//int entry_to_delete;
-	int MAXDATASIZE=1024;
 	int sockfd=0,new_fd; // listen on sock_fd, new connection on new_fd
 	char buf[1024];
-    int numbytes;
 
 	pthread_key_t *item_lock_type_key = (pthread_key_t*)args;
 	if(item_lock_type_key) fprintf(stderr,"lock passed on properly\n");
@@ -4935,7 +7976,8 @@ static void *join_request_listener_thread_routine(void * args) {
 	    fprintf(stderr,"lock not passed on properly, exiting here\n");
 	    exit(-1);
 	}
-	char neighbour_request_propogation[1024], neighbour_node_removal[1024];
+	char neighbour_request_propogation[NODE_ADDR_LEN], neighbour_node_removal[NODE_ADDR_LEN];
+	uint64_t child_capacity;
     my_new_boundary = me.boundary;
 
     fprintf(stderr,"\nin join req....me.joinport:%s\n",me.join_request);
@@ -4946,20 +7988,30 @@ static void *join_request_listener_thread_routine(void * args) {
         perror("join_req_listener");
         exit(-1);
     }
+    wait_for_node_ports();
 	while (1) { // main accept() loop
 	    new_fd = receive_connection_from_client(sockfd,"join_request_listener_thread_routine");
+	    handoff_wait();
+
+		/* the joining node takes a share of our bytes in proportion to its capacity */
+		node_expect_message(new_fd, PROTOCOL_NODE_CMD_CAPACITY, buf, sizeof(buf), "join_request_listener_thread_routine");
+		child_capacity = strtoull(buf, NULL, 10);
+		if (child_capacity == 0)
+			child_capacity = capacity_weight();
 
 		mode = SPLITTING_PARENT_INIT;
         fprintf(stderr,"Mode changed: NORMAL_NODE -> SPLITTING_PARENT_INIT\n");
 
-        float x1, y1, x2, y2;
+        float x1, y1, x2, y2, cut;
 
         x1 = my_new_boundary.from.x;
         x2 = my_new_boundary.to.x;
         y1 = my_new_boundary.from.y;
         y2 = my_new_boundary.to.y;
+        cut = split_point(my_new_boundary,
+                (double)capacity_weight() / (capacity_weight() + child_capacity));
 
-        client_boundary.from.x = x1 + (x2 - x1) / 2;
+        client_boundary.from.x = cut;
         client_boundary.from.y = y1;
         client_boundary.to.x = x2;
         client_boundary.to.y = y2;
@@ -4967,7 +8019,7 @@ static void *join_request_listener_thread_routine(void * args) {
         my_new_boundary.from.x = x1;
         my_new_boundary.from.y = y1;
 
-        my_new_boundary.to.x = x1 + (x2 - x1) / 2;
+        my_new_boundary.to.x = cut;
         my_new_boundary.to.y = y2;
 
         if (settings.verbose > 1) {
@@ -4984,32 +8036,20 @@ static void *join_request_listener_thread_routine(void * args) {
         serialize_boundary(client_boundary, client_boundary_str);
         serialize_boundary(my_new_boundary, my_new_boundary_str);
 
-        mylist_init("trash_both",&trash_both);
-        //adding usleep
-        usleep(1000);
-		if (send(new_fd, client_boundary_str, strlen(client_boundary_str), 0) == -1)
+		if (node_send_message(new_fd, PROTOCOL_NODE_CMD_BOUNDARY, client_boundary_str) == -1)
 			perror("send");
 
-		//adding zero
-		usleep(1000);
-		if (send(new_fd, my_new_boundary_str, strlen(my_new_boundary_str), 0) == -1)
+		if (node_send_message(new_fd, PROTOCOL_NODE_CMD_BOUNDARY, my_new_boundary_str) == -1)
             perror("send");
 
 		serialize_port_numbers(me.request_propogation, me.node_removal,buf);
-
-		//adding zero
-		usleep(1000);
 		fprintf(stderr,"\nsending portnumbers:%s\n",buf);
 
-		if (send(new_fd, buf, strlen(buf), 0) == -1)
+		if (node_send_message(new_fd, PROTOCOL_NODE_CMD_PORTS, buf) == -1)
 			perror("send");
 
 		//receiving client port num
-	    memset(buf, '\0', 1024);
-	    if ((numbytes = recv(new_fd, buf, MAXDATASIZE - 1, 0)) == -1) {
-	            perror("recv");
-	            exit(1);
-	        }
+		node_expect_message(new_fd, PROTOCOL_NODE_CMD_PORTS, buf, sizeof(buf), "join_request_listener_thread_routine");
 
         deserialize_port_numbers2(buf,neighbour_request_propogation,neighbour_node_removal);
 
@@ -5021,16 +8061,16 @@ static void *join_request_listener_thread_routine(void * args) {
         copy_node_info(me,&new_me);
         new_me.boundary = my_new_boundary;
 
-        send_neighbours_to_child(new_fd);
+        /* the child is taking the zone by now; requests for it go there */
+        handoff_begin(HANDOFF_GIVING, client_boundary, &new_node);
+        send_neighbours_to_child(new_fd,client_boundary);
         inform_neighbours_about_new_child(new_node,new_me);
 
         add_to_my_neighbours_list(new_node);
 
-        usleep(2000);
         pthread_t split_migrate_keys_thread;
-        usleep(3000);
         split_migrate_key_args *args=(split_migrate_key_args*)malloc(sizeof(split_migrate_key_args));
-        args->child_fd = new_fd;
+        args->fd = new_fd;
         args->item_lock_type_key = item_lock_type_key;
         pthread_create(&split_migrate_keys_thread, 0,split_migrate_keys_routine,(void*)args);
         print_ecosystem();
@@ -5038,48 +8078,85 @@ static void *join_request_listener_thread_routine(void * args) {
 	return 0;
 }
 
-static void send_parent_and_my_info_to_bootstrap(char *port_number){
+/*
+ * PORTS carries the join request and request propagation addresses; the
+ * bootstrap names a node by the latter when the join address is "-".
+ */
+static void send_parent_and_my_info_to_bootstrap(char *port_number,
+        char *parent_join_request, char *parent_request_propogation){
     int sockfd=-1;
-    char str[1024],str2[1024];
-    char parent_boundary_str[1024];
+    char str[1024], address[NODE_ADDR_LEN];
     
-    fprintf(stderr,"\nBootstrap node removal routine is at %s:%s\n","localhost",port_number);
-    sockfd= connect_to("localhost", port_number,"send_parent_and_my_info_to_bootstrap");
+    bootstrap_port_address(address, port_number);
+    fprintf(stderr,"\nBootstrap node removal routine is at %s\n",address);
+    sockfd= connect_to(address,"send_parent_and_my_info_to_bootstrap");
+    if(sockfd == -1)
+        return;
     
-    //sending my boundary
+    //sending my boundary and join req port number
     serialize_boundary(me.boundary,str);
-    send(sockfd,str,strlen(str),0);
-    usleep(1000);
+    node_send_message(sockfd,PROTOCOL_NODE_CMD_BOUNDARY,str);
+    sprintf(str,"%s %s",me.join_request,me.request_propogation);
+    node_send_message(sockfd,PROTOCOL_NODE_CMD_PORTS,str);
     
-    //sending my join req port number
-    sprintf(str2,"%s",me.join_request);
-    send(sockfd,str2,strlen(str2),0);
-    serialize_boundary(parent, parent_boundary_str);
-    
-    //sending parent bondary
-    usleep(1000);
-    send(sockfd,parent_boundary_str,strlen(parent_boundary_str),0);
-    
-    //sending parent join req port
-    usleep(1000);
-    send(sockfd,join_server_port_number,strlen(join_server_port_number),0);
+    //sending parent boundary and join req port
+    serialize_boundary(parent,str);
+    node_send_message(sockfd,PROTOCOL_NODE_CMD_BOUNDARY,str);
+    sprintf(str,"%s %s",parent_join_request,parent_request_propogation);
+    node_send_message(sockfd,PROTOCOL_NODE_CMD_PORTS,str);
     
     close(sockfd);
 }
 
 
+/* Takes the parent's stream of our keys, then tells it the zone is ours. */
+static void split_child_receive_keys(int sockfd) {
+    _receive_keys(sockfd);
+    handoff_end(NULL);
+    if (node_send_key(sockfd, PROTOCOL_NODE_REQ, PROTOCOL_NODE_CMD_END, 0, NULL, 0) == -1)
+        perror("send");
+    close(sockfd);
+}
+
+static void *lazy_join_receive_routine(void *tagArgs) {
+    split_migrate_key_args *args = tagArgs;
+    uint8_t lock_type = ITEM_LOCK_GRANULAR;
+    pthread_setspecific(*(args->item_lock_type_key), &lock_type);
+    split_child_receive_keys(args->fd);
+    fprintf(stderr, "lazy join: all keys of our zone received\n");
+    free(args);
+    return 0;
+}
+
+/* The child serves its zone as a NORMAL_NODE and takes joins of its own. */
+static void split_child_join_done(void *args, char *parent_request_propogation) {
+    mode = NORMAL_NODE;
+    fprintf(stderr,"Mode changed: SPLITTING_CHILD_MIGRATING -> NORMAL_NODE\n");
+
+    send_parent_and_my_info_to_bootstrap("11312",join_server_address,
+            parent_request_propogation);
+
+	pthread_create(&join_request_listening_thread, 0,join_request_listener_thread_routine,args);
+	print_ecosystem();
+}
+
 static void *connect_and_split_thread_routine(void *args) {
-	int sockfd, numbytes;
-	int MAXDATASIZE = 1024;
-	char buf[MAXDATASIZE];
-	int counter;
+	int sockfd;
+	char buf[1024];
 	ZoneBoundary neighbour_boundary;
 
-	char neighbour_request_propogation[1024],
-    neighbour_node_removal[1024];//, me_request_propogation[1024],
+	char neighbour_request_propogation[NODE_ADDR_LEN],
+    neighbour_node_removal[NODE_ADDR_LEN];//, me_request_propogation[1024],
 //    me_node_removal[1024];
 
-    sockfd = connect_to(join_server_ip_address, join_server_port_number,"connect_and_split_thread_routine");
+    wait_for_node_ports();
+    sockfd = connect_to(join_server_address,"connect_and_split_thread_routine");
+    if(sockfd == -1){
+        fprintf(stderr,"Could not reach the node we were told to join\n");
+        exit(-1);
+    }
+    sprintf(buf, "%llu", (unsigned long long)capacity_weight());
+    node_send_message(sockfd, PROTOCOL_NODE_CMD_CAPACITY, buf);
 
 	//receiving self boundary
 	me.boundary = *(_recv_boundary_from_neighbour(sockfd));
@@ -5096,37 +8173,25 @@ static void *connect_and_split_thread_routine(void *args) {
 
 
 	/////////receiving portnumbers
-    memset(buf, '\0', 1024);
-        if ((numbytes = recv(sockfd, buf, MAXDATASIZE - 1, 0)) == -1) {
-            perror("recv");
-            exit(1);
-        }
+        node_expect_message(sockfd, PROTOCOL_NODE_CMD_PORTS, buf, sizeof(buf), "connect_and_split_thread_routine");
         deserialize_port_numbers2(buf,neighbour_request_propogation,neighbour_node_removal);
         fprintf(stderr, "\n Got port numbers: %s %s ", neighbour_request_propogation,
                     neighbour_node_removal);
 
 
 
-		for(counter=0;counter<10;counter++)
-		{
-			if(is_neighbour_info_not_valid(neighbour[counter]))
-			{
-				neighbour[counter].boundary=neighbour_boundary;
-				sprintf(neighbour[counter].node_removal,"%s",neighbour_node_removal);
-				sprintf(neighbour[counter].request_propogation,"%s",neighbour_request_propogation);
-				break;
-			}
-			else
-				continue;
-		}
+		node_info parent_info;
+		set_node_info(&parent_info,neighbour_boundary,neighbour_request_propogation,neighbour_node_removal);
+		add_to_my_neighbours_list(parent_info);
+		/* until a key reaches us, its requests go back to the parent */
+		handoff_begin(HANDOFF_TAKING, me.boundary, &parent_info);
 
 
 
 		memset(buf, '\0', 1024);
 		serialize_port_numbers(me.request_propogation, me.node_removal,buf);
-		usleep(1000);
 		fprintf(stderr,"\nsending client portnumbers:%s\n",buf);
-		if (send(sockfd, buf, strlen(buf), 0)== -1)
+		if (node_send_message(sockfd, PROTOCOL_NODE_CMD_PORTS, buf) == -1)
 				perror("send");
 
 		receiving_from_parents_parents_neighbours(sockfd);
@@ -5135,41 +8200,64 @@ static void *connect_and_split_thread_routine(void *args) {
     mode = SPLITTING_CHILD_MIGRATING;
     fprintf(stderr,"Mode changed: SPLITTING_CHILD_INIT -> SPLITTING_CHILD_MIGRATING\n");
 
-   _receive_keys_and_trash_keys(sockfd);
-    close(sockfd);
-
-    mode = NORMAL_NODE;
-    fprintf(stderr,"Mode changed: SPLITTING_CHILD_MIGRATING -> NORMAL_NODE\n");
-
-    send_parent_and_my_info_to_bootstrap("11312");
+    /*
+     * A lazy join goes live before the keys arrive: a key we haven't got yet
+     * is fetched from the parent when it is asked for, see handoff_key(), so
+     * the hot keys move first and the stream trickles in the rest. thread_init()
+     * waits for this thread, so the stream is received by one of its own.
+     */
+    if (settings.lazy_join) {
+        pthread_t lazy_join_thread;
+        split_migrate_key_args *receive_args = malloc(sizeof(split_migrate_key_args));
+        if (receive_args == NULL) {
+            fprintf(stderr, "connect_and_split_thread_routine: out of memory\n");
+            exit(1);
+        }
+        receive_args->fd = sockfd;
+        receive_args->item_lock_type_key = args;
+        split_child_join_done(args, neighbour_request_propogation);
+        pthread_create(&lazy_join_thread, 0, lazy_join_receive_routine, receive_args);
+        return 0;
+    }
 
-	pthread_create(&join_request_listening_thread, 0,join_request_listener_thread_routine,args);
-	print_ecosystem();
-	return 0;
+    split_child_receive_keys(sockfd);
+    split_child_join_done(args, neighbour_request_propogation);
+    return 0;
 }
 
 static void _send_my_boundary_to(int another_node_fd) {
 	char buf[1024];
 	serialize_boundary(me.boundary, buf);
-	send(another_node_fd, buf, strlen(buf), 0);
+	node_send_message(another_node_fd, PROTOCOL_NODE_CMD_BOUNDARY, buf);
 }
 
 
 
+/*
+ * Picks the neighbour that takes our zone when we leave: the one left with
+ * the least area per unit of capacity once it holds ours as well. A
+ * neighbour missing from the zone map is taken to be as big as we are.
+ */
 static void find_smallest_neighbour(node_info *found_neighbour)
 {
 	int counter;
-	float area;
+	float area, my_area = calculate_area(me.boundary);
 	float min=999999;
 	int final_counter=0;
+	uint64_t weight;
 	ZoneBoundary bounds;
-	for(counter=0;counter<10;counter++)
+	for(counter=0;counter<neighbour_slots;counter++)
 		{
 		    if(strcmp(neighbour[counter].node_removal,"NULL") || strcmp(neighbour[counter].request_propogation,"NULL"))
             {
                 bounds=neighbour[counter].boundary;
                 area=calculate_area(bounds);
-                if(min>area&&area!=0)
+                if(area==0 || node_suspected(neighbour[counter].request_propogation))
+                    continue;
+                if((weight=zone_map_capacity(neighbour[counter].request_propogation))==0)
+                    weight=capacity_weight();
+                area=(area+my_area)/weight;
+                if(min>area)
                 {
                     min=area;
                     final_counter=counter;
@@ -5178,12 +8266,13 @@ static void find_smallest_neighbour(node_info *found_neighbour)
 		}
 
 	strcpy(found_neighbour->node_removal, neighbour[final_counter].node_removal);
+	strcpy(found_neighbour->request_propogation, neighbour[final_counter].request_propogation);
 }
 
 static int count_of_valid_node_info(){
     int i=0;
     int count =0;
-    for(i=0;i<10;i++){
+    for(i=0;i<neighbour_slots;i++){
         if(!is_neighbour_info_not_valid(neighbour[i])){
             count++;
         }
@@ -5202,8 +8291,9 @@ static void process_die_command(conn *c) {
 	out_string(c,"Die command received, initiating to move all keys to a neighbour\n");
 	find_smallest_neighbour(found_neighbour);
 
+	handoff_wait();
 	fprintf(stderr,"\nneighbour.node_removal=%s\n",found_neighbour->node_removal);
-	sockfd = connect_to("localhost", found_neighbour->node_removal,"process_die_command");
+	sockfd = connect_to(found_neighbour->node_removal,"process_die_command");
     if(sockfd == -1){
         fprintf(stderr,"Did not connect to neighbour.node_removal port no %s",found_neighbour->node_removal);
         exit(-1);
@@ -5212,43 +8302,36 @@ static void process_die_command(conn *c) {
     mode = MERGING_CHILD_INIT;
     fprintf(stderr, "Mode changed: NORMAL_NODE -> MERGING_CHILD_INIT\n");
 
-   //usleep(1000*1000*5);
 	_send_my_boundary_to(sockfd);
 
     parent = *(_recv_boundary_from_neighbour(sockfd));
+    /* the parent is taking the zone by now; requests for it go there */
+    handoff_begin(HANDOFF_GIVING, me.boundary, found_neighbour);
 
     // Send neighbour list to parent.
-    int count_of_valid_entries = count_of_valid_node_info();
-    memset(buf,'\0',1024);
-    sprintf(buf,"%d",count_of_valid_entries);
-    send(sockfd,buf,strlen(buf),0);
-    fprintf(stderr,"Number of valid node_info: %d\n",count_of_valid_entries);
-
-    for(i=0;i<count_of_valid_entries;i++){
-        usleep(1000);
+    fprintf(stderr,"Number of valid node_info: %d\n",count_of_valid_node_info());
+    for(i=0;i<neighbour_slots;i++){
+        if(is_neighbour_info_not_valid(neighbour[i])) continue;
         serialize_node_info(neighbour[i],buf);
-        send(sockfd,buf,strlen(buf),0);
+        node_send_message(sockfd,PROTOCOL_NODE_CMD_NODE_INFO,buf);
     }
+    node_send_message(sockfd,PROTOCOL_NODE_CMD_END,NULL);
 
     mode = MERGING_CHILD_MIGRATING;
     fprintf(stderr, "Mode changed: MERGING_CHILD_INIT -> MERGING_CHILD_MIGRATING\n");
 
-	pthread_mutex_lock(&list_of_keys_lock);
-	mylist_init("keys_to_send",&keys_to_send);
-	for (i = 0; i < list_of_keys.size; i++) {
-		char *key = list_of_keys.array[i];
-		mylist_add(&keys_to_send, key);
-	}
-	pthread_mutex_unlock(&list_of_keys_lock);
+	/* only our own zone moves, not the replicas we hold of others */
+	collect_keys(&keys_to_send, &me.boundary);
 
 	fprintf(stderr, "Migrating keys to neighbour before shutting down\n");
 	_migrate_key_values(sockfd, keys_to_send);
-
-	fprintf(stderr, "Trashing keys in parent and child:\n");
-	_trash_keys_in_both_nodes(sockfd, trash_both);
+	mylist_delete_all(&keys_to_send);
+	/* we may go once the parent has taken over */
+	node_expect_message(sockfd, PROTOCOL_NODE_CMD_END, buf, sizeof(buf), "process_die_command");
 
 	///
-	send_parent_and_my_info_to_bootstrap("11313");
+	send_parent_and_my_info_to_bootstrap("11313","-",
+	        found_neighbour->request_propogation);
 	//
 	serialize_boundary(me.boundary,buf);
 	out_string(c, "Die command complete\r\n");
@@ -5303,12 +8386,6 @@ static void process_command(conn *c, char *command) {
 					|| (strcmp(tokens[COMMAND_TOKEN].value, "append") == 0
 							&& (comm = NREAD_APPEND)))) {
 
-        if(strcmp(tokens[COMMAND_TOKEN].value, "set") == 0){
-            char *set_command_to_execute=(char*)malloc(sizeof(char)*1024);
-            sprintf(set_command_to_execute, "%s", command);
-            pthread_setspecific(set_command_to_execute_t,set_command_to_execute);
-        }
-
 		process_update_command(c, tokens, ntokens, comm, false);
 
 	} else if ((ntokens == 7 || ntokens == 8)
@@ -5351,9 +8428,6 @@ static void process_command(conn *c, char *command) {
 			&& (strcmp(tokens[COMMAND_TOKEN].value, "flush_all") == 0)) {
 		time_t exptime = 0;
 
-		pthread_mutex_lock(&list_of_keys_lock);
-		mylist_delete_all(&list_of_keys);
-		pthread_mutex_unlock(&list_of_keys_lock);
 
 		set_noreply_maybe(c, tokens, ntokens);
 
@@ -5471,6 +8545,9 @@ assert(c->rbytes > 0);
 if (c->protocol == negotiating_prot || c->transport == udp_transport) {
 	if ((unsigned char) c->rbuf[0] == (unsigned char) PROTOCOL_BINARY_REQ) {
 		c->protocol = binary_prot;
+	} else if ((unsigned char) c->rbuf[0] == (unsigned char) PROTOCOL_NODE_REQ
+			&& !IS_UDP(c->transport)) {
+		c->protocol = node_prot;
 	} else {
 		c->protocol = ascii_prot;
 	}
@@ -5481,7 +8558,9 @@ if (c->protocol == negotiating_prot || c->transport == udp_transport) {
 	}
 }
 
-if (c->protocol == binary_prot) {
+if (c->protocol == node_prot) {
+	return try_read_node_command(c);
+} else if (c->protocol == binary_prot) {
 	/* Do we have the complete packet header? */
 	if (c->rbytes < sizeof(c->binary_header)) {
 		/* need more data! */
@@ -5500,6 +8579,14 @@ if (c->protocol == binary_prot) {
 		protocol_binary_request_header* req;
 		req = (protocol_binary_request_header*) c->rcurr;
 
+		/* answer the quiet gets before anything that follows them */
+		if (bin_get_batch_open(c) &&
+				req->request.opcode != PROTOCOL_BINARY_CMD_GETQ &&
+				req->request.opcode != PROTOCOL_BINARY_CMD_GETKQ) {
+			bin_get_batch_close(c);
+			return 1;
+		}
+
 		if (settings.verbose > 1) {
 			/* Dump the packet before we convert it to host order */
 			int ii;
@@ -5816,7 +8903,6 @@ if (c->msgcurr < c->msgused) {
 }
 }
 
-int previous_state=-1;
 static void drive_machine(conn *c) {
 bool stop = false;
 int sfd, flags = 1;
@@ -5825,7 +8911,6 @@ struct sockaddr_storage addr;
 int nreqs = settings.reqs_per_event;
 int res;
 const char *str;
-char *set_command_to_execute,*key_to_transfer;
 // char *ptr;
 //item *it;
 
@@ -5876,6 +8961,10 @@ while (!stop) {
 		break;
 
 	case conn_waiting:
+		if (bin_get_batch_open(c)) {
+			bin_get_batch_close(c);
+			break;
+		}
 		if (!update_event(c, EV_READ | EV_PERSIST)) {
 			if (settings.verbose > 0)
 				fprintf(stderr, "Couldn't update event\n");
@@ -5925,6 +9014,8 @@ while (!stop) {
 			pthread_mutex_lock(&c->thread->stats.mutex);
 			c->thread->stats.conn_yields++;
 			pthread_mutex_unlock(&c->thread->stats.mutex);
+			if (bin_get_batch_open(c))
+				neighbour_pool_flush();
 			if (c->rbytes > 0) {
 				/* We have already read in data into the input buffer,
 				 so libevent will most likely not signal read events
@@ -5937,20 +9028,23 @@ while (!stop) {
 						fprintf(stderr, "Couldn't update event\n");
 					conn_set_state(c, conn_closing);
 				}
+			} else if (c->ev_flags == 0) {
+				/* resumed by forward_done(), which left us no event */
+				if (!update_event(c, EV_READ | EV_PERSIST)) {
+					if (settings.verbose > 0)
+						fprintf(stderr, "Couldn't update event\n");
+					conn_set_state(c, conn_closing);
+				}
 			}
 			stop = true;
 		}
 		break;
 
 	case conn_nread:
-	    previous_state = conn_nread;
-        key_to_transfer=(char*)pthread_getspecific(key_to_transfer_t);
-        fprintf(stderr,"1.storing key %s\n",key_to_transfer);
 		if (c->rlbytes == 0) {
 			complete_nread(c);
 			break;
 		}
-        fprintf(stderr,"2.storing key %s\n",key_to_transfer);
 
 		/* first check if we have leftovers in the conn_read buffer */
 		if (c->rbytes > 0) {
@@ -5966,7 +9060,6 @@ while (!stop) {
 				break;
 			}
 		}
-        fprintf(stderr,"3.storing key %s\n",key_to_transfer);
 		/*now try reading from the socket*/
 		res = read(c->sfd, c->ritem, c->rlbytes);
 
@@ -5981,13 +9074,11 @@ while (!stop) {
 			c->rlbytes -= res;
 			break;
 		}
-        fprintf(stderr,"5.storing key %s\n",key_to_transfer);
 
 		if (res == 0) { /* end of stream */
 			conn_set_state(c, conn_closing);
 			break;
 		}
-        fprintf(stderr,"6.storing key %s\n",key_to_transfer);
 		if (res == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
 			if (!update_event(c, EV_READ | EV_PERSIST)) {
 				if (settings.verbose > 0)
@@ -5998,7 +9089,6 @@ while (!stop) {
 			stop = true;
 			break;
 		}
-        fprintf(stderr,"7.storing key %s\n",key_to_transfer);
 		/* otherwise we have a real error, on which we close the connection */
 		if (settings.verbose > 0) {
 			fprintf(stderr, "Failed to read, and not due to blocking:\n"
@@ -6057,15 +9147,7 @@ while (!stop) {
 		break;
 
 	case conn_write:
-	    set_command_to_execute=(char*)pthread_getspecific(set_command_to_execute_t);
-	    if(previous_state == conn_nread && set_command_to_execute && strncmp(set_command_to_execute,"set ",4)==0){
-            key_to_transfer=(char*)pthread_getspecific(key_to_transfer_t);
-            _propagate_update_command_if_required(key_to_transfer,set_command_to_execute);
-            free(set_command_to_execute);
-            free(key_to_transfer);
-            previous_state = -1;
-        }
-        /*
+		/*
 		 * We want to write out a simple response. If we haven't already,
 		 * assemble it into a msgbuf list (this will be a single-entry
 		 * list for TCP or a two-entry list for UDP).
@@ -6106,7 +9188,7 @@ while (!stop) {
 					c->suffixleft--;
 				}
 				/* XXX:  I don't know why this wasn't the general case */
-				if (c->protocol == binary_prot) {
+				if (c->protocol == binary_prot || c->protocol == node_prot) {
 					conn_set_state(c, c->write_and_go);
 				} else {
 					conn_set_state(c, conn_new_cmd);
@@ -6134,6 +9216,15 @@ while (!stop) {
 		}
 		break;
 
+	case conn_forwarding:
+		/* forward_done() resumes us once the neighbours have answered */
+		if (c->ev_flags != 0) {
+			event_del(&c->event);
+			c->ev_flags = 0;
+		}
+		stop = true;
+		break;
+
 	case conn_closing:
 		if (IS_UDP(c->transport))
 			conn_cleanup(c);
@@ -6616,7 +9707,24 @@ printf(
 				"              - hashpower: An integer multiplier for how large the hash\n"
 				"                table should be. Can be grown at runtime if not big enough.\n"
 				"                Set this based on \"STAT hash_power_level\" before a \n"
-				"                restart.\n");
+				"                restart.\n"
+				"              - migration_rate: Bytes per second that a split or merge\n"
+				"                may use to move keys between nodes (default: no limit).\n"
+				"              - capacity_weight: Size of this node relative to the others;\n"
+				"                a join or merge sizes zones by it (default: -m in megabytes).\n"
+				"              - replicas: Number of adjacent zones, 0 to 2, that mirror\n"
+				"                our writes and serve reads of our keys (default: 0).\n"
+				"              - near_cache: Bytes of values fetched from other nodes\n"
+				"                to keep and serve locally (default: 0, off).\n"
+				"              - near_cache_ttl: Seconds a near-cached value is served\n"
+				"                (default: 2).\n"
+				"              - redirect: Answer MOVED <host:port> <epoch> for keys\n"
+				"                another node owns instead of forwarding them.\n"
+				"              - node_host: Host other nodes and clients reach this\n"
+				"                node at (default: the -l address, or localhost).\n"
+				"              - lazy_join: Serve the zone we are given right away;\n"
+				"                keys are fetched from the node we split as they are\n"
+				"                asked for, the rest follow at migration_rate.\n");
 return;
 }
 
@@ -6809,28 +9917,27 @@ if (ever != NULL ) {
 return true;
 }
 
-static void connect_to_bootstrap(char *bootstrap_port_no){
-	int MAXDATASIZE=1024;
-	int sockfd=0, numbytes;
-	char buf[MAXDATASIZE];
+/*
+ * A joining node tells the bootstrap the address of its join port, and
+ * learns the world boundary and whose zone to split, if any.
+ */
+static void connect_to_bootstrap(void){
+	int sockfd=0, port, fd;
+	char buf[1024];
 	int i;
 	char buf2[255];
-	int temp;
-
-	strcpy(join_server_ip_address,"localhost");
-	fprintf(stderr,"\nBootstrap is at %s:%s\n",join_server_ip_address,bootstrap_port_no);
-    sockfd = connect_to("localhost", "11311","connect_to_boostrap");
-    //receiving join req port
-	if ((numbytes = recv(sockfd, buf, MAXDATASIZE-1, 0)) == -1) {
-	perror("recv");
-	exit(1);
-	}
-
-	buf[numbytes] = '\0';
-	printf("client: received '%s'\n",buf);
 
-
-	sprintf(me.join_request,"%s",buf);
+	fprintf(stderr,"\nBootstrap is at %s\n",bootstrap_address);
+    sockfd = connect_to(bootstrap_address,"connect_to_boostrap");
+    if(sockfd == -1){
+        fprintf(stderr,"Could not reach the bootstrap\n");
+        exit(-1);
+    }
+    //sending our join req port; the listener binds it again once we run
+    port = find_port(&fd);
+    close(fd);
+    node_address(me.join_request, port);
+    node_send_message(sockfd, PROTOCOL_NODE_CMD_PORTS, me.join_request);
 
 	//receiving world boundaries
     world_boundary = *(_recv_boundary_from_neighbour(sockfd));
@@ -6838,18 +9945,13 @@ static void connect_to_bootstrap(char *bootstrap_port_no){
 
 
 ////receiving whom to connect
-	memset(buf,'\0',1024);
-		if ((numbytes = recv(sockfd, buf, MAXDATASIZE-1, 0)) == -1) {
-			perror("recv");
-			exit(1);
-			}
+		node_expect_message(sockfd, PROTOCOL_NODE_CMD_JOIN_TARGET, buf, sizeof(buf), "connect_to_bootstrap");
 		printf("client: received '%s'\n",buf);
-		sscanf(buf,"%s %d",buf2,&temp);
+		sscanf(buf,"%254s %63s",buf2,join_server_address);
 		printf("client: received buf2:'%s'\n",buf2);
 		if(!strcmp(buf2,"NOTFIRST"))
 		{
-			sprintf(join_server_port_number,"%d",temp);
-			fprintf(stderr,"\nNode starting as Child, connecting to %s to receive keys\n",join_server_port_number);
+			fprintf(stderr,"\nNode starting as Child, connecting to %s to receive keys\n",join_server_address);
 			starting_node_type = START_AS_CHILD;
 		}
 		else
@@ -6858,7 +9960,7 @@ static void connect_to_bootstrap(char *bootstrap_port_no){
 		    starting_node_type = START_AS_PARENT;
 		}
 	close(sockfd);
-    for(i =0 ;i < 10 ;i++)
+    for(i =0 ;i < neighbour_slots ;i++)
     {
         strcpy(neighbour[i].node_removal,"NULL");
         strcpy(neighbour[i].request_propogation,"NULL");
@@ -6870,10 +9972,7 @@ static void my_init(){
     strcpy(NULL_NODE_INFO.join_request,"NULL");
     strcpy(NULL_NODE_INFO.request_propogation,"NULL");
     strcpy(NULL_NODE_INFO.node_removal,"NULL");
-    int i=0;
-    for(i = 0;i<10;i++){
-        copy_node_info(NULL_NODE_INFO,&neighbour[i]);
-    }
+    neighbour_table_grow();
 }
 
 int main(int argc, char **argv) {
@@ -6889,7 +9988,6 @@ struct rlimit rlim;
 char unit = '\0';
 int size_max = 0;
 int retval = EXIT_SUCCESS;
-char temp[255];
 /* listening sockets */
 static int *l_socket = NULL;
 
@@ -6902,11 +10000,17 @@ bool udp_specified = false;
 char *subopts;
 char *subopts_value;
 enum {
-	MAXCONNS_FAST = 0, HASHPOWER_INIT, SLAB_REASSIGN, SLAB_AUTOMOVE
+	MAXCONNS_FAST = 0, HASHPOWER_INIT, SLAB_REASSIGN, SLAB_AUTOMOVE,
+	MIGRATION_RATE, CAPACITY_WEIGHT, REPLICAS, NEAR_CACHE, NEAR_CACHE_TTL,
+	REDIRECT, NODE_HOST, LAZY_JOIN
 };
 char * const subopts_tokens[] = { [MAXCONNS_FAST] = "maxconns_fast",
 		[HASHPOWER_INIT] = "hashpower", [SLAB_REASSIGN] = "slab_reassign",
-		[SLAB_AUTOMOVE] = "slab_automove", NULL };
+		[SLAB_AUTOMOVE] = "slab_automove", [MIGRATION_RATE] = "migration_rate",
+		[CAPACITY_WEIGHT] = "capacity_weight", [REPLICAS] = "replicas",
+		[NEAR_CACHE] = "near_cache", [NEAR_CACHE_TTL] = "near_cache_ttl",
+		[REDIRECT] = "redirect", [NODE_HOST] = "node_host",
+		[LAZY_JOIN] = "lazy_join", NULL };
 
 if (!sanitycheck()) {
 	return EX_OSERR;
@@ -6923,8 +10027,6 @@ my_init();
 /* set stderr non-buffering (for running under, say, daemontools) */
 setbuf(stderr, NULL );
 
-char *ptr;
-
 /* process arguments */
 while (-1 != (c = getopt(argc, argv, "a:" /* access mask for unix socket */
 		"A" /* enable admin shutdown commannd */
@@ -6958,8 +10060,8 @@ while (-1 != (c = getopt(argc, argv, "a:" /* access mask for unix socket */
 		"y:" /* lower y coordinate */
 		"X:" /* upper x coordinate */
 		"Y:" /* upper y coordinate */
-		"j:" /*IP address and port number of the node to join with */
-		"J:" /*Connecting to bootstrap*/
+		"j:" /* host:port of the node to join with */
+		"J:" /* [host:]port of the bootstrap */
 ))) {
 	switch (c) {
 	case 'A':
@@ -6987,15 +10089,11 @@ while (-1 != (c = getopt(argc, argv, "a:" /* access mask for unix socket */
 
 	case 'j':
 		starting_node_type = START_AS_PARENT;
-		ptr = strtok(optarg, ":");
-		strcpy(join_server_ip_address, ptr);
-		ptr = strtok(NULL, ":");
-		strcpy(join_server_port_number, ptr);
-
+		snprintf(join_server_address, sizeof(join_server_address), "%s", optarg);
 		break;
 	case 'J':
-		strcpy(temp,optarg);
-		connect_to_bootstrap(temp);
+		/* joined once all options are in, node_host among them */
+		snprintf(bootstrap_address, sizeof(bootstrap_address), "%s", optarg);
 		break;
 	case 'a':
 		/* access for unix domain socket, as octal mask (like chmod)*/
@@ -7215,6 +10313,72 @@ while (-1 != (c = getopt(argc, argv, "a:" /* access mask for unix socket */
 					return 1;
 				}
 				break;
+			case MIGRATION_RATE:
+				if (subopts_value == NULL ) {
+					fprintf(stderr, "Missing numeric argument for migration_rate\n");
+					return 1;
+				}
+				if (!safe_strtoull(subopts_value, &settings.migration_rate)) {
+					fprintf(stderr, "Invalid migration_rate: %s\n", subopts_value);
+					return 1;
+				}
+				break;
+			case CAPACITY_WEIGHT:
+				if (subopts_value == NULL ) {
+					fprintf(stderr, "Missing numeric argument for capacity_weight\n");
+					return 1;
+				}
+				if (!safe_strtoull(subopts_value, &settings.capacity_weight) ||
+						settings.capacity_weight == 0) {
+					fprintf(stderr, "Invalid capacity_weight: %s\n", subopts_value);
+					return 1;
+				}
+				break;
+			case REPLICAS:
+				if (subopts_value == NULL ) {
+					fprintf(stderr, "Missing numeric argument for replicas\n");
+					return 1;
+				}
+				if (!safe_strtol(subopts_value, &settings.replicas) ||
+						settings.replicas < 0 || settings.replicas > 2) {
+					fprintf(stderr, "replicas must be between 0 and 2\n");
+					return 1;
+				}
+				break;
+			case NEAR_CACHE:
+				if (subopts_value == NULL ) {
+					fprintf(stderr, "Missing numeric argument for near_cache\n");
+					return 1;
+				}
+				if (!safe_strtoull(subopts_value, &settings.near_cache)) {
+					fprintf(stderr, "Invalid near_cache: %s\n", subopts_value);
+					return 1;
+				}
+				break;
+			case NEAR_CACHE_TTL:
+				if (subopts_value == NULL ) {
+					fprintf(stderr, "Missing numeric argument for near_cache_ttl\n");
+					return 1;
+				}
+				if (!safe_strtol(subopts_value, &settings.near_cache_ttl) ||
+						settings.near_cache_ttl < 1) {
+					fprintf(stderr, "near_cache_ttl must be at least 1\n");
+					return 1;
+				}
+				break;
+			case REDIRECT:
+				settings.redirect = true;
+				break;
+			case NODE_HOST:
+				if (subopts_value == NULL ) {
+					fprintf(stderr, "Missing host for node_host\n");
+					return 1;
+				}
+				settings.node_host = strdup(subopts_value);
+				break;
+			case LAZY_JOIN:
+				settings.lazy_join = true;
+				break;
 			default:
 				printf("Illegal suboption \"%s\"\n", subopts_value);
 				return 1;
@@ -7228,6 +10392,14 @@ while (-1 != (c = getopt(argc, argv, "a:" /* access mask for unix socket */
 	}
 }
 
+/* the host other nodes and clients reach us at */
+if (settings.node_host == NULL) {
+	settings.node_host = settings.inter != NULL && !strchr(settings.inter, ',') ?
+			settings.inter : "localhost";
+}
+if (bootstrap_address[0] != '\0')
+	connect_to_bootstrap();
+
 /*
  * Use one workerthread to serve each UDP port if the user specified
  * multiple ports
@@ -7365,14 +10537,16 @@ if (sigignore(SIGPIPE) == -1) {
 	exit(EX_OSERR);
 }
 
-pthread_mutex_init(&list_of_keys_lock, NULL );
 
-pthread_mutex_lock(&list_of_keys_lock);
-mylist_init("all_keys",&list_of_keys);
-mylist_init("trash_both",&trash_both);
-pthread_mutex_unlock(&list_of_keys_lock);
+pthread_key_create(&neighbour_pool_t, neighbour_pool_free);
+
 
 /* start up worker threads if MT mode */
+/* initialise clock event before a joining node starts receiving keys */
+clock_handler(0, 0, 0);
+
+server_socket_node_propagation();
+
 if (starting_node_type == START_AS_PARENT) {
 	mode = NORMAL_NODE;
 
@@ -7380,20 +10554,20 @@ if (starting_node_type == START_AS_PARENT) {
 	print_ecosystem();
 	thread_init(settings.num_threads, main_base,
 			join_request_listener_thread_routine, NULL,
-			node_removal_listener_thread_routine,
-			node_propagation_thread_routine);
+			node_removal_listener_thread_routine);
 } else if (starting_node_type == START_AS_CHILD) {
     mode = SPLITTING_CHILD_INIT;
     fprintf(stderr, "Mode set as : SPLITTING_CHILD_INIT\n");
 	thread_init(settings.num_threads, main_base, NULL,
 			connect_and_split_thread_routine,
-			node_removal_listener_thread_routine,
-			node_propagation_thread_routine);
+			node_removal_listener_thread_routine);
 }
 else {
     fprintf(stderr,"Invalid start node type\n");
     exit(-1);
 }
+pthread_create(&zone_map_thread, 0, zone_map_thread_routine, NULL);
+pthread_create(&heartbeat_thread, 0, heartbeat_thread_routine, NULL);
 
 if (start_assoc_maintenance_thread() == -1) {
 	exit(EXIT_FAILURE);
@@ -7403,8 +10577,6 @@ if (settings.slab_reassign && start_slab_maintenance_thread() == -1) {
 	exit(EXIT_FAILURE);
 }
 
-/* initialise clock event */
-clock_handler(0, 0, 0);
 
 /* create unix mode sockets after dropping privileges */
 if (settings.socketpath != NULL ) {
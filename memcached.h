@@ -31,6 +31,7 @@
 
 
 #include "protocol_binary.h"
+#include "protocol_node.h"
 #include "cache.h"
 
 #include "sasl_defs.h"
@@ -162,6 +163,7 @@ enum conn_states {
     conn_swallow,    /**< swallowing unnecessary bytes w/o storing */
     conn_closing,    /**< closing this connection */
     conn_mwrite,     /**< writing out many items sequentially */
+    conn_forwarding, /**< waiting for neighbours to answer forwarded requests */
     conn_max_state   /**< Max state value (used for assertion) */
 };
 
@@ -183,7 +185,8 @@ enum bin_substates {
 enum protocol {
     ascii_prot = 3, /* arbitrary value. */
     binary_prot,
-    negotiating_prot /* Discovering the protocol */
+    negotiating_prot, /* Discovering the protocol */
+    node_prot /* Requests from other nodes, see protocol_node.h */
 };
 
 enum network_transport {
@@ -283,6 +286,14 @@ struct stats {
     uint64_t      evicted_unfetched; /* items evicted but never touched */
     bool          slab_reassign_running; /* slab reassign in progress */
     uint64_t      slabs_moved;       /* times slabs were moved around */
+    bool          migration_running; /* keys are streaming to or from a node */
+    uint64_t      migration_keys;    /* keys migrated by split and merge */
+    uint64_t      migration_bytes;   /* bytes of those keys, headers included */
+    uint64_t      migration_keys_per_sec;  /* rate of the last migration */
+    uint64_t      migration_bytes_per_sec;
+    uint64_t      near_cache_hits;   /* remote keys served from the near-cache */
+    uint64_t      near_cache_items;
+    uint64_t      near_cache_bytes;
 };
 
 #define MAX_VERBOSITY_LEVEL 2
@@ -320,6 +331,14 @@ struct settings {
     int slab_automove;     /* Whether or not to automatically move slabs */
     int hashpower_init;     /* Starting hash power level */
     bool shutdown_command; /* allow shutdown command */
+    uint64_t migration_rate; /* bytes/sec cap on split and merge migration, 0 for none */
+    uint64_t capacity_weight; /* share of the keyspace a join gives us, 0 to use -m */
+    int replicas;           /* adjacent zones that mirror our writes */
+    uint64_t near_cache;    /* bytes of remote values kept at this node, 0 for none */
+    int near_cache_ttl;     /* seconds a near-cached value is served */
+    bool redirect;          /* answer MOVED instead of forwarding to the owner */
+    char *node_host;        /* host other nodes and clients reach us at */
+    bool lazy_join;         /* serve our zone as soon as we join, keys follow */
 };
 
 extern struct stats stats;
@@ -333,6 +352,8 @@ extern struct settings settings;
 #define ITEM_SLABBED 4
 
 #define ITEM_FETCHED 8
+/* malloc'd outside the slabs, see item_copy_unslabbed() */
+#define ITEM_UNSLABBED 16
 
 /**
  * Structure for storing items within memcached.
@@ -349,6 +370,8 @@ typedef struct _stritem {
     uint8_t         it_flags;   /* ITEM_* above */
     uint8_t         slabs_clsid;/* which slab class we're in */
     uint8_t         nkey;       /* key length, w/terminating null and padding */
+    uint16_t        cell;       /* grid cell of the key's point */
+    uint32_t        cell_pos;   /* slot in the cell's index, fits the padding */
     /* this odd type prevents type-punning issues when we do
      * the little shuffle to save space when not using CAS. */
     union {
@@ -371,6 +394,7 @@ typedef struct {
     struct conn_queue *new_conn_queue; /* queue of new connections to handle */
     cache_t *suffix_cache;      /* suffix cache */
     uint8_t item_lock_type;     /* use fine-grained or global item lock */
+    unsigned int read_turn;     /* spreads reads over a zone's replicas */
 } LIBEVENT_THREAD;
 
 typedef struct {
@@ -436,6 +460,12 @@ struct conn {
     item   **icurr;
     int    ileft;
 
+    /* data for the forwarding state */
+    int    forwards;       /* requests sent to neighbours and not answered yet */
+    int    forward_status; /* reply status of a single forwarded request */
+    void   (*forwarded)(conn *c); /* completes the command once forwards is 0 */
+    struct bin_get_batch *bin_gets; /* binary gets sent to other nodes, not answered yet */
+
     char   **suffixlist;
     int    suffixsize;
     char   **suffixcurr;
@@ -462,6 +492,7 @@ struct conn {
     /* Binary protocol stuff */
     /* This is where the binary header goes */
     protocol_binary_request_header binary_header;
+    protocol_node_header node_header; /* header of the current node_prot request */
     uint64_t cas; /* the cas to return */
     short cmd; /* current command being processed */
     int opaque;
@@ -527,8 +558,7 @@ static inline int mutex_lock(pthread_mutex_t *mutex)
 void thread_init(int nthreads, struct event_base *main_base,
     void *(*join_request_listener_thread_routine)(void *),
     void *(*joining_thread_routine)(void *),
-    void *(*node_removal_listener_thread_routine)(void *),
-    void *(*node_propagation_thread_routine)(void *)
+    void *(*node_removal_listener_thread_routine)(void *)
     );
 int  dispatch_event_add(int thread, conn *c);
 void dispatch_conn_new(int sfd, enum conn_states init_state, int event_flags, int read_buffer_size, enum network_transport transport);
@@ -563,6 +593,9 @@ void *item_trylock(uint32_t hv);
 void item_trylock_unlock(void *arg);
 void item_unlock(uint32_t hv);
 void switch_item_lock_type(enum item_lock_types type);
+void item_lock_granular_thread(void);
+void notify_neighbour_pools(void);
+void neighbour_pool_sync(void);
 unsigned short refcount_incr(unsigned short *refcount);
 unsigned short refcount_decr(unsigned short *refcount);
 void STATS_LOCK(void);
@@ -611,19 +644,24 @@ ZoneBoundary world_boundary,client_boundary, my_new_boundary,parent,NULL_BOUNDAR
 typedef struct tagList{
     char name[32];
     int size;
+    int capacity;
     char **array;
 }my_list;
 
+/* A node's ports are named by the "host:port" other nodes reach them at */
+#define NODE_ADDR_LEN 64
+
 typedef struct tag_node_info{
 	ZoneBoundary boundary;
-    char join_request[10];
-    char request_propogation[10];
-    char node_removal[10];
+    char join_request[NODE_ADDR_LEN];
+    char request_propogation[NODE_ADDR_LEN];
+    char node_removal[NODE_ADDR_LEN];
 
 }node_info;
-node_info me, neighbour[10],NULL_NODE_INFO;
+node_info me, *neighbour,NULL_NODE_INFO;
+/* number of entries in neighbour, the table grows as zones are split */
+int neighbour_slots;
 
-pthread_mutex_t list_of_keys_lock ;
 pthread_t join_request_listening_thread;
 
 
@@ -634,7 +672,3 @@ void *(*function2)(void *);
 } function_pointer;
 function_pointer *fp;
 
-//protocol commands
-#define ADD_NEIGHBOUR_COMMAND "ADD_NEIGHBOUR"
-#define REMOVE_NEIGHBOUR_COMMAND "REMOVE_NEIGHBOUR"
-#define UPDATE_NEIGHBOUR_COMMAND "UPDATE_NEIGHBOUR"
@@ -70,7 +70,8 @@ extern "C"
         PROTOCOL_BINARY_RESPONSE_AUTH_ERROR = 0x20,
         PROTOCOL_BINARY_RESPONSE_AUTH_CONTINUE = 0x21,
         PROTOCOL_BINARY_RESPONSE_UNKNOWN_COMMAND = 0x81,
-        PROTOCOL_BINARY_RESPONSE_ENOMEM = 0x82
+        PROTOCOL_BINARY_RESPONSE_ENOMEM = 0x82,
+        PROTOCOL_BINARY_RESPONSE_ETMPFAIL = 0x86
     } protocol_binary_response_status;
 
     /**
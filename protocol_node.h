@@ -0,0 +1,139 @@
+/*
+ * Summary: Constants and packet format of the protocol spoken between the
+ *          nodes of a cluster and the bootstrap.
+ *
+ * Every message is a fixed size header followed by the key and then the
+ * value, so a receiver always knows how many bytes belong to a message and
+ * requests can be written back to back on one connection. The layout is
+ * modelled on the binary protocol (see protocol_binary.h).
+ */
+
+#ifndef PROTOCOL_NODE_H
+#define PROTOCOL_NODE_H
+
+/**
+ * Please note that you _MUST_ remember to convert each multibyte field to /
+ * from network byte order to / from host order.
+ */
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /**
+     * Definition of the legal "magic" values used in a packet. They are
+     * chosen so they can't be mistaken for an ascii or binary client.
+     */
+    typedef enum {
+        PROTOCOL_NODE_REQ = 0x90,
+        PROTOCOL_NODE_RES = 0x91
+    } protocol_node_magic;
+
+    /**
+     * Definition of the valid response status numbers.
+     */
+    typedef enum {
+        PROTOCOL_NODE_RESPONSE_SUCCESS = 0x00,
+        PROTOCOL_NODE_RESPONSE_KEY_ENOENT = 0x01,
+        PROTOCOL_NODE_RESPONSE_KEY_EEXISTS = 0x02,
+        PROTOCOL_NODE_RESPONSE_EINVAL = 0x04,
+        PROTOCOL_NODE_RESPONSE_NOT_STORED = 0x05,
+        PROTOCOL_NODE_RESPONSE_DELTA_BADVAL = 0x06,
+        PROTOCOL_NODE_RESPONSE_UNKNOWN_COMMAND = 0x81,
+        PROTOCOL_NODE_RESPONSE_ENOMEM = 0x82,
+        PROTOCOL_NODE_RESPONSE_ETMPFAIL = 0x86
+    } protocol_node_response_status;
+
+    /**
+     * Definition of the different command opcodes.
+     */
+    typedef enum {
+        /* Key operations forwarded to the owner of a key */
+        PROTOCOL_NODE_CMD_GET = 0x00,
+        PROTOCOL_NODE_CMD_SET = 0x01,
+        PROTOCOL_NODE_CMD_DELETE = 0x04,
+        PROTOCOL_NODE_CMD_NOOP = 0x0a,
+        /* Quiet get, only hits are answered; a NOOP ends a batch of them */
+        PROTOCOL_NODE_CMD_GETKQ = 0x0d,
+        /* Conditional stores carry the item like a SET; CAS checks its cas */
+        PROTOCOL_NODE_CMD_ADD = 0x02,
+        PROTOCOL_NODE_CMD_REPLACE = 0x03,
+        PROTOCOL_NODE_CMD_APPEND = 0x0e,
+        PROTOCOL_NODE_CMD_PREPEND = 0x0f,
+        PROTOCOL_NODE_CMD_CAS = 0x20,
+        /*
+         * The value is the delta and the initial value, 8 bytes each. The
+         * key is created with the initial value unless exptime is
+         * 0xffffffff; a hit is answered with the new value in text.
+         */
+        PROTOCOL_NODE_CMD_INCREMENT = 0x05,
+        PROTOCOL_NODE_CMD_DECREMENT = 0x06,
+        /* Sets the exptime of the key, a hit is answered with the item */
+        PROTOCOL_NODE_CMD_TOUCH = 0x1c,
+
+        /* Neighbour table maintenance, the value is a serialized node_info */
+        PROTOCOL_NODE_CMD_ADD_NEIGHBOUR = 0x40,
+        PROTOCOL_NODE_CMD_REMOVE_NEIGHBOUR = 0x41,
+        PROTOCOL_NODE_CMD_UPDATE_NEIGHBOUR = 0x42,
+
+        /* Join, removal and bootstrap handshakes */
+        PROTOCOL_NODE_CMD_BOUNDARY = 0x50,
+        PROTOCOL_NODE_CMD_PORTS = 0x51,
+        PROTOCOL_NODE_CMD_NODE_INFO = 0x52,
+        PROTOCOL_NODE_CMD_JOIN_TARGET = 0x53,
+        /* Version of the bootstrap's zone map, followed by NODE_INFO entries */
+        PROTOCOL_NODE_CMD_ZONE_MAP = 0x54,
+        /* Capacity weight of a joining node, sent before its parent splits */
+        PROTOCOL_NODE_CMD_CAPACITY = 0x55,
+
+        /* Key migration during split and merge */
+        PROTOCOL_NODE_CMD_MIGRATE = 0x60,
+
+        /* An owner's writes mirrored to its replicas; these are never answered */
+        PROTOCOL_NODE_CMD_REPLICA_SET = 0x62,
+        PROTOCOL_NODE_CMD_REPLICA_DELETE = 0x63,
+        /* Drops a near-cached copy of the key; never answered */
+        PROTOCOL_NODE_CMD_INVALIDATE = 0x64,
+        /* The giving node's copy of a moving key, or its absence; never answered */
+        PROTOCOL_NODE_CMD_HANDOFF_SET = 0x65,
+        PROTOCOL_NODE_CMD_HANDOFF_DELETE = 0x66,
+
+        /* Terminates a stream of NODE_INFO or MIGRATE messages. The receiver
+         * of a MIGRATE stream answers END once it has taken over the zone. */
+        PROTOCOL_NODE_CMD_END = 0x6f
+    } protocol_node_command;
+
+    /**
+     * Definition of the header structure for a request or response packet.
+     * The key (keylen bytes) and the value (vallen bytes) follow the header.
+     * exptime follows the text protocol: seconds relative to now, or an
+     * absolute unix time when larger than 30 days.
+     *
+     * A reply to a conditional store or an arithmetic command carries the
+     * new cas of the item.
+     *
+     * In a GET or GETKQ request, nonzero flags means the sender keeps a
+     * near-cache copy of the value; the value is the sender's propagation
+     * address. A hit with reserved set means the responder will send that
+     * address an INVALIDATE when the key changes.
+     */
+    typedef union {
+        struct {
+            uint8_t magic;
+            uint8_t opcode;
+            uint16_t keylen;
+            uint16_t status;
+            uint16_t reserved;
+            uint32_t opaque;
+            uint32_t vallen;
+            uint32_t flags;
+            uint32_t exptime;
+            uint64_t cas;
+        } request;
+        uint8_t bytes[32];
+    } protocol_node_header;
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* PROTOCOL_NODE_H */
@@ -0,0 +1,123 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use Test::More tests => 12;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+# Binary requests reach the node owning the key, and pipelined quiet gets
+# are batched per owner and answered before the NOOP that closes them.
+
+use constant REQ_MAGIC   => 0x80;
+use constant RES_MAGIC   => 0x81;
+use constant CMD_GET     => 0x00;
+use constant CMD_SET     => 0x01;
+use constant CMD_DELETE  => 0x04;
+use constant CMD_GETQ    => 0x09;
+use constant CMD_NOOP    => 0x0A;
+use constant CMD_GETKQ   => 0x0D;
+use constant PKT_FMT     => "CCnCCnNNNN";
+
+my $keys = 200;
+
+sub bin_request {
+    my ($opcode, $opaque, $key, $extra, $value) = @_;
+    $extra = '' unless defined $extra;
+    $value = '' unless defined $value;
+    return pack(PKT_FMT, REQ_MAGIC, $opcode, length($key), length($extra), 0, 0,
+                length($extra) + length($key) + length($value), $opaque, 0, 0) .
+        $extra . $key . $value;
+}
+
+# Returns (opcode, status, opaque, key, value) of the next response on $sock.
+sub bin_response {
+    my $sock = shift;
+    my ($hdr, $body) = ('', '');
+    while (length($hdr) < 24) {
+        return () unless sysread($sock, $hdr, 24 - length($hdr), length($hdr));
+    }
+    my ($magic, $opcode, $keylen, $extlen, undef, $status, $bodylen, $opaque) =
+        unpack(PKT_FMT, $hdr);
+    while (length($body) < $bodylen) {
+        return () unless sysread($sock, $body, $bodylen - length($body), length($body));
+    }
+    return ($opcode, $status, $opaque, substr($body, $extlen, $keylen),
+            substr($body, $extlen + $keylen));
+}
+
+my $bootstrap = new_bootstrap();
+my @nodes = map { new_node($_) } (1 .. 3);
+my $sock = $nodes[0]->new_sock;
+
+my $stored = 0;
+for (1 .. $keys) {
+    print $sock bin_request(CMD_SET, $_, "bkey$_", pack("NN", 0, 0), "bvalue$_");
+    my ($opcode, $status, $opaque) = bin_response($sock);
+    $stored++ if $opcode == CMD_SET && $status == 0 && $opaque == $_;
+}
+is($stored, $keys, "binary sets answered");
+
+# mem_stats() reads into $_, so no map over the nodes
+my (@items, $total);
+for my $n (@nodes) {
+    push @items, mem_stats($n->sock)->{curr_items};
+    $total += $items[-1];
+}
+is($total, $keys, "each key stored once");
+ok((grep { $_ > 0 } @items) > 1, "keys spread over the zones: @items");
+
+# GETKQ for every key and as many misses, then a NOOP, in one write
+my $batch = '';
+$batch .= bin_request(CMD_GETKQ, $_, "bkey$_") . bin_request(CMD_GETKQ, 0, "bmiss$_")
+    for (1 .. $keys);
+$batch .= bin_request(CMD_NOOP, 9999, "");
+print $sock $batch;
+
+# local hits go out first, forwarded ones with their owner's batch
+my ($hits, $noop, %seen) = (0, 0);
+while (my ($opcode, $status, $opaque, $key, $value) = bin_response($sock)) {
+    if ($opcode == CMD_NOOP) {
+        $noop = $opaque == 9999;
+        last;
+    }
+    $hits++ if $status == 0 && $key eq "bkey$opaque" && $value eq "bvalue$opaque";
+    $seen{$opaque}++;
+}
+is($hits, $keys, "GETKQ hits, wherever the key lives");
+is(scalar(grep { $_ > 1 } values %seen), 0, "GETKQ hits answered once");
+ok($noop, "NOOP answered after the batch");
+
+# GETQ from another node, the misses stay quiet
+$sock = $nodes[2]->new_sock;
+$batch = '';
+$batch .= bin_request(CMD_GETQ, $_, "bkey$_") for (1 .. $keys);
+$batch .= bin_request(CMD_GETQ, $keys + 1, "bmiss");
+$batch .= bin_request(CMD_NOOP, 9999, "");
+print $sock $batch;
+
+($hits, $noop) = (0, 0);
+my $misses = 0;
+while (my ($opcode, $status, $opaque, $key, $value) = bin_response($sock)) {
+    if ($opcode == CMD_NOOP) {
+        $noop = $opaque == 9999;
+        last;
+    }
+    $hits++ if $status == 0 && $key eq "" && $value eq "bvalue$opaque";
+    $misses++ if $opaque > $keys;
+}
+is($hits, $keys, "GETQ hits");
+is($misses, 0, "GETQ misses not answered");
+ok($noop, "NOOP answered after the batch");
+
+# a delete through one node is seen through the others
+print $sock bin_request(CMD_DELETE, 1, "bkey1");
+my ($opcode, $status) = bin_response($sock);
+is($status, 0, "deleted bkey1");
+for my $n (@nodes[0, 1]) {
+    my $s = $n->new_sock;
+    print $s bin_request(CMD_GET, 2, "bkey1");
+    ($opcode, $status) = bin_response($s);
+    is($status, 1, "bkey1 gone on port " . $n->port);
+}
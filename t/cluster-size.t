@@ -0,0 +1,70 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use Test::More tests => 19;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+# A cluster isn't bounded by the ten nodes the bootstrap and the forwarding
+# layer once had room for: the zone map lists every node, the zones tile
+# the world, and a multiget spanning every owner gets all its hits.
+
+my $count = 14;
+my $keys = 600;
+
+my $bootstrap = new_bootstrap();
+my @nodes = (new_node(1));
+my ($world) = zone_map();
+push @nodes, new_node($_) for (2 .. $count);
+
+sub area {
+    my $z = shift;
+    return ($z->{to_x} - $z->{from_x}) * ($z->{to_y} - $z->{from_y});
+}
+
+my @zones = zone_map();
+is(scalar @zones, $count, "zone map lists all $count nodes");
+my %clients = map { $_->{client} => 1 } @zones;
+is(scalar keys %clients, $count, "one zone per node");
+
+my $total = 0;
+$total += area($_) for @zones;
+ok(abs($total - area($world)) < 1e-3, "zones cover the world");
+
+my $overlaps = 0;
+for my $i (0 .. $#zones) {
+    for my $j ($i + 1 .. $#zones) {
+        my ($a, $b) = ($zones[$i], $zones[$j]);
+        $overlaps++ if $a->{from_x} < $b->{to_x} && $b->{from_x} < $a->{to_x} &&
+                       $a->{from_y} < $b->{to_y} && $b->{from_y} < $a->{to_y};
+    }
+}
+is($overlaps, 0, "zones don't overlap");
+
+my $sock = $nodes[0]->sock;
+for (1 .. $keys) {
+    print $sock "set ckey$_ 0 0 " . length("cvalue$_") . "\r\ncvalue$_\r\n";
+    <$sock>;
+}
+my @items;
+for my $n (@nodes) {
+    push @items, mem_stats($n->sock)->{curr_items};
+}
+ok((grep { $_ > 0 } @items) > 10, "keys spread over more than ten zones: @items");
+
+# every node asks every owner in one multiget
+my $get = "get " . join(" ", map { "ckey$_" } (1 .. $keys)) . "\r\n";
+for my $n (@nodes) {
+    $sock = $n->sock;
+    print $sock $get;
+    my $hits = 0;
+    while (my $line = <$sock>) {
+        last if $line eq "END\r\n";
+        my ($key) = $line =~ /^VALUE ckey(\d+)/;
+        my $value = <$sock>;
+        $hits++ if defined $key && $value eq "cvalue$key\r\n";
+    }
+    is($hits, $keys, "multiget through port " . $n->port . " hits every owner");
+}
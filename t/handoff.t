@@ -0,0 +1,112 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use Test::More tests => 10;
+use POSIX ();
+use File::Temp qw(tempdir);
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+# Every set acknowledged while a node joins can be read back afterwards,
+# from every node, whether the joining node takes its keys before serving
+# its zone or lazily after.
+
+my $writers = 4;
+my $keys = 1000;    # per writer
+my $dir = tempdir(CLEANUP => 1);
+
+# Sets hkey<writer>_<n> round after round until $deadline, through $port,
+# and leaves the last value acknowledged for each key in $dir/<writer>.
+sub writer {
+    my ($id, $port, $deadline) = @_;
+    my $sock = IO::Socket::INET->new(PeerAddr => "127.0.0.1:$port");
+    my (%acked, $errors);
+    for (my $round = 0; time() < $deadline; $round++) {
+        for (1 .. $keys) {
+            my $value = "r${round}_$_";
+            print $sock "set hkey${id}_$_ 0 0 " . length($value) . "\r\n$value\r\n";
+            my $line = <$sock>;
+            if (defined $line && $line eq "STORED\r\n") {
+                $acked{"hkey${id}_$_"} = $value;
+            } else {
+                $errors++;
+            }
+        }
+    }
+    open my $out, '>', "$dir/$id" or POSIX::_exit(1);
+    print $out "$_ $acked{$_}\n" for keys %acked;
+    print $out "errors $errors\n" if $errors;
+    close $out;
+    # skip the destructors, which would stop the servers
+    POSIX::_exit(0);
+}
+
+# Joins node number $count with $args while the writers run; returns the
+# new node and the values they had acknowledged.
+sub join_during_writes {
+    my ($nodes, $count, $args) = @_;
+    my $deadline = time() + 6;
+    my @pids;
+    for my $id (1 .. $writers) {
+        my $pid = fork();
+        writer($id, $nodes->[$id % @$nodes]->port, $deadline) unless $pid;
+        push @pids, $pid;
+    }
+    sleep(1);
+    my $node = new_node($count, $args);
+    waitpid($_, 0) for @pids;
+
+    my %acked;
+    my $errors = 0;
+    for my $id (1 .. $writers) {
+        open my $in, '<', "$dir/$id" or next;
+        while (<$in>) {
+            my ($key, $value) = split;
+            if ($key eq 'errors') {
+                $errors += $value;
+            } else {
+                $acked{$key} = $value;
+            }
+        }
+    }
+    is($errors, 0, "no set failed during join $count");
+    return ($node, \%acked);
+}
+
+# Number of $acked keys that don't read back as acknowledged through $sock.
+sub count_lost {
+    my ($sock, $acked) = @_;
+    my @keys = sort keys %$acked;
+    my $lost = 0;
+    while (my @batch = splice(@keys, 0, 100)) {
+        my %got;
+        print $sock "get @batch\r\n";
+        while (my $line = <$sock>) {
+            last if $line eq "END\r\n";
+            my ($key) = $line =~ /^VALUE (\S+)/;
+            my $value = <$sock>;
+            $value =~ s/\r\n$//;
+            $got{$key} = $value;
+        }
+        for (@batch) {
+            $lost++ unless defined $got{$_} && $got{$_} eq $acked->{$_};
+        }
+    }
+    return $lost;
+}
+
+my $bootstrap = new_bootstrap();
+my @nodes = (new_node(1), new_node(2));
+
+my ($node, $acked) = join_during_writes(\@nodes, 3);
+push @nodes, $node;
+is(scalar keys %$acked, $writers * $keys, "every key acknowledged");
+is(count_lost($_->sock, $acked), 0, "no acknowledged set lost, port " . $_->port)
+    for @nodes;
+
+($node, $acked) = join_during_writes(\@nodes, 4, "-o lazy_join");
+push @nodes, $node;
+is(count_lost($_->sock, $acked), 0, "no acknowledged set lost, lazy join, port " . $_->port)
+    for @nodes;
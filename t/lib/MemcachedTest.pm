@@ -13,7 +13,11 @@ my $builddir = getcwd;
 
 
 @EXPORT = qw(new_memcached sleep mem_get_is mem_gets mem_gets_is mem_stats
-             supports_sasl free_port);
+             supports_sasl free_port new_bootstrap new_node zone_map);
+
+# Fixed in bootstrap.c; nodes join on the first, the zone map is served on the last.
+use constant BOOTSTRAP_JOIN_PORT => 11311;
+use constant BOOTSTRAP_ZONE_MAP_PORT => 11314;
 
 sub sleep {
     my $n = shift;
@@ -149,7 +153,7 @@ sub supports_sasl {
 }
 
 sub new_memcached {
-    my ($args, $passed_port) = @_;
+    my ($args, $passed_port, $quiet) = @_;
     my $port = $passed_port || free_port();
     my $host = '127.0.0.1';
 
@@ -180,6 +184,11 @@ sub new_memcached {
     croak("memcached binary not executable\n") unless -x _;
 
     unless ($childpid) {
+        # cluster nodes log every join and split
+        if ($quiet) {
+            open STDOUT, '>', '/dev/null';
+            open STDERR, '>', '/dev/null';
+        }
         exec "$builddir/timedrun 600 $exe $args";
         exit; # never gets here.
     }
@@ -215,6 +224,87 @@ sub new_memcached {
     croak("Failed to startup/connect to memcached server.");
 }
 
+# Starts the bootstrap that new_node() joins; there is one per host, as its
+# ports are fixed.
+sub new_bootstrap {
+    my $exe = "$builddir/bootstrap";
+    croak("bootstrap binary doesn't exist.  Haven't run 'make' ?\n") unless -e $exe;
+
+    my $childpid = fork();
+    unless ($childpid) {
+        open STDOUT, '>', '/dev/null';
+        open STDERR, '>', '/dev/null';
+        exec "$builddir/timedrun 600 $exe 127.0.0.1";
+        exit; # never gets here.
+    }
+
+    for (1..20) {
+        my $conn = IO::Socket::INET->new(PeerAddr => "127.0.0.1:" . BOOTSTRAP_ZONE_MAP_PORT);
+        if ($conn) {
+            close $conn;
+            return Memcached::Handle->new(pid  => $childpid,
+                                          host => '127.0.0.1',
+                                          port => BOOTSTRAP_JOIN_PORT);
+        }
+        select undef, undef, undef, 0.10;
+    }
+    croak("Failed to startup/connect to bootstrap.");
+}
+
+# Reads one message of the node protocol (protocol_node.h) off $sock.
+# Returns the header fields by name, with the key and value.
+sub node_read_message {
+    my $sock = shift;
+    my ($hdr, $body) = ('', '');
+    while (length($hdr) < 32) {
+        return undef unless sysread($sock, $hdr, 32 - length($hdr), length($hdr));
+    }
+    my %m;
+    @m{qw(magic opcode keylen status reserved opaque vallen flags exptime)} =
+        unpack("CCnnnNNNN", $hdr);
+    while (length($body) < $m{keylen} + $m{vallen}) {
+        return undef unless sysread($sock, $body, $m{keylen} + $m{vallen} - length($body),
+                                    length($body));
+    }
+    $m{key} = substr($body, 0, $m{keylen});
+    $m{value} = substr($body, $m{keylen});
+    return \%m;
+}
+
+# Returns the zones the bootstrap knows of, as hashes of the node's
+# propagation address, its zone and the address its clients use.
+sub zone_map {
+    my $sock = IO::Socket::INET->new(PeerAddr => "127.0.0.1:" . BOOTSTRAP_ZONE_MAP_PORT)
+        or return ();
+    # we know no version yet, so every entry is sent
+    print $sock pack("CCnnnNNNNNN", 0x90, 0x54, 0, 0, 0, 0, 1, 0, 0, 0, 0) . "0";
+    my @zones;
+    while (my $m = node_read_message($sock)) {
+        last if $m->{opcode} == 0x6f;
+        next unless $m->{opcode} == 0x52;
+        my %z;
+        @z{qw(propagation from_x from_y to_x to_y client)} = $m->{value} =~
+            /^(\S+) \S+ \(([^,]+),([^)]+)\) to \(([^,]+),([^)]+)\) \d+ (\S+)/ or next;
+        push @zones, \%z;
+    }
+    return @zones;
+}
+
+# Starts a node that joins the bootstrap's cluster, and waits until it has
+# taken its zone, that is until the zone map lists all $nodes nodes.
+sub new_node {
+    my ($nodes, $args) = @_;
+    my $server = new_memcached("-J 127.0.0.1:" . BOOTSTRAP_JOIN_PORT . " " . ($args || ""),
+                               undef, 1);
+    for (1..100) {
+        my @zones = zone_map();
+        return $server if @zones == $nodes &&
+            grep { $_->{client} =~ /:$server->{port}$/ } @zones;
+        select undef, undef, undef, 0.10;
+    }
+    croak("Node on port $server->{port} didn't join the cluster.");
+}
+
 ############################################################################
 package Memcached::Handle;
 sub new {
@@ -0,0 +1,104 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use Test::More tests => 50;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+# Messages between nodes are framed (protocol_node.h), so requests can be
+# written back to back and split anywhere without losing their boundaries.
+
+use constant NODE_REQ    => 0x90;
+use constant NODE_RES    => 0x91;
+use constant CMD_GET     => 0x00;
+use constant CMD_SET     => 0x01;
+use constant CMD_DELETE  => 0x04;
+use constant CMD_NOOP    => 0x0a;
+use constant SUCCESS     => 0x00;
+use constant KEY_ENOENT  => 0x01;
+
+sub node_request {
+    my ($opcode, $opaque, $key, $value) = @_;
+    $value = '' unless defined $value;
+    return pack("CCnnnNNNNNN", NODE_REQ, $opcode, length($key), 0, 0, $opaque,
+                length($value), 0, 0, 0, 0) . $key . $value;
+}
+
+my $bootstrap = new_bootstrap();
+my $first = new_node(1);
+my $second = new_node(2);
+
+my ($zone) = grep { $_->{client} =~ /:$first->{port}$/ } zone_map();
+ok($zone, "first node is in the zone map");
+my $peer = IO::Socket::INET->new(PeerAddr => $zone->{propagation});
+ok($peer, "connected to the propagation port of the first node");
+
+# Twenty sets and twenty gets in one write, answered in order; keys the
+# first node doesn't own are forwarded to the second.
+my $batch = '';
+$batch .= node_request(CMD_SET, $_, "nkey$_", "nvalue$_") for (1..20);
+$batch .= node_request(CMD_GET, 100 + $_, "nkey$_") for (1..20);
+print $peer $batch;
+
+my ($sets, $gets) = (0, 0);
+for (1..20) {
+    my $m = MemcachedTest::node_read_message($peer);
+    $sets++ if $m && $m->{magic} == NODE_RES && $m->{opcode} == CMD_SET &&
+        $m->{opaque} == $_ && $m->{status} == SUCCESS;
+}
+is($sets, 20, "pipelined sets answered in order");
+for (1..20) {
+    my $m = MemcachedTest::node_read_message($peer);
+    $gets++ if $m && $m->{opcode} == CMD_GET && $m->{opaque} == 100 + $_ &&
+        $m->{status} == SUCCESS && $m->{value} eq "nvalue$_";
+}
+is($gets, 20, "pipelined gets answered in order");
+
+# a request arriving a byte at a time
+my $req = node_request(CMD_DELETE, 200, "nkey1");
+for my $i (0 .. length($req) - 1) {
+    print $peer substr($req, $i, 1);
+    $peer->flush;
+    sleep(0.01) if $i % 8 == 0;
+}
+my $m = MemcachedTest::node_read_message($peer);
+is($m->{opaque}, 200, "delete split across writes answered");
+is($m->{status}, SUCCESS, "delete found the key");
+
+# two requests and the start of a third in one write
+my $get = node_request(CMD_GET, 202, "nkey2");
+print $peer node_request(CMD_GET, 201, "nkey1") . node_request(CMD_NOOP, 0, "") .
+    substr($get, 0, 10);
+$peer->flush;
+sleep(0.1);
+print $peer substr($get, 10);
+$m = MemcachedTest::node_read_message($peer);
+is_deeply([$m->{opaque}, $m->{status}], [201, KEY_ENOENT], "deleted key is gone");
+$m = MemcachedTest::node_read_message($peer);
+is($m->{opcode}, CMD_NOOP, "noop answered");
+$m = MemcachedTest::node_read_message($peer);
+is_deeply([$m->{opaque}, $m->{value}], [202, "nvalue2"], "split request answered");
+
+# every node serves what was set through the node protocol
+my $sock = $second->sock;
+mem_get_is($sock, "nkey1", undef);
+mem_get_is($sock, "nkey$_", "nvalue$_") for (2..20);
+$sock = $first->sock;
+mem_get_is($sock, "nkey$_", "nvalue$_") for (2..20);
+
+# a value set already expired is gone at once, also where it was forwarded
+print $sock "set nkey$_ 0 -1 7\r\nexpired\r\n" for (2..20);
+<$sock> for (2..20);
+for my $node ($first, $second) {
+    my $s = $node->sock;
+    my $hits = 0;
+    print $s "get " . join(" ", map { "nkey$_" } (2..20)) . "\r\n";
+    while (my $line = <$s>) {
+        last if $line eq "END\r\n";
+        $hits++;
+        <$s>;
+    }
+    is($hits, 0, "expired sets miss through port " . $node->port);
+}
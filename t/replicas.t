@@ -0,0 +1,91 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use Test::More tests => 5;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+# With one replica every key lives on its owner and one neighbour. After a
+# join moves zones, nodes that no longer mirror a zone drop their copies of
+# it, and reads through any node, owner or replica, see the latest value.
+
+my $keys = 300;
+my $args = "-o replicas=1";
+
+my $bootstrap = new_bootstrap();
+my @nodes = (new_node(1, $args));
+push @nodes, new_node(2, $args);
+
+# Waits until every node's zone map lists all of them, so they know their replicas.
+sub wait_for_maps {
+    for (1 .. 50) {
+        my $known = 0;
+        for my $n (@nodes) {
+            my $map = mem_stats($n->sock, "cluster");
+            $known++ if (grep { /:/ } keys %$map) == @nodes;
+        }
+        return if $known == @nodes;
+        select undef, undef, undef, 0.2;
+    }
+}
+
+sub set_all {
+    my ($sock, $version) = @_;
+    for (1 .. $keys) {
+        print $sock "set rkey$_ 0 0 " . length("$version-$_") . "\r\n$version-$_\r\n";
+        <$sock>;
+    }
+}
+
+# Polls until the nodes together hold $want items, and returns the count.
+sub total_items {
+    my $want = shift;
+    my $total;
+    for (1 .. 50) {
+        $total = 0;
+        for my $n (@nodes) {
+            $total += mem_stats($n->sock)->{curr_items};
+        }
+        last if $total == $want;
+        select undef, undef, undef, 0.2;
+    }
+    return $total;
+}
+
+# Number of reads through $sock that don't answer "$version-<n>".
+sub stale_reads {
+    my ($sock, $version) = @_;
+    my $stale = 0;
+    for (my $i = 1; $i <= $keys; $i += 50) {
+        my %got;
+        print $sock "get " . join(" ", map { "rkey$_" } ($i .. $i + 49)) . "\r\n";
+        while (my $line = <$sock>) {
+            last if $line eq "END\r\n";
+            my ($key) = $line =~ /^VALUE (\S+)/;
+            my $value = <$sock>;
+            $value =~ s/\r\n$//;
+            $got{$key} = $value;
+        }
+        for ($i .. $i + 49) {
+            $stale++ unless defined $got{"rkey$_"} && $got{"rkey$_"} eq "$version-$_";
+        }
+    }
+    return $stale;
+}
+
+wait_for_maps();
+set_all($nodes[0]->sock, "v1");
+is(total_items(2 * $keys), 2 * $keys, "each key is on its owner and its replica");
+
+push @nodes, new_node(3, $args);
+wait_for_maps();
+set_all($nodes[0]->sock, "v2");
+is(total_items(2 * $keys), 2 * $keys, "copies of zones no longer mirrored are dropped");
+
+# reads take turns over the owner and its replica, so ask each node twice
+for my $n (@nodes) {
+    my $stale = stale_reads($n->sock, "v2") + stale_reads($n->sock, "v2");
+    is($stale, 0, "reads through port " . $n->port . " see the latest values");
+}
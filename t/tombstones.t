@@ -0,0 +1,87 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use Test::More tests => 8;
+use POSIX ();
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+# Keys deleted while their zone is handed to a joining node stay deleted,
+# and what a handoff settled doesn't leak into the next one.
+
+my $keys = 300;
+
+# Number of keys in $from..$to that read back as &$expect($i).
+sub count_matching {
+    my ($sock, $from, $to, $expect) = @_;
+    my $matching = 0;
+    for (my $i = $from; $i <= $to; $i += 50) {
+        my $last = $i + 49 > $to ? $to : $i + 49;
+        my %got;
+        print $sock "get " . join(" ", map { "tkey$_" } ($i .. $last)) . "\r\n";
+        while (my $line = <$sock>) {
+            last if $line eq "END\r\n";
+            my ($key) = $line =~ /^VALUE (\S+)/;
+            my $value = <$sock>;
+            $value =~ s/\r\n$//;
+            $got{$key} = $value;
+        }
+        for ($i .. $last) {
+            my $want = $expect->($_);
+            $matching++ if defined $want ? defined $got{"tkey$_"} && $got{"tkey$_"} eq $want
+                                         : !defined $got{"tkey$_"};
+        }
+    }
+    return $matching;
+}
+
+# Deletes tkey$from..$to through the node on $port while a node joins.
+sub delete_during_join {
+    my ($port, $from, $to, $nodes) = @_;
+    my $pid = fork();
+    unless ($pid) {
+        my $sock = IO::Socket::INET->new(PeerAddr => "127.0.0.1:$port");
+        for ($from .. $to) {
+            print $sock "delete tkey$_\r\n";
+            <$sock>;
+        }
+        # skip the destructors, which would stop the servers
+        POSIX::_exit(0);
+    }
+    my $node = new_node($nodes);
+    waitpid($pid, 0);
+    return $node;
+}
+
+my $bootstrap = new_bootstrap();
+my @nodes = (new_node(1));
+my $sock = $nodes[0]->sock;
+for (1 .. $keys) {
+    print $sock "set tkey$_ 0 0 " . length("first$_") . "\r\nfirst$_\r\n";
+    <$sock>;
+}
+is(count_matching($sock, 1, $keys, sub { "first$_[0]" }), $keys, "all keys stored");
+
+push @nodes, delete_during_join($nodes[0]->port, 1, $keys / 2, 2);
+for my $n (@nodes) {
+    is(count_matching($n->sock, 1, $keys, sub { $_[0] <= $keys / 2 ? undef : "first$_[0]" }),
+       $keys, "deletes during the first join hold on port " . $n->port);
+}
+
+# set again what was deleted, then delete the rest during the next join
+$sock = $nodes[1]->sock;
+for (1 .. $keys / 2) {
+    print $sock "set tkey$_ 0 0 " . length("again$_") . "\r\nagain$_\r\n";
+    <$sock>;
+}
+is(count_matching($sock, 1, $keys / 2, sub { "again$_[0]" }), $keys / 2, "deleted keys set again");
+
+push @nodes, delete_during_join($nodes[1]->port, $keys / 2 + 1, $keys, 3);
+for my $n (@nodes) {
+    is(count_matching($n->sock, 1, $keys / 2, sub { "again$_[0]" }), $keys / 2,
+       "keys set again survive the second join on port " . $n->port);
+}
+is(count_matching($nodes[2]->sock, $keys / 2 + 1, $keys, sub { undef }), $keys / 2,
+   "deletes during the second join hold");
@@ -0,0 +1,52 @@
+import re
+import sys
+import telnetlib
+
+# Loads keys through the first node and reports how evenly they were placed
+# across the cluster: per node key and byte counts, and max/mean skew.
+#
+# usage: python skew.py count value_size port [port ...]
+
+
+def set_key(node, key, value):
+    node.write(("set %s 0 0 %d\r\n%s\r\n" % (key, len(value), value)).encode())
+    reply = node.read_until("\r\n".encode()).decode()
+    assert reply == "STORED\r\n", "SET %s: %s" % (key, reply)
+
+
+def node_stats(node):
+    node.write("stats\r\n".encode())
+    lines = node.read_until("END\r\n".encode()).decode()
+    return dict(re.findall(r"STAT (\S+) (\S+)\r\n", lines))
+
+
+def skew(values):
+    mean = float(sum(values)) / len(values)
+    if mean == 0:
+        return 0.0
+    return max(values) / mean
+
+
+def main(count, value_size, ports):
+    nodes = [telnetlib.Telnet("localhost", port) for port in ports]
+    value = "v" * value_size
+    for i in range(count):
+        set_key(nodes[0], "skew%d" % i, value)
+
+    keys = []
+    bytes = []
+    print("%8s %10s %12s" % ("port", "keys", "bytes"))
+    for port, node in zip(ports, nodes):
+        stats = node_stats(node)
+        keys.append(int(stats["curr_items"]))
+        bytes.append(int(stats["bytes"]))
+        print("%8d %10d %12d" % (port, keys[-1], bytes[-1]))
+    print("key skew (max/mean): %.2f" % skew(keys))
+    print("byte skew (max/mean): %.2f" % skew(bytes))
+
+
+if __name__ == "__main__":
+    if len(sys.argv) < 4:
+        print("usage: %s count value_size port [port ...]" % sys.argv[0])
+        sys.exit(1)
+    main(int(sys.argv[1]), int(sys.argv[2]), [int(p) for p in sys.argv[3:]])
@@ -122,8 +122,7 @@ void item_unlock_global(void) {
 
 void item_lock(uint32_t hv) {
     uint8_t *lock_type = pthread_getspecific(item_lock_type_key);
-    if(lock_type) fprintf(stderr,"got lock type\n");
-    else {
+    if (lock_type == NULL) {
         fprintf(stderr,"did not get lock type\n");
         exit(-1);
     }
@@ -436,6 +435,24 @@ static void thread_libevent_process(int fd, short which, void *arg) {
     me->item_lock_type = ITEM_LOCK_GLOBAL;
     register_thread_initialized();
         break;
+    /* the neighbours changed, drop pooled connections to the ones we lost */
+    case 'n':
+    neighbour_pool_sync();
+        break;
+    }
+}
+
+/*
+ * Asks every worker thread to resync its neighbour pool now, instead of on
+ * its next forward, so requests parked on a lost node fail right away.
+ */
+void notify_neighbour_pools(void) {
+    char buf[1] = { 'n' };
+    int i;
+
+    for (i = 0; i < settings.num_threads; i++) {
+        if (write(threads[i].notify_send_fd, buf, 1) != 1)
+            perror("Failed writing to notify pipe");
     }
 }
 
@@ -767,6 +784,12 @@ void slab_stats_aggregate(struct thread_stats *stats, struct slab_stats *out) {
     }
 }
 
+/* Lets a thread of our own, not a worker, look up items. It locks granularly. */
+void item_lock_granular_thread(void) {
+    static uint8_t lock_type = ITEM_LOCK_GRANULAR;
+    pthread_setspecific(item_lock_type_key, &lock_type);
+}
+
 static void *(*static_joining_thread_routine)(void *) = NULL;
 
 static void *wrapper_routine_for_child(void *arg){
@@ -780,7 +803,6 @@ static void *wrapper_routine_for_child(void *arg){
 static pthread_t connect_and_split_thread;
 static pthread_t join_request_listener_thread;
 static pthread_t node_removal_listener_thread;
-static pthread_t node_propagation_listener_thread;
 static void connect_to_join_server(void *(*joining_thread_routine)(void *))
 {
     static_joining_thread_routine = joining_thread_routine;
@@ -805,18 +827,13 @@ static void start_listening_on_node_removal_port(void *(*node_removal_listener_t
 	pthread_create(&node_removal_listener_thread, 0,wrapper_routine_for_child, NULL);
 }
 
-static void start_listening_on_node_propagation_port(void *(*node_propagation_listener_thread_routine)(void *)){
-    static_joining_thread_routine = node_propagation_listener_thread_routine;
-	pthread_create(&node_propagation_listener_thread, 0,wrapper_routine_for_child, NULL);
-}
-
 /*
  * Initializes the thread subsystem, creating various worker threads.
  *
  * nthreads  Number of worker event handler threads to spawn
  * main_base Event base for main thread
  */
-void thread_init(int nthreads, struct event_base *main_base, void *(*join_request_listener_thread_routine)(void *), void *(*joining_thread_routine)(void *), void *(*node_removal_listener_thread_routine)(void *),void *(*node_propagation_thread_routine)(void *)) {
+void thread_init(int nthreads, struct event_base *main_base, void *(*join_request_listener_thread_routine)(void *), void *(*joining_thread_routine)(void *), void *(*node_removal_listener_thread_routine)(void *)) {
     int         i;
     int         power;
 
@@ -895,8 +912,6 @@ void thread_init(int nthreads, struct event_base *main_base, void *(*join_reques
     else
         start_listening_on_join_port(join_request_listener_thread_routine);
 
-    usleep(1000);
-    start_listening_on_node_propagation_port(node_propagation_thread_routine);
     usleep(1000);
     start_listening_on_node_removal_port(node_removal_listener_thread_routine);
 